@@ -8,10 +8,23 @@
 #include <time.h>
 
 #include "ap.h"
+#include "association.h"
+#include "beacon.h"
+#include "bridge.h"
+#include "coding.h"
+#include "credit.h"
 #include "dll_ethernet.h"
 #include "dll_wifi.h"
+#include "downlink.h"
+#include "dupcache.h"
+#include "fec.h"
+#include "fragment.h"
+#include "handoff.h"
 #include "mapping.h"
 #include "network.h"
+#include "packet_pool.h"
+#include "poll.h"
+#include "store.h"
 
 /// This enumerates the possible types of data link layers used by an AP.
 ///
@@ -21,7 +34,33 @@ enum dll_type {
   DLL_WIFI
 };
 
-static int AVAILABLE_FOR = 0;
+#define EV_BEACON EV_TIMER5
+#define BEACON_INTERVAL 102400   // Usecs between beacons (100 TU).
+#define LAN_BUNDLE_DEADLINE 20   // Usecs that a packet bridged to another AP may
+                                 // wait to share an Ethernet frame with others.
+
+// Counts of the packets that we unicast, flooded, and kept out of our cell.
+static int sentUnicast = 0;
+static int sentFlooded = 0;
+static int keptQuiet = 0;
+
+// The number of uplink frames that we left to another AP to bridge, and of
+// copies of packets that we had already forwarded.
+static int lostElection = 0;
+static int duplicatesSuppressed = 0;
+static int codedPairs = 0;
+
+// The signal strength (dBm) of the frame being read from a WiFi link.
+static double rx_signal = 0.0;
+
+// Our position, which our beacons carry to the mobiles.
+static CnetPosition position;
+
+// The timer that ends the current poll grant, or NULLTIMER if we are idle.
+static CnetTimerID poll_timer = NULLTIMER;
+
+// The timer that next releases queued downlink packets, or NULLTIMER.
+static CnetTimerID downlink_timer = NULLTIMER;
 
 /// This holds the data link layer type and state for a single link on an AP.
 ///
@@ -32,12 +71,18 @@ struct dll_state {
     struct dll_eth_state *ethernet;
     struct dll_wifi_state *wifi;
   } data;
+
+  // The largest packet that the link carries whole, found at reboot.
+  size_t mtu;
 };
 
 /// This holds the data link layer information for all links on this AP.
 ///
 static struct dll_state *dll_states = NULL;
 
+// The broadcast NIC address, parsed once at reboot.
+static CnetNICaddr broadcast;
+
 /// Called when we encounter a collision.
 ///
 static EVENT_HANDLER(collision) {
@@ -52,6 +97,7 @@ static EVENT_HANDLER(physical_ready) {
   char frame[DLL_MTU];
   size_t length	= sizeof(frame);
   int link;
+  double rx_angle;
 
   CHECK(CNET_read_physical(&link, frame, &length));
   
@@ -69,96 +115,609 @@ static EVENT_HANDLER(physical_ready) {
       break;
     
     case DLL_WIFI:
+      // Note how strongly we heard this frame, for the forwarding election.
+      if (CNET_wlan_arrival(link, &rx_signal, &rx_angle) != 0) rx_signal = -100.0;
       dll_wifi_read(dll_states[link].data.wifi, frame, length);		// If frame has arrived on the wifi link then pass to the wifi read.
       break;
   }
 }
 
+/// This holds the link and address that the fragments of a packet go to.
+///
+struct forward_target {
+  int link;
+  unsigned char *dest;
+};
+
+/// Called by nl_fragment with each fragment of a packet being forwarded.
+///
+static void write_fragment(pkt_handle fragment, void *context) {
+  const struct forward_target *target = context;
+  
+  switch (dll_states[target->link].type) {
+    case DLL_UNSUPPORTED:
+      break;
+    
+    case DLL_ETHERNET:
+      dll_eth_write_pkt(dll_states[target->link].data.ethernet, target->dest, fragment);
+      break;
+    
+    case DLL_WIFI:
+      dll_wifi_write_pkt(dll_states[target->link].data.wifi, target->dest, fragment,
+                         nl_packet_class(pkt_data(fragment), pkt_length(fragment)));
+      break;
+  }
+}
+
+/// Send the packet held in the given buffer to dest on the given link,
+/// splitting it into fragments if it is larger than the link's MTU. Each link
+/// prepends its own header in the buffer's headroom, so one buffer can be sent
+/// on several links without being copied. The caller keeps its reference.
+///
+static void send_on_link(int outlink, CnetNICaddr dest, pkt_handle packet) {
+  if (packet == PKT_NULL || dll_states[outlink].type == DLL_UNSUPPORTED)
+    return;	// If link is unsupported then discard packet.
+  
+  printf("\tSending on %s link %d\n",
+         dll_states[outlink].type == DLL_WIFI ? "WiFi" : "Ethernet", outlink);
+  
+  struct forward_target target = { .link = outlink, .dest = dest };
+  int fragments = nl_fragment(packet, dll_states[outlink].mtu,
+                              write_fragment, &target);
+  
+  if (fragments > 1)
+    printf("\tFragmented %u bytes into %d for MTU %zu on link %d\n",
+           (unsigned)pkt_length(packet), fragments, dll_states[outlink].mtu,
+           outlink);
+}
+
+/// Returns true iff each of our WiFi links has no more than DOWNLINK_BACKLOG
+/// frames waiting, so can take another from the downlink scheduler.
+///
+static bool cell_ready(void) {
+  for (int link = 1; link <= nodeinfo.nlinks; ++link) {
+    if (dll_states[link].type == DLL_WIFI &&
+        dll_wifi_queued(dll_states[link].data.wifi) >= DOWNLINK_BACKLOG)
+      return false;
+  }
+  return true;
+}
+
+/// Returns true iff the given queued frame holds a whole packet that can be
+/// coded, decoding its header into header.
+///
+static bool codable(const struct downlink_frame *frame, struct nl_header *header) {
+  if (!nl_decode_header(pkt_data(frame->packet), pkt_length(frame->packet), header))
+    return false;
+  if (header->type != DATA && header->type != ACK && header->type != NACK)
+    return false;
+  if (header->flags & NL_FLAG_FRAGMENT)
+    return false;
+  return nodeinfo.time_in_usec - frame->enqueued <= CODING_MAX_AGE;
+}
+
+/// This struct holds the frame that downlink_take() looks for a partner of.
+///
+struct coding_partner {
+  const struct downlink_frame *frame;
+  const struct nl_header *header;
+};
+
+/// Called by downlink_take() with each frame queued for the sender of the
+/// packet being coded: a partner was sent by that packet's destination, goes
+/// out on the same link, and fits into one frame with it. The coded frame is a
+/// broadcast at the base rate, so it must also take less airtime than the two
+/// packets would sent alone, each at the rate of its receiver.
+///
+static bool is_partner(const struct downlink_frame *frame, void *context) {
+  const struct coding_partner *partner = context;
+  struct nl_header header;
+  
+  if (frame->link != partner->frame->link || !codable(frame, &header))
+    return false;
+  if (header.src != partner->header->dest)
+    return false;
+  
+  size_t longer = pkt_length(frame->packet);
+  if (pkt_length(partner->frame->packet) > longer)
+    longer = pkt_length(partner->frame->packet);
+  size_t coded = NL_HEADER_LENGTH + CODING_PREFIX_LENGTH + longer;
+  if (coded > dll_states[frame->link].mtu)
+    return false;
+  
+  const struct dll_wifi_state *wifi = dll_states[frame->link].data.wifi;
+  return dll_wifi_airtime(wifi, broadcast, coded) <
+         dll_wifi_airtime(wifi, frame->nic, pkt_length(frame->packet)) +
+         dll_wifi_airtime(wifi, partner->frame->nic,
+                          pkt_length(partner->frame->packet));
+}
+
+/// Try to send the given frame coded with a packet going the other way, as
+/// one CODED broadcast. Returns false if no partner is queued, or none that
+/// saves airtime, leaving the frame to be sent alone. The caller keeps its reference.
+///
+static bool send_coded(const struct downlink_frame *frame) {
+  struct nl_header native;
+  if (!codable(frame, &native)) return false;
+  
+  struct coding_partner partner = { .frame = frame, .header = &native };
+  struct downlink_frame other;
+  if (!downlink_take(native.src, is_partner, &partner, &other)) return false;
+  
+  char packet[NL_HEADER_LENGTH + CODING_PREFIX_LENGTH + PKT_MAXDATA];
+  size_t length = coding_encode(frame->packet, native.dest,
+                                other.packet, native.src,
+                                packet + NL_HEADER_LENGTH);
+  
+  enum nl_class class = nl_packet_class(pkt_data(frame->packet),
+                                        pkt_length(frame->packet));
+  enum nl_class other_class = nl_packet_class(pkt_data(other.packet),
+                                              pkt_length(other.packet));
+  if (other_class > class) class = other_class;
+  
+  struct nl_header header = (struct nl_header) {
+    .src = nodeinfo.address,
+    .dest = ALLNODES,
+    .type = CODED,
+    .flags = class << NL_CLASS_SHIFT,
+    .length = length
+  };
+  nl_encode_header(&header, packet);
+  nl_seal(packet, NL_HEADER_LENGTH + length);
+  
+  pkt_handle handle = pkt_copy_in(packet, NL_HEADER_LENGTH + length);
+  if (handle == PKT_NULL) {
+    // Without a buffer for the coded packet, send the partner on its own.
+    dll_wifi_write_pkt(dll_states[other.link].data.wifi, other.nic, other.packet,
+                       other_class);
+    handoff_record(other.mobile, other.packet);
+    pkt_release(other.packet);
+    return false;
+  }
+  
+  printf("\tCoding packets for nodes %" PRId32 " and %" PRId32 " into one frame\n",
+         native.dest, native.src);
+  dll_wifi_write_pkt(dll_states[frame->link].data.wifi, broadcast, handle, class);
+  handoff_record(frame->mobile, frame->packet);
+  handoff_record(other.mobile, other.packet);
+  pkt_release(handle);
+  pkt_release(other.packet);
+  ++codedPairs;
+  return true;
+}
+
+/// Release queued downlink packets to our WiFi links, in the order that the
+/// scheduler chooses, while the links can take them. A packet that can be
+/// paired with one going the other way is sent coded with it, if that saves
+/// airtime. Packets left queued are tried again after DOWNLINK_TICK.
+///
+static void drain_downlink(void) {
+  struct downlink_frame frame;
+  
+  while (cell_ready() && downlink_dequeue(&frame)) {
+    if (!send_coded(&frame)) {
+      dll_wifi_write_pkt(dll_states[frame.link].data.wifi, frame.nic, frame.packet,
+                         nl_packet_class(pkt_data(frame.packet),
+                                         pkt_length(frame.packet)));
+      handoff_record(frame.mobile, frame.packet);
+    }
+    pkt_release(frame.packet);
+  }
+  
+  if (downlink_pending() && downlink_timer == NULLTIMER)
+    downlink_timer = CNET_start_timer(EV_DOWNLINK, DOWNLINK_TICK, 0);
+}
+
+/// Called when it is time to try to release queued downlink packets again.
+///
+static EVENT_HANDLER(downlink_tick) {
+  downlink_timer = NULLTIMER;
+  drain_downlink();
+}
+
+/// Queue the packet held in the given buffer for the given mobile, which we
+/// serve on the given WiFi link at mobile_nic, and release what the links can
+/// take. The caller keeps its reference.
+///
+static void send_downlink(CnetAddr mobile,
+                          int link,
+                          const CnetNICaddr mobile_nic,
+                          pkt_handle packet) {
+  CnetTime cost = dll_wifi_airtime(dll_states[link].data.wifi, mobile_nic,
+                                   pkt_length(packet));
+  
+  if (!downlink_enqueue(mobile, link, mobile_nic, packet, cost))
+    printf("\tDownlink queue for node %" PRId32 " full, dropping.\n", mobile);
+  drain_downlink();
+}
+
+/// Announce that we serve the mobile in the given entry to the other APs, by
+/// broadcasting an ASSOC packet on our Ethernet links.
+///
+static void announce(const struct assoc_entry *entry) {
+  if (entry == NULL) return;
+  
+  struct nl_header header = (struct nl_header) {
+    .src = nodeinfo.address,
+    .dest = ALLNODES,
+    .type = ASSOC,
+    .flags = NL_CLASS_CONTROL << NL_CLASS_SHIFT,
+    .length = ASSOC_PAYLOAD_LENGTH
+  };
+  char packet[NL_HEADER_LENGTH + ASSOC_PAYLOAD_LENGTH];
+  
+  nl_encode_header(&header, packet);
+  assoc_encode(entry, packet + NL_HEADER_LENGTH);
+  nl_seal(packet, sizeof(packet));
+  
+  pkt_handle handle = pkt_copy_in(packet, sizeof(packet));
+  if (handle == PKT_NULL) return;
+  
+  for (int outlink = 1; outlink <= nodeinfo.nlinks; ++outlink) {
+    if (dll_states[outlink].type == DLL_ETHERNET)
+      dll_eth_write_pkt(dll_states[outlink].data.ethernet, broadcast, handle);
+  }
+  pkt_release(handle);
+}
+
+/// Called by handoff_forward with each packet buffered for a mobile that has
+/// moved to another AP. The packet goes to the new AP over the LAN.
+///
+static void hand_over(pkt_handle packet, void *context) {
+  const struct forward_target *target = context;
+  
+  nl_fragment(packet, dll_states[target->link].mtu, write_fragment, context);
+}
+
+/// Called by store_flush with each packet held for a mobile that has come back
+/// within reach of our cell. The context is the mobile's association.
+///
+static void deliver(pkt_handle packet, void *context) {
+  const struct assoc_entry *entry = context;
+  
+  send_downlink(entry->mobile, entry->link, entry->mobile_nic, packet);
+}
+
+/// Called when we hear from the given mobile. If it is ours, then the packets
+/// that we held while it was out of reach are queued for it now.
+///
+static void reappeared(CnetAddr mobile) {
+  const struct assoc_entry *entry = assoc_lookup(mobile);
+  if (entry == NULL || entry->ap != nodeinfo.address) return;
+  
+  store_flush(mobile, deliver, (void *)entry);
+}
+
+/// Handle an ASSOC packet that another AP sent over the LAN from the NIC src.
+/// If it tells us that a mobile we served has moved to that AP, then the
+/// packets that we buffered or held for the mobile are handed over to the
+/// new AP.
+///
+static void associate(int link,
+                      const CnetNICaddr src,
+                      const char *payload,
+                      size_t length,
+                      CnetAddr ap) {
+  CnetAddr mobile;
+  CnetNICaddr mobile_nic;
+  double rssi;
+  bool chosen;
+  
+  if (!assoc_decode(payload, length, &mobile, mobile_nic, &rssi, &chosen))
+    return;
+  
+  // Note whether we served the mobile, and when we last heard it, before the
+  // announcement can take it from us.
+  const struct assoc_entry *entry = assoc_lookup(mobile);
+  bool served = (entry != NULL && entry->ap == nodeinfo.address);
+  CnetTime last_heard = served ? entry->heard : 0;
+  
+  assoc_announced(mobile, mobile_nic, ap, rssi, chosen);
+  
+  entry = assoc_lookup(mobile);
+  if (!served || entry == NULL || entry->ap == nodeinfo.address) return;
+  
+  CnetNICaddr new_ap;
+  memcpy(new_ap, src, sizeof(CnetNICaddr));
+  
+  struct forward_target target = { .link = link, .dest = new_ap };
+  // The packets that we sent lately go first, then those still queued, which
+  // must not now be sent into our cell, then those held while it was out of
+  // reach.
+  handoff_forward(mobile, last_heard, hand_over, &target);
+  downlink_forget(mobile, hand_over, &target);
+  store_flush(mobile, hand_over, &target);
+}
+
+/// Write the credits of our downlink queues into buf, which must hold
+/// CREDIT_MAX_LENGTH bytes, and return the number of bytes written.
+///
+static size_t encode_credits(char *buf) {
+  struct credit_grant grants[CREDIT_MAX];
+  int count = downlink_credits(grants, CREDIT_MAX);
+  return credit_encode(grants, count, buf);
+}
+
+/// Broadcast a beacon into our cell from each of our WiFi links, so that the
+/// mobiles in range can measure how well they hear us, and learn where we are.
+/// It carries the credits of our downlink queues.
+///
+static EVENT_HANDLER(beacon) {
+  char packet[NL_HEADER_LENGTH + BEACON_PAYLOAD_LENGTH + CREDIT_MAX_LENGTH];
+  char *payload = packet + NL_HEADER_LENGTH;
+
+  beacon_encode(&position, true, payload);
+  size_t length = BEACON_PAYLOAD_LENGTH +
+    encode_credits(payload + BEACON_PAYLOAD_LENGTH);
+
+  struct nl_header header = (struct nl_header) {
+    .src = nodeinfo.address,
+    .dest = ALLNODES,
+    .type = BEACON,
+    .flags = NL_CLASS_CONTROL << NL_CLASS_SHIFT,
+    .length = length
+  };
+  nl_encode_header(&header, packet);
+  nl_seal(packet, NL_HEADER_LENGTH + length);
+  
+  pkt_handle handle = pkt_copy_in(packet, NL_HEADER_LENGTH + length);
+  if (handle != PKT_NULL) {
+    for (int outlink = 1; outlink <= nodeinfo.nlinks; ++outlink) {
+      if (dll_states[outlink].type == DLL_WIFI)
+        dll_wifi_write_pkt(dll_states[outlink].data.wifi, broadcast, handle,
+                           NL_CLASS_CONTROL);
+    }
+    pkt_release(handle);
+  }
+  
+  CNET_start_timer(EV_BEACON, BEACON_INTERVAL, 0);
+}
+
+/// Grant the next mobile with a backlog a burst of frames, and time the grant.
+/// The grant carries fresh credits, for the frames that the mobile is about to
+/// send. If no mobile has a backlog, we are idle until one asks to be polled.
+///
+static void poll_mobile(void) {
+  const struct poll_entry *entry = poll_next();
+  if (entry == NULL) return;
+  
+  char packet[NL_HEADER_LENGTH + POLL_PAYLOAD_LENGTH + CREDIT_MAX_LENGTH];
+  char *payload = packet + NL_HEADER_LENGTH;
+
+  payload[0] = POLL_GRANT;
+  size_t length = POLL_PAYLOAD_LENGTH +
+    encode_credits(payload + POLL_PAYLOAD_LENGTH);
+
+  struct nl_header header = (struct nl_header) {
+    .src = nodeinfo.address,
+    .dest = entry->mobile,
+    .type = POLL,
+    .flags = NL_CLASS_CONTROL << NL_CLASS_SHIFT,
+    .length = length
+  };
+  nl_encode_header(&header, packet);
+  nl_seal(packet, NL_HEADER_LENGTH + length);
+  
+  CnetNICaddr mobile_nic;
+  memcpy(mobile_nic, entry->nic, sizeof(CnetNICaddr));
+  dll_wifi_write(dll_states[entry->link].data.wifi, mobile_nic,
+                 packet, NL_HEADER_LENGTH + length, NL_CLASS_CONTROL);
+  
+  poll_timer = CNET_start_timer(EV_POLL, (POLL_GRANT + 1) * POLL_SLOT, 0);
+}
+
+/// Called when a mobile has not ended its grant in time.
+///
+static EVENT_HANDLER(poll_timeout) {
+  poll_timer = NULLTIMER;
+  poll_expired();
+  poll_mobile();
+}
+
+/// Handle a POLL packet from a mobile that has chosen us, reporting its
+/// backlog. A report that ends a grant passes the turn on at once.
+///
+static void polled(int link,
+                   const CnetNICaddr src,
+                   const struct nl_header *packet,
+                   const char *payload) {
+  if (packet->length < POLL_PAYLOAD_LENGTH) return;
+  
+  int backlog = (unsigned char)payload[0];
+  bool done = poll_request(packet->src, link, src, backlog);
+  
+  if (done && poll_timer != NULLTIMER) {
+    CNET_stop_timer(poll_timer);
+    poll_timer = NULLTIMER;
+  }
+  if (poll_timer == NULLTIMER) poll_mobile();
+}
+
+/// Forward the packet with the given header, held in the given buffer, which
+/// arrived on link (from our cell iff uplink is true). The buffer is shared by
+/// every queue and link that the packet goes to; the caller keeps its
+/// reference.
+///
+static void forward(int link,
+                    bool uplink,
+                    const struct nl_header *packet,
+                    pkt_handle handle) {
+  const struct assoc_entry *assoc = assoc_lookup(packet->dest);
+  CnetNICaddr next_hop;
+  
+  // If we serve the destination, then it only needs to hear the packet from us.
+  // While it is out of reach the packet is held for it; otherwise it is
+  // queued, and kept once sent in case the mobile is leaving our cell.
+  if (assoc != NULL && assoc->ap == nodeinfo.address) {
+    if (store_unreachable(assoc->heard)) {
+      printf("\tNode %" PRId32 " is out of reach, holding packet.\n",
+             packet->dest);
+      store_hold(packet->dest, handle);
+      return;
+    }
+    
+    send_downlink(packet->dest, assoc->link, assoc->mobile_nic, handle);
+    ++sentUnicast;
+    return;
+  }
+  
+  // If another AP serves the destination, then only that AP needs the packet.
+  // The packets it sends us over the LAN are kept out of our cell.
+  if (assoc != NULL && !uplink) {
+    printf("\tNode %" PRId32 " is served by AP %" PRId32 ".\n",
+           packet->dest, assoc->ap);
+    ++keptQuiet;
+    return;
+  }
+  
+  // Otherwise the bridge table says where the destination (or the AP that
+  // serves it) was last heard from.
+  const struct bridge_entry *next = bridge_lookup(assoc != NULL ? assoc->ap
+                                                                 : packet->dest);
+  if (next != NULL && dll_states[next->link].type != DLL_UNSUPPORTED) {
+    // Every node on an Ethernet segment has already seen packets sent on it.
+    if (next->link == link && !uplink) {
+      ++keptQuiet;
+      return;
+    }
+    
+    memcpy(next_hop, next->nic, sizeof(CnetNICaddr));
+    send_on_link(next->link, next_hop, handle);
+    ++sentUnicast;
+    return;
+  }
+
+  // We don't know where the destination is, so we rebroadcast the packet on
+  // all of our links. If the packet came in on an Ethernet link, then don't
+  // rebroadcast on that because all other nodes have already seen it.
+  for (int outlink = 1; outlink <= nodeinfo.nlinks; ++outlink) {
+    if (dll_states[outlink].type == DLL_ETHERNET && outlink == link) continue;
+    send_on_link(outlink, broadcast, handle);
+  }
+  ++sentFlooded;
+}
+
+
 /// Called when we receive data from one of our data link layers.
 ///
-static void up_from_dll(int link, const char *data, size_t length) {
+static void up_from_dll(int link,
+                        const CnetNICaddr dest,
+                        const CnetNICaddr src,
+                        const char *data,
+                        size_t length) {
   // If frame is larger than a network packet discard.
-  if (length > sizeof(struct nl_packet)) {
+  if (length > NL_PACKET_MAXLENGTH) {
     printf("AP: %zu is larger than a nl_packet! ignoring.\n", length);
     return;
   }
   
-  // Treat this frame as a network layer packet.
-  const struct nl_packet *packet = (const struct nl_packet *)data;
+  // Decode the network layer header of this frame.
+  struct nl_header header;
+  if (!nl_decode_header(data, length, &header)) return;
+  const struct nl_header *packet = &header;
+  const char *payload = data + NL_HEADERS_LENGTH(header);
   
   printf("AP: Received frame on link %d from node %" PRId32
          " for node %" PRId32 ".\n", link, packet->src, packet->dest);
 
-  int RTS = strcmp("RTS", packet->data);
-  // If the packet is a RTS packet.
-  // The strcmp function does not work correctly you can put any word to cmp and it will come up as true!!, check fprintf below to see!. 
-  // fprintf(stdout, "STR COMPARE: node %d: data is %s\n", nodeinfo.address, packet->data);
-  if(RTS != 1  && AVAILABLE_FOR == 0) {
-    
-    // Create a CTS packet.
-    struct nl_packet cts = (struct nl_packet) {
-      .src = nodeinfo.address,
-      .length = 10
-    };
+  // Learn where the sender is from every intact packet, so that packets for
+  // it can be unicast.
+  bool valid = nl_verify(data, length);
+  if (valid) bridge_learn(packet->src, link, src);
 
-    // Copy our CTS data into our packet.
-    char src[10];
-    strcpy(cts.data, "CTS");
-    sprintf(src, "%d", packet->src);
-    strcat(cts.data, src);
-  
-    // Create a checksum.
-    cts.checksum = CNET_crc32((unsigned char *)&cts, sizeof(cts));
-    uint16_t cts_length = NL_PACKET_LENGTH(cts);
+  // A mobile that addresses its frames to our NIC has chosen us, whatever the
+  // election between APs says.
+  bool uplink = (dll_states[link].type == DLL_WIFI);
+  bool chosen = uplink &&
+                memcmp(dest, linkinfo[link].nicaddr, sizeof(CnetNICaddr)) == 0;
 
-    // Broadcast on all wifi links
-    CnetNICaddr broadcast;
-    CHECK(CNET_parse_nicaddr(broadcast, "ff:ff:ff:ff:ff:ff"));
+  // Associations are requested by mobiles and shared between APs, and go no
+  // further.
+  if (packet->type == ASSOC) {
+    if (valid && uplink) {
+      if (assoc_heard(packet->src, src, link, rx_signal, chosen))
+        announce(assoc_lookup(packet->src));
+      reappeared(packet->src);
+    } else if (valid) {
+      associate(link, src, payload, packet->length, packet->src);
+    }
+    return;
+  }
 
-    dll_wifi_write(dll_states[link].data.wifi, broadcast, (char *)&cts, cts_length);
-    AVAILABLE_FOR = 0;
-    fprintf(stdout, "Node %d is CTS. AP %d is not Available.\n", packet->src, nodeinfo.address); 
-    return;   
+  // Beacons from mobiles are for the mobiles around them, and CODED packets
+  // from other APs are for the mobiles in their cells.
+  if (packet->type == BEACON || packet->type == CODED) return;
+
+  // Learn the associations of mobiles from the uplink packets that we hear,
+  // and tell the other APs about them.
+  if (uplink && valid) {
+    if (assoc_heard(packet->src, src, link, rx_signal, chosen))
+      announce(assoc_lookup(packet->src));
+    reappeared(packet->src);
   }
-  else if (AVAILABLE_FOR != packet->src && RTS != 1)
-  {
-     fprintf(stdout, "Node %d is NOT CTS b/c AP %d is unavailable\n", packet->src, nodeinfo.address);
-     return;
+
+  // Polls schedule the mobiles in our cell, and go no further.
+  if (packet->type == POLL) {
+    if (valid && chosen) polled(link, src, packet, payload);
+    return;
   }
 
+  // Only the AP serving a mobile bridges its frames; the other APs that hear
+  // them stay quiet.
+  const struct assoc_entry *from = uplink ? assoc_lookup(packet->src) : NULL;
+  if (from != NULL && from->ap != nodeinfo.address) {
+    printf("\tNode %" PRId32 " is served by AP %" PRId32 ", not bridging.\n",
+           packet->src, from->ap);
+    ++lostElection;
+    return;
+  }
 
+  // Copies still get through while an election is being settled, so drop
+  // any packet that we have forwarded already from another link or AP.
+  if (dup_seen(packet, link, src)) {
+    printf("\tDuplicate of a packet already forwarded.\n");
+    ++duplicatesSuppressed;
+    return;
+  }
 
   fprintf(stdout, "Packet received from: %d\n", packet->src);
 
-  // We rebroadcast the packet on all of our links. If the packet came in on an
-  // Ethernet link, then don't rebroadcast on that because all other nodes have
-  // already seen it.
-  CnetNICaddr broadcast;
-  CHECK(CNET_parse_nicaddr(broadcast, "ff:ff:ff:ff:ff:ff"));
-  
-  for (int outlink = 1; outlink <= nodeinfo.nlinks; ++outlink) {
-    switch (dll_states[outlink].type) {
-      case DLL_UNSUPPORTED:
-        break;	// If link is unsupported then discard packet.
-      
-      case DLL_ETHERNET:
-        if (outlink == link) break; // If data has arrived on the ethernet link then discard the packet.
-        printf("\tSending on Ethernet link %d\n", outlink);
-        dll_eth_write(dll_states[outlink].data.ethernet,
-                      broadcast,
-                      data,
-                      length);	// Write the packet to the ethernet data link layer.
-        break;
-      
-      case DLL_WIFI:
-        printf("\tSending on WiFi link %d\n", outlink);
-        dll_wifi_write(dll_states[outlink].data.wifi,
-                       broadcast,
-                       data,
-                       length);	// Write the packet to the wifi data link layer.
-        break;
-    }
+  // The packet is copied into the pool once, however many links it goes to.
+  pkt_handle handle = pkt_copy_in(data, length);
+  if (handle == PKT_NULL) {
+    printf("\tNo buffers to forward the packet! dropping.\n");
+    return;
   }
+
+  forward(link, uplink, packet, handle);
+  pkt_release(handle);
+}
+
+/// Called when the simulation ends, to report how packets were forwarded.
+///
+static EVENT_HANDLER(shutdown) {
+  printf("AP %" PRId32 ": %d packets unicast, %d flooded, %d kept out of our cell.\n",
+         nodeinfo.address, sentUnicast, sentFlooded, keptQuiet);
+  printf("AP %" PRId32 ": %d uplink frames left to another AP, %d duplicates suppressed.\n",
+         nodeinfo.address, lostElection, duplicatesSuppressed);
+  printf("AP %" PRId32 ": %d pairs of packets sent coded.\n",
+         nodeinfo.address, codedPairs);
+  handoff_report();
+  store_report();
+  poll_report();
+  downlink_report();
+
+  for (int link = 1; link <= nodeinfo.nlinks; ++link) {
+    if (dll_states[link].type == DLL_WIFI)
+      dll_wifi_report(dll_states[link].data.wifi);
+    else if (dll_states[link].type == DLL_ETHERNET)
+      dll_eth_report(dll_states[link].data.ethernet);
+  }
+  
+#ifdef FEC_BENCHMARK
+  // Show what the parity coding of our WiFi frames costs this host.
+  fec_benchmark();
+#endif
 }
 
 /// Called when this access point is booted up.
@@ -167,9 +726,27 @@ void reboot_accesspoint() {
   // We require each node to have a different stream of random numbers.
   CNET_srand(nodeinfo.time_of_day.sec + nodeinfo.nodenumber);
   
+  // Preallocate this node's packet buffers.
+  pkt_pool_init();
+  assoc_init();
+  bridge_init();
+  dup_init();
+  handoff_init();
+  store_init();
+  poll_init();
+  poll_timer = NULLTIMER;
+  downlink_init();
+  downlink_timer = NULLTIMER;
+  CHECK(CNET_get_position(&position, NULL));
+  CHECK(CNET_parse_nicaddr(broadcast, "ff:ff:ff:ff:ff:ff"));
+  
   // Provide the required event handlers.
   CHECK(CNET_set_handler(EV_PHYSICALREADY, physical_ready, 0));
   CHECK(CNET_set_handler(EV_FRAMECOLLISION, collision, 0));
+  CHECK(CNET_set_handler(EV_SHUTDOWN, shutdown, 0));
+  CHECK(CNET_set_handler(EV_BEACON, beacon, 0));
+  CHECK(CNET_set_handler(EV_POLL, poll_timeout, 0));
+  CHECK(CNET_set_handler(EV_DOWNLINK, downlink_tick, 0));
 
   // Prepare to talk via our wireless connection.
   CHECK(CNET_set_wlan_model(my_WLAN_model));
@@ -190,6 +767,11 @@ void reboot_accesspoint() {
       case LT_LAN:
         dll_states[link].type = DLL_ETHERNET;	// Set the type to ethernet.
         dll_states[link].data.ethernet = dll_eth_new_state(link, up_from_dll);	// Create a new ethernet state.
+        dll_states[link].mtu = dll_eth_mtu(dll_states[link].data.ethernet);
+
+        // The packets that we bridge to the other APs share frames.
+        dll_eth_bundle(dll_states[link].data.ethernet, dll_states[link].mtu,
+                       LAN_BUNDLE_DEADLINE);
         break;
       
       case LT_WLAN:
@@ -197,7 +779,14 @@ void reboot_accesspoint() {
         dll_states[link].data.wifi = dll_wifi_new_state(link,
                                                         up_from_dll,
                                                         true /* is_ds */);	// Create a new wifi state.
+        dll_states[link].mtu = dll_wifi_mtu(dll_states[link].data.wifi);
+        dll_wifi_fec(dll_states[link].data.wifi, true);
+        dll_wifi_power_control(dll_states[link].data.wifi, true);
+        dll_wifi_rate_adaptation(dll_states[link].data.wifi, true);
         break;
     }
   }
+  
+  // Start beaconing once our links are set up.
+  CNET_start_timer(EV_BEACON, BEACON_INTERVAL, 0);
 }
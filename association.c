@@ -0,0 +1,156 @@
+/// This file implements the association table kept by each access point. The
+/// table is open addressed with linear probing, keyed by the mobile's address,
+/// so lookups are O(1) and nothing is allocated after reboot. Expired entries
+/// are left in place (they keep probe chains intact) and reused by the same
+/// mobile.
+
+#include "association.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+
+static struct assoc_entry table[ASSOC_TABLE_SIZE];
+
+/// Returns true iff the given entry has been confirmed within ASSOC_TIMEOUT.
+///
+static bool fresh(const struct assoc_entry *entry) {
+  return entry->used && nodeinfo.time_in_usec - entry->heard <= ASSOC_TIMEOUT;
+}
+
+/// Find the entry for the given mobile, claiming a free one if there is none.
+/// Returns NULL only if the table is full.
+///
+static struct assoc_entry *find(CnetAddr mobile, bool claim) {
+  size_t start = (uint32_t)mobile & (ASSOC_TABLE_SIZE - 1);
+
+  for (size_t i = 0; i < ASSOC_TABLE_SIZE; ++i) {
+    struct assoc_entry *entry = &table[(start + i) & (ASSOC_TABLE_SIZE - 1)];
+
+    if (entry->used && entry->mobile == mobile) return entry;
+    if (!entry->used) {
+      if (!claim) return NULL;
+
+      memset(entry, 0, sizeof(*entry));
+      entry->used = true;
+      entry->mobile = mobile;
+      entry->ap = ALLNODES;
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/// Clear the association table.
+///
+void assoc_init(void) {
+  memset(table, 0, sizeof(table));
+}
+
+/// Returns the current association of the given mobile.
+///
+const struct assoc_entry *assoc_lookup(CnetAddr mobile) {
+  const struct assoc_entry *entry = find(mobile, false);
+  return (entry != NULL && fresh(entry)) ? entry : NULL;
+}
+
+/// Record that we heard the given mobile on our WiFi link.
+///
+bool assoc_heard(CnetAddr mobile,
+                 const CnetNICaddr mobile_nic,
+                 int link,
+                 double rssi,
+                 bool chosen) {
+  struct assoc_entry *entry = find(mobile, true);
+  if (entry == NULL) return false;
+
+  memcpy(entry->mobile_nic, mobile_nic, sizeof(CnetNICaddr));
+
+  // Leave the mobile with another AP that it chose, or that hears it about as
+  // well as we do, unless it has now chosen us.
+  if (!chosen && fresh(entry) && entry->ap != nodeinfo.address &&
+      (entry->chosen || rssi <= entry->rssi + ASSOC_HYSTERESIS))
+    return false;
+
+  bool changed = (entry->ap != nodeinfo.address) || !fresh(entry) ||
+                 (chosen && !entry->chosen);
+
+  entry->ap = nodeinfo.address;
+  entry->link = link;
+  entry->heard = nodeinfo.time_in_usec;
+  entry->rssi = rssi;
+  entry->chosen = chosen;
+
+  if (changed) {
+    printf("ASSOC: mobile %" PRId32 " is now served by this AP.\n", mobile);
+  } else if (nodeinfo.time_in_usec - entry->announced < ASSOC_REFRESH) {
+    return false;
+  }
+
+  entry->announced = nodeinfo.time_in_usec;
+  return true;
+}
+
+/// Record an association announced by another AP.
+///
+void assoc_announced(CnetAddr mobile,
+                     const CnetNICaddr mobile_nic,
+                     CnetAddr ap,
+                     double rssi,
+                     bool chosen) {
+  struct assoc_entry *entry = find(mobile, true);
+  if (entry == NULL) return;
+
+  // Several APs claim a mobile that they all heard at once. The one that
+  // heard it most strongly wins, and the lower address breaks a tie, so every
+  // AP settles on the same winner.
+  if (!chosen && fresh(entry) && entry->ap == nodeinfo.address &&
+      (entry->chosen || entry->rssi > rssi ||
+       (entry->rssi == rssi && nodeinfo.address < ap)))
+    return;
+
+  if (entry->ap != ap)
+    printf("ASSOC: mobile %" PRId32 " is now served by AP %" PRId32 ".\n",
+           mobile, ap);
+
+  memcpy(entry->mobile_nic, mobile_nic, sizeof(CnetNICaddr));
+  entry->ap = ap;
+  entry->heard = nodeinfo.time_in_usec;
+  entry->rssi = rssi;
+  entry->chosen = chosen;
+}
+
+/// Write the payload of an ASSOC packet: the mobile's address, little-endian,
+/// followed by its NIC address, the RSSI, and whether the mobile chose us.
+///
+void assoc_encode(const struct assoc_entry *entry, char *buf) {
+  for (int i = 0; i < 4; ++i)
+    buf[i] = (char)(((uint32_t)entry->mobile >> (8 * i)) & 0xFF);
+  memcpy(buf + 4, entry->mobile_nic, sizeof(CnetNICaddr));
+
+  int16_t rssi = (int16_t)lround(entry->rssi * 10.0);
+  buf[10] = (char)((uint16_t)rssi & 0xFF);
+  buf[11] = (char)((uint16_t)rssi >> 8);
+  buf[12] = entry->chosen ? 1 : 0;
+}
+
+/// Read the payload of an ASSOC packet.
+///
+bool assoc_decode(const char *buf,
+                  size_t length,
+                  CnetAddr *mobile,
+                  CnetNICaddr mobile_nic,
+                  double *rssi,
+                  bool *chosen) {
+  if (length < ASSOC_PAYLOAD_LENGTH) return false;
+
+  const unsigned char *b = (const unsigned char *)buf;
+  *mobile = (CnetAddr)((uint32_t)b[0] | ((uint32_t)b[1] << 8) |
+                       ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24));
+  memcpy(mobile_nic, buf + 4, sizeof(CnetNICaddr));
+  *rssi = (int16_t)(b[10] | (b[11] << 8)) / 10.0;
+  *chosen = b[12] != 0;
+  return true;
+}
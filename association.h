@@ -0,0 +1,105 @@
+/// This file declares the association table kept by each access point. The
+/// table maps the address of each mobile node to the AP that serves it; the
+/// bridge table (bridge.h) says how to reach that AP. An AP learns its
+/// own associations from the source of uplink packets, and the others from
+/// the ASSOC packets that APs exchange over the LAN.
+///
+/// The association also settles a forwarding election: when several APs hear
+/// a mobile, the one that hears it most strongly serves it, and only that AP
+/// bridges the mobile's frames. A mobile that has chosen an AP itself (see
+/// neighbor.h) addresses its frames to that AP, and its choice overrides the
+/// election.
+
+#ifndef ASSOCIATION_H
+#define ASSOCIATION_H
+
+#include <cnet.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ASSOC_TABLE_SIZE 128       // Entries in the table; a power of two.
+#define ASSOC_TIMEOUT 30000000     // Usecs before an unconfirmed association expires.
+#define ASSOC_REFRESH 1000000      // Usecs between announcements of one association.
+#define ASSOC_KEEPALIVE 500000     // Usecs of silence after which a mobile sends
+                                   // its AP an ASSOC to show it is in range.
+
+#define ASSOC_HYSTERESIS 3.0       // dB by which an AP must hear a mobile more
+                                   // strongly to take it from its serving AP.
+
+#define ASSOC_PAYLOAD_LENGTH 13    // Bytes in the payload of an ASSOC packet.
+
+/// This struct holds the association of one mobile node.
+///
+struct assoc_entry {
+  // True iff this entry holds an association.
+  bool used;
+
+  // The mobile node, and the NIC address of its WiFi link.
+  CnetAddr mobile;
+  CnetNICaddr mobile_nic;
+
+  // The AP serving the mobile, and the WiFi link that the mobile is reached
+  // on iff we are the serving AP.
+  CnetAddr ap;
+  int link;
+
+  // When the serving AP last heard from the mobile, and how strongly (dBm).
+  CnetTime heard;
+  double rssi;
+
+  // True iff the mobile chose the serving AP by addressing frames to it.
+  bool chosen;
+
+  // When we last announced this association, iff we are the serving AP.
+  CnetTime announced;
+};
+
+/// Clear the association table. Called when an access point reboots.
+///
+void assoc_init(void);
+
+/// Returns the current association of the given mobile, or NULL if it has
+/// none or its association has expired.
+///
+const struct assoc_entry *assoc_lookup(CnetAddr mobile);
+
+/// Record that we heard the given mobile, with the given NIC address, on our
+/// WiFi link with a signal of rssi dBm; chosen is true iff the frame was
+/// addressed to us. We become its serving AP if the mobile chose us. Otherwise
+/// we do unless another AP was chosen by it, or has heard it more strongly
+/// than us (allowing ASSOC_HYSTERESIS), within ASSOC_TIMEOUT. Returns true iff
+/// the association should be announced to the other APs now.
+///
+bool assoc_heard(CnetAddr mobile,
+                 const CnetNICaddr mobile_nic,
+                 int link,
+                 double rssi,
+                 bool chosen);
+
+/// Record an association announced by another AP, which heard the mobile with
+/// a signal of rssi dBm. An AP chosen by the mobile always wins. Otherwise the
+/// announcement is ignored if we serve the mobile ourselves and were chosen,
+/// or hear it more strongly (or as strongly, with a lower address).
+///
+void assoc_announced(CnetAddr mobile,
+                     const CnetNICaddr mobile_nic,
+                     CnetAddr ap,
+                     double rssi,
+                     bool chosen);
+
+/// Write the payload of an ASSOC packet for the given mobile into buf, which
+/// must hold ASSOC_PAYLOAD_LENGTH bytes.
+///
+void assoc_encode(const struct assoc_entry *entry, char *buf);
+
+/// Read the payload of an ASSOC packet. Returns false if it is too short.
+/// The RSSI is carried in tenths of a dB.
+///
+bool assoc_decode(const char *buf,
+                  size_t length,
+                  CnetAddr *mobile,
+                  CnetNICaddr mobile_nic,
+                  double *rssi,
+                  bool *chosen);
+
+#endif // ASSOCIATION_H
@@ -0,0 +1,34 @@
+/// This file implements the encoding of beacon payloads.
+
+#include "beacon.h"
+
+#include <stdint.h>
+
+/// Write the payload of a BEACON packet.
+///
+void beacon_encode(const CnetPosition *position, bool ap, char *buf) {
+  uint16_t x = (uint16_t)(int16_t)position->x;
+  uint16_t y = (uint16_t)(int16_t)position->y;
+
+  buf[0] = (char)(x & 0xFF);
+  buf[1] = (char)(x >> 8);
+  buf[2] = (char)(y & 0xFF);
+  buf[3] = (char)(y >> 8);
+  buf[4] = ap ? 1 : 0;
+}
+
+/// Read the payload of a BEACON packet.
+///
+bool beacon_decode(const char *buf,
+                   size_t length,
+                   CnetPosition *position,
+                   bool *ap) {
+  if (length < BEACON_PAYLOAD_LENGTH) return false;
+
+  const unsigned char *b = (const unsigned char *)buf;
+  position->x = (int16_t)(b[0] | (b[1] << 8));
+  position->y = (int16_t)(b[2] | (b[3] << 8));
+  position->z = 0;
+  *ap = b[4] != 0;
+  return true;
+}
@@ -0,0 +1,34 @@
+/// This file declares the payload of the beacons that access points broadcast
+/// into their cells. A beacon carries the position of the AP, so that a mobile
+/// that knows where it is walking can tell which AP it is walking towards.
+/// Mobiles broadcast beacons too, so that mobiles in range of each other can
+/// talk directly; the payload says which kind of node sent it.
+
+#ifndef BEACON_H
+#define BEACON_H
+
+#include <cnet.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// The length of the payload of a BEACON packet: the sender's x and y
+// coordinates, each as a 16-bit little-endian number of metres, then a byte
+// that is 1 iff the sender is an access point. An AP's beacon goes on with
+// the credits of its downlink queues (see credit.h).
+//
+#define BEACON_PAYLOAD_LENGTH 5
+
+/// Write the payload of a BEACON packet for a node at position into the first
+/// BEACON_PAYLOAD_LENGTH bytes of buf. The node is an AP iff ap is true.
+///
+void beacon_encode(const CnetPosition *position, bool ap, char *buf);
+
+/// Read the payload of a BEACON packet of the given length into position and
+/// ap. Returns false if the payload is too short.
+///
+bool beacon_decode(const char *buf,
+                   size_t length,
+                   CnetPosition *position,
+                   bool *ap);
+
+#endif // BEACON_H
@@ -0,0 +1,85 @@
+/// This file implements the learning bridge table kept by each access point.
+/// The table is open addressed with linear probing and a multiplicative hash
+/// of the node address, so each lookup touches only a few entries. Ageing is
+/// lazy: an expired entry is ignored by lookups and reclaimed by the next
+/// node that probes past it.
+
+#include "bridge.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BRIDGE_TABLE_SIZE (1 << BRIDGE_TABLE_BITS)
+
+static struct bridge_entry table[BRIDGE_TABLE_SIZE];
+
+/// Returns the slot at which the probe sequence for addr starts.
+///
+static size_t hash(CnetAddr addr) {
+  return ((uint32_t)addr * 2654435761u) >> (32 - BRIDGE_TABLE_BITS);
+}
+
+/// Returns true iff the given entry has been refreshed within BRIDGE_AGEING.
+///
+static bool live(const struct bridge_entry *entry) {
+  return nodeinfo.time_in_usec - entry->seen <= BRIDGE_AGEING;
+}
+
+/// Clear the bridge table.
+///
+void bridge_init(void) {
+  memset(table, 0, sizeof(table));
+}
+
+/// Record that a verified frame from addr arrived on link, sent by nic.
+///
+void bridge_learn(CnetAddr addr, int link, const CnetNICaddr nic) {
+  struct bridge_entry *reuse = NULL;
+  struct bridge_entry *entry = NULL;
+
+  for (size_t i = 0; i < BRIDGE_TABLE_SIZE; ++i) {
+    struct bridge_entry *slot = &table[(hash(addr) + i) & (BRIDGE_TABLE_SIZE - 1)];
+
+    if (!slot->used || slot->addr == addr) {
+      entry = slot;
+      break;
+    }
+    if (reuse == NULL && !live(slot)) reuse = slot;
+  }
+
+  // A new node takes the first expired slot on its probe sequence, if any.
+  if (entry == NULL || (!entry->used && reuse != NULL)) entry = reuse;
+  if (entry == NULL) return;
+
+  if (entry->used && entry->addr == addr && live(entry)) {
+    // A node heard on two links (say, directly and through another AP) only
+    // moves once it has not been heard on its current link for a while.
+    if (entry->link != link &&
+        nodeinfo.time_in_usec - entry->seen < BRIDGE_HOLD)
+      return;
+  } else {
+    printf("BRIDGE: learned node %" PRId32 " on link %d.\n", addr, link);
+  }
+
+  entry->used = true;
+  entry->addr = addr;
+  entry->link = link;
+  entry->seen = nodeinfo.time_in_usec;
+  memcpy(entry->nic, nic, sizeof(CnetNICaddr));
+}
+
+/// Returns what we know about addr.
+///
+const struct bridge_entry *bridge_lookup(CnetAddr addr) {
+  for (size_t i = 0; i < BRIDGE_TABLE_SIZE; ++i) {
+    const struct bridge_entry *slot =
+        &table[(hash(addr) + i) & (BRIDGE_TABLE_SIZE - 1)];
+
+    if (!slot->used) return NULL;
+    if (slot->addr == addr) return live(slot) ? slot : NULL;
+  }
+
+  return NULL;
+}
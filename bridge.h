@@ -0,0 +1,48 @@
+/// This file declares the learning bridge table kept by each access point.
+/// The table records, for each node that we have received a frame from, the
+/// link that the frame arrived on and the NIC address that sent it, so that
+/// frames for that node can be unicast rather than flooded. For a node in our
+/// own cell this is the node's own NIC; for a node behind another AP it is
+/// that AP's LAN NIC, because our frames carry network addresses rather than
+/// the NIC address of the final destination.
+
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include <cnet.h>
+#include <stdbool.h>
+
+#define BRIDGE_TABLE_BITS 8          // The table holds 2^BRIDGE_TABLE_BITS entries.
+#define BRIDGE_AGEING 60000000       // Usecs before an entry that is not refreshed expires.
+#define BRIDGE_HOLD 1000000          // Usecs before a node may move to another link.
+
+/// This struct holds what the bridge has learned about one node.
+///
+struct bridge_entry {
+  // The node, and the time that we last received a frame from it.
+  CnetAddr addr;
+  CnetTime seen;
+
+  // The link that the node's frames arrive on, and the NIC that sent them.
+  int link;
+  CnetNICaddr nic;
+
+  // True iff this entry has ever been used. Expired entries stay in use, so
+  // that the probe sequences through them remain intact.
+  bool used;
+};
+
+/// Clear the bridge table. Called when an access point reboots.
+///
+void bridge_init(void);
+
+/// Record that a verified frame from addr arrived on link, sent by nic.
+///
+void bridge_learn(CnetAddr addr, int link, const CnetNICaddr nic);
+
+/// Returns what we know about addr, or NULL if it is unknown or its entry has
+/// aged out.
+///
+const struct bridge_entry *bridge_lookup(CnetAddr addr);
+
+#endif // BRIDGE_H
@@ -0,0 +1,74 @@
+/// This file implements the CoDel active queue manager, after the algorithm
+/// of RFC 8289.
+
+#include "codel.h"
+
+#include <math.h>
+#include <string.h>
+
+/// Returns the time of the drop that follows one at time t, when count
+/// packets have been dropped.
+///
+static CnetTime control_law(CnetTime t, int count) {
+  return t + (CnetTime)(CODEL_INTERVAL / sqrt((double)count));
+}
+
+/// Returns true iff the sojourn time has been above the target for a whole
+/// interval. A queue with no packets behind this one is never dropped from,
+/// as it cannot be the cause of a standing delay.
+///
+static bool above_target(struct codel_state *state,
+                         CnetTime sojourn,
+                         int backlog,
+                         CnetTime now) {
+  if (sojourn < CODEL_TARGET || backlog == 0) {
+    state->first_above = 0;
+    return false;
+  }
+
+  if (state->first_above == 0) {
+    state->first_above = now + CODEL_INTERVAL;
+    return false;
+  }
+
+  return now >= state->first_above;
+}
+
+/// Reset the given state.
+///
+void codel_init(struct codel_state *state) {
+  memset(state, 0, sizeof(*state));
+}
+
+/// Decide whether a packet leaving the queue should be dropped.
+///
+bool codel_drop(struct codel_state *state, CnetTime sojourn, int backlog) {
+  CnetTime now = nodeinfo.time_in_usec;
+  bool above = above_target(state, sojourn, backlog, now);
+
+  if (state->dropping) {
+    if (!above) {
+      state->dropping = false;
+      return false;
+    }
+    if (now < state->drop_next) return false;
+
+    ++state->count;
+    ++state->drops;
+    state->drop_next = control_law(state->drop_next, state->count);
+    return true;
+  }
+
+  if (!above) return false;
+
+  // Start dropping. If we stopped only recently, carry on from about the
+  // rate that we had reached, rather than starting again from one.
+  int delta = state->count - state->last_count;
+  state->count = (delta > 1 && now - state->drop_next < 16 * CODEL_INTERVAL)
+                   ? delta : 1;
+  state->last_count = state->count;
+  state->dropping = true;
+  state->drop_next = control_law(now, state->count);
+  ++state->drops;
+  return true;
+}
@@ -0,0 +1,49 @@
+/// This file declares a CoDel (controlled delay) active queue manager. It
+/// watches the time that packets spend queued (their sojourn time) rather
+/// than the length of the queue. Once packets have spent more than
+/// CODEL_TARGET queued for a whole CODEL_INTERVAL, packets are dropped as they
+/// leave the queue. The drops grow more frequent, with the square root of
+/// their count, until the sojourn time falls below the target again.
+
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <cnet.h>
+#include <stdbool.h>
+
+#define CODEL_TARGET 5000         // Usecs of queueing delay that we accept.
+#define CODEL_INTERVAL 100000     // Usecs that the delay must stay above the
+                                  // target before we drop; about one RTT.
+
+/// This struct holds the state of CoDel for one queue.
+///
+struct codel_state {
+  // The time by which the sojourn time must fall below the target, or 0 if
+  // it is below now.
+  CnetTime first_above;
+
+  // True iff we are dropping, and when the next drop is due.
+  bool dropping;
+  CnetTime drop_next;
+
+  // The drops since we started dropping, and the count that we started the
+  // last dropping state with.
+  int count;
+  int last_count;
+
+  // The packets that we have dropped in all.
+  int drops;
+};
+
+/// Reset the given state, for an empty queue.
+///
+void codel_init(struct codel_state *state);
+
+/// Called as a packet that was queued for sojourn usecs leaves the queue,
+/// which still holds backlog packets after it. Returns true iff the packet
+/// should be dropped. While it returns true, the caller should ask again of
+/// the next packet in the queue.
+///
+bool codel_drop(struct codel_state *state, CnetTime sojourn, int backlog);
+
+#endif // CODEL_H
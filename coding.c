@@ -0,0 +1,152 @@
+/// This file implements the network coding of packets between pairs of
+/// mobiles. A mobile keeps the packets it sends in a ring of references, and
+/// finds the one a CODED packet was made with by its checksum.
+
+#include "coding.h"
+#include "fec.h"
+#include "network.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+#include <string.h>
+
+/// This struct holds a packet that we sent, and when.
+///
+struct coding_kept {
+  pkt_handle packet;
+  uint32_t checksum;
+  CnetTime sent;
+};
+
+static struct coding_kept kept[CODING_KEEP];
+static int next_kept = 0;
+
+// The CODED packets that we decoded, and those that we could not because we
+// no longer held our own packet.
+static int decoded = 0;
+static int undecodable = 0;
+
+/// Write the description of one packet into buf.
+///
+static void encode_native(pkt_handle packet, CnetAddr dest, char *buf) {
+  uint32_t d = (uint32_t)dest;
+  const char *data = pkt_data(packet);
+  size_t length = pkt_length(packet);
+
+  buf[0] = (char)(d & 0xFF);
+  buf[1] = (char)((d >> 8) & 0xFF);
+  buf[2] = (char)((d >> 16) & 0xFF);
+  buf[3] = (char)(d >> 24);
+  memcpy(buf + 4, data, 4);   // The checksum leads every encoded packet.
+  buf[8] = (char)(length & 0xFF);
+  buf[9] = (char)(length >> 8);
+}
+
+/// Write the payload of a CODED packet.
+///
+size_t coding_encode(pkt_handle a, CnetAddr a_dest,
+                     pkt_handle b, CnetAddr b_dest,
+                     char *buf) {
+  size_t a_length = pkt_length(a);
+  size_t b_length = pkt_length(b);
+  size_t longer = a_length > b_length ? a_length : b_length;
+
+  encode_native(a, a_dest, buf);
+  encode_native(b, b_dest, buf + CODING_NATIVE_LENGTH);
+
+  unsigned char *coded = (unsigned char *)buf + CODING_PREFIX_LENGTH;
+  memset(coded, 0, longer);
+  fec_xor(coded, (const unsigned char *)pkt_data(a), a_length);
+  fec_xor(coded, (const unsigned char *)pkt_data(b), b_length);
+  return CODING_PREFIX_LENGTH + longer;
+}
+
+/// Forget every packet that we kept.
+///
+void coding_init(void) {
+  for (int i = 0; i < CODING_KEEP; ++i) kept[i].packet = PKT_NULL;
+  next_kept = 0;
+  decoded = 0;
+  undecodable = 0;
+}
+
+/// Keep a packet that we sent.
+///
+void coding_keep(pkt_handle packet) {
+  if (pkt_length(packet) < 4) return;
+
+  const unsigned char *b = (const unsigned char *)pkt_data(packet);
+  struct coding_kept *k = &kept[next_kept];
+
+  pkt_release(k->packet);
+  k->packet = pkt_ref(packet);
+  k->checksum = (uint32_t)b[0] | ((uint32_t)b[1] << 8) |
+                ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+  k->sent = nodeinfo.time_in_usec;
+  next_kept = (next_kept + 1) % CODING_KEEP;
+}
+
+/// Returns the packet that we kept with the given checksum, or PKT_NULL.
+///
+static pkt_handle find_kept(uint32_t checksum) {
+  for (int i = 0; i < CODING_KEEP; ++i) {
+    if (kept[i].packet == PKT_NULL) continue;
+
+    if (nodeinfo.time_in_usec - kept[i].sent > CODING_KEEP_TIME) {
+      pkt_release(kept[i].packet);
+      kept[i].packet = PKT_NULL;
+    } else if (kept[i].checksum == checksum) {
+      return kept[i].packet;
+    }
+  }
+  return PKT_NULL;
+}
+
+/// Rebuild our packet from a CODED packet.
+///
+size_t coding_decode(const char *payload, size_t length, char *out) {
+  if (length < CODING_PREFIX_LENGTH) return 0;
+
+  const unsigned char *p = (const unsigned char *)payload;
+  const unsigned char *ours = NULL;
+  const unsigned char *theirs = NULL;
+
+  for (int i = 0; i < 2; ++i) {
+    const unsigned char *native = p + i * CODING_NATIVE_LENGTH;
+    CnetAddr dest = (CnetAddr)((uint32_t)native[0] | ((uint32_t)native[1] << 8) |
+                               ((uint32_t)native[2] << 16) |
+                               ((uint32_t)native[3] << 24));
+    if (dest == nodeinfo.address) ours = native;
+    else theirs = native;
+  }
+  if (ours == NULL || theirs == NULL) return 0;
+
+  size_t coded_length = length - CODING_PREFIX_LENGTH;
+  size_t our_length = ours[8] | (ours[9] << 8);
+  size_t their_length = theirs[8] | (theirs[9] << 8);
+  if (our_length > coded_length || their_length > coded_length ||
+      our_length > NL_PACKET_MAXLENGTH)
+    return 0;
+
+  // The packet coded with ours is the one that we sent.
+  uint32_t checksum = (uint32_t)theirs[4] | ((uint32_t)theirs[5] << 8) |
+                      ((uint32_t)theirs[6] << 16) | ((uint32_t)theirs[7] << 24);
+  pkt_handle sent = find_kept(checksum);
+  if (sent == PKT_NULL || pkt_length(sent) != their_length) {
+    ++undecodable;
+    return 0;
+  }
+
+  memcpy(out, p + CODING_PREFIX_LENGTH, our_length);
+  fec_xor((unsigned char *)out, (const unsigned char *)pkt_data(sent),
+          their_length < our_length ? their_length : our_length);
+  ++decoded;
+  return our_length;
+}
+
+/// Print the decoding counters.
+///
+void coding_report(void) {
+  printf("Mobile %" PRId32 ": %d CODED packets decoded, %d undecodable.\n",
+         nodeinfo.address, decoded, undecodable);
+}
@@ -0,0 +1,60 @@
+/// This file declares the network coding of packets between pairs of mobiles.
+/// When an AP holds a packet from mobile A for mobile B, and one from B for A,
+/// it broadcasts a single CODED packet holding the XOR of the two. Each mobile
+/// keeps a copy of the packets that it sends, so A rebuilds B's packet by
+/// XORing out its own, and B rebuilds A's; one transmission does the work of
+/// two. The CODED packet is broadcast at the base rate, so the AP only codes a
+/// pair when that takes less airtime than sending both at their own rates.
+///
+/// The payload of a CODED packet describes each of the two packets (its
+/// destination as four bytes, the checksum from its header as four bytes and
+/// its length as two, all little-endian), then holds their XOR, the shorter
+/// padded with zeroes.
+
+#ifndef CODING_H
+#define CODING_H
+
+#include "packet_pool.h"
+
+#include <cnet.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CODING_NATIVE_LENGTH 10   // Bytes that describe each packet.
+#define CODING_PREFIX_LENGTH (2 * CODING_NATIVE_LENGTH)
+#define CODING_KEEP 32            // Packets that a mobile keeps for decoding.
+#define CODING_KEEP_TIME 200000   // Usecs that a mobile keeps each packet.
+#define CODING_MAX_AGE 100000     // Usecs that an AP may hold a packet and still
+                                  // code it, so that its sender still has it.
+
+/// Write the payload of a CODED packet for the packets a, for a_dest, and b,
+/// for b_dest, into buf, which must hold CODING_PREFIX_LENGTH bytes more than
+/// the longer of them. Returns the length of the payload.
+///
+size_t coding_encode(pkt_handle a, CnetAddr a_dest,
+                     pkt_handle b, CnetAddr b_dest,
+                     char *buf);
+
+/// Forget every packet that we kept. Called when a mobile reboots, after its
+/// pool has been reset.
+///
+void coding_init(void);
+
+/// Keep a reference to the packet in the given buffer, which we have just
+/// sent, so that it can be XORed out of a CODED packet.
+///
+void coding_keep(pkt_handle packet);
+
+/// Rebuild the packet for us from the payload of a CODED packet, of the given
+/// length, into out, which must hold NL_PACKET_MAXLENGTH bytes. Returns the
+/// length of the rebuilt packet, or 0 if the packet is not for us or we no
+/// longer hold the packet that it was coded with.
+///
+size_t coding_decode(const char *payload, size_t length, char *out);
+
+/// Print the CODED packets that we decoded, and those that we could not.
+///
+void coding_report(void);
+
+#endif // CODING_H
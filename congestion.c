@@ -0,0 +1,59 @@
+/// This file implements the AIMD congestion controller used by each flow.
+
+#include "congestion.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+
+/// Reset the given state for a new flow.
+///
+void cc_init(struct cc_state *cc) {
+  cc->cwnd = 1.0;
+  cc->ssthresh = CC_MAX_WINDOW;
+  cc->timeouts = 0;
+  cc->nacks = 0;
+}
+
+/// Returns the number of messages that may be outstanding on the flow.
+///
+int cc_window(const struct cc_state *cc) {
+  int window = (int)cc->cwnd;
+  return (window < 1) ? 1 : window;
+}
+
+/// Grow the window for the given number of newly acknowledged messages.
+///
+void cc_on_ack(struct cc_state *cc, int acked) {
+  for (int i = 0; i < acked; ++i) {
+    if (cc->cwnd < cc->ssthresh)
+      cc->cwnd += 1.0;              // Slow start.
+    else
+      cc->cwnd += 1.0 / cc->cwnd;   // Additive increase.
+  }
+
+  if (cc->cwnd > CC_MAX_WINDOW) cc->cwnd = CC_MAX_WINDOW;
+}
+
+/// Shrink the window after a loss.
+///
+void cc_on_loss(struct cc_state *cc, bool timeout) {
+  // Multiplicative decrease.
+  cc->ssthresh = cc->cwnd / 2.0;
+  if (cc->ssthresh < 1.0) cc->ssthresh = 1.0;
+
+  if (timeout) {
+    cc->cwnd = 1.0;
+    ++cc->timeouts;
+  } else {
+    cc->cwnd = cc->ssthresh;
+    ++cc->nacks;
+  }
+}
+
+/// Print the state of the flow to dest, for tracing.
+///
+void cc_trace(const struct cc_state *cc, CnetAddr dest, const char *event) {
+  printf("CC: flow %" PRId32 "->%" PRId32 " %s: cwnd=%.2f ssthresh=%.2f "
+         "timeouts=%d nacks=%d\n", nodeinfo.address, dest, event,
+         cc->cwnd, cc->ssthresh, cc->timeouts, cc->nacks);
+}
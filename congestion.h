@@ -0,0 +1,53 @@
+/// This file declares the AIMD congestion controller that our network layer
+/// runs for each flow (each destination that a node sends messages to). The
+/// controller only decides how many messages may be outstanding; the flow
+/// itself is managed by the caller.
+
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <cnet.h>
+#include <stdbool.h>
+
+#define CC_MAX_WINDOW 16    // The largest congestion window, in messages.
+
+/// This struct holds the congestion control state of one flow.
+///
+struct cc_state {
+  // The congestion window, in messages. Fractional growth accumulates here
+  // during congestion avoidance.
+  double cwnd;
+
+  // The slow start threshold, in messages.
+  double ssthresh;
+
+  // The number of loss events detected by timeout and by NACK.
+  int timeouts;
+  int nacks;
+};
+
+/// Reset the given state for a new flow: slow start from one message.
+///
+void cc_init(struct cc_state *cc);
+
+/// Returns the number of messages that may be outstanding on the flow.
+///
+int cc_window(const struct cc_state *cc);
+
+/// Grow the window for the given number of newly acknowledged messages:
+/// by one message per ACK in slow start, and by about one message per window
+/// in congestion avoidance.
+///
+void cc_on_ack(struct cc_state *cc, int acked);
+
+/// Shrink the window after a loss. A timeout halves ssthresh and restarts
+/// slow start from one message; a NACK halves the window and continues in
+/// congestion avoidance.
+///
+void cc_on_loss(struct cc_state *cc, bool timeout);
+
+/// Print the state of the flow to dest, for tracing, after the given event.
+///
+void cc_trace(const struct cc_state *cc, CnetAddr dest, const char *event);
+
+#endif // CONGESTION_H
@@ -0,0 +1,110 @@
+/// This file implements the credits with which an access point paces the
+/// mobiles in its cell. A mobile keeps the credits of every destination, in a
+/// table indexed by address.
+
+#include "credit.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+#include <stdint.h>
+
+static int credits[CREDIT_NODES];
+
+// The number of times that a destination's credits ran out.
+static int stalls = 0;
+
+/// Write a credit list.
+///
+size_t credit_encode(const struct credit_grant *grants, int count, char *buf) {
+  if (count > CREDIT_MAX) count = CREDIT_MAX;
+
+  buf[0] = (char)count;
+  char *p = buf + 1;
+  for (int i = 0; i < count; ++i, p += CREDIT_ENTRY_LENGTH) {
+    uint32_t dest = (uint32_t)grants[i].dest;
+    int n = grants[i].credits;
+
+    p[0] = (char)(dest & 0xFF);
+    p[1] = (char)((dest >> 8) & 0xFF);
+    p[2] = (char)((dest >> 16) & 0xFF);
+    p[3] = (char)(dest >> 24);
+    p[4] = (char)(n < 0 ? 0 : (n > UINT8_MAX ? UINT8_MAX : n));
+  }
+  return (size_t)(p - buf);
+}
+
+/// Read a credit list.
+///
+int credit_decode(const char *buf,
+                  size_t length,
+                  struct credit_grant *grants,
+                  int max) {
+  if (length < 1) return -1;
+
+  const unsigned char *b = (const unsigned char *)buf;
+  int count = b[0];
+  if (length < 1 + (size_t)count * CREDIT_ENTRY_LENGTH) return -1;
+  if (count > max) count = max;
+
+  const unsigned char *p = b + 1;
+  for (int i = 0; i < count; ++i, p += CREDIT_ENTRY_LENGTH) {
+    grants[i].dest = (CnetAddr)((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                                ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+    grants[i].credits = p[4];
+  }
+  return count;
+}
+
+/// Give every destination unlimited credit.
+///
+void credit_init(void) {
+  for (int i = 0; i < CREDIT_NODES; ++i) credits[i] = CREDIT_UNLIMITED;
+  stalls = 0;
+}
+
+/// Replace our credits with those advertised.
+///
+void credit_granted(const struct credit_grant *grants,
+                    int count,
+                    credit_changed_fn changed) {
+  int previous[CREDIT_NODES];
+  for (int i = 0; i < CREDIT_NODES; ++i) {
+    previous[i] = credits[i];
+    credits[i] = CREDIT_UNLIMITED;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    if (grants[i].dest >= 0 && grants[i].dest < CREDIT_NODES)
+      credits[grants[i].dest] = grants[i].credits;
+  }
+
+  for (CnetAddr dest = 0; dest < CREDIT_NODES; ++dest) {
+    if ((previous[dest] == 0) != (credits[dest] == 0)) {
+      if (credits[dest] == 0) ++stalls;
+      (*changed)(dest);
+    }
+  }
+}
+
+/// Returns true iff dest has credit.
+///
+bool credit_available(CnetAddr dest) {
+  return dest < 0 || dest >= CREDIT_NODES || credits[dest] != 0;
+}
+
+/// Spend credits on dest.
+///
+void credit_spend(CnetAddr dest, int count) {
+  if (dest < 0 || dest >= CREDIT_NODES) return;
+  if (credits[dest] == CREDIT_UNLIMITED || credits[dest] == 0) return;
+
+  credits[dest] = (credits[dest] > count) ? credits[dest] - count : 0;
+  if (credits[dest] == 0) ++stalls;
+}
+
+/// Print the credit counters.
+///
+void credit_report(void) {
+  printf("Mobile %" PRId32 ": credits ran out %d times.\n",
+         nodeinfo.address, stalls);
+}
@@ -0,0 +1,80 @@
+/// This file declares the credits with which an access point paces the
+/// mobiles in its cell. Each AP advertises, in its beacons and in the POLL
+/// packets that grant a mobile its turn, how many more packets its downlink
+/// queue for each mobile can take. A mobile spends a credit on each packet it
+/// sends through the AP for that destination, and stops its application from
+/// generating messages for the destination when it has none left, rather than
+/// using the air for packets that the AP would drop.
+///
+/// An advertisement lists only the destinations whose queues hold packets; the
+/// others may be sent to freely. Each advertisement replaces the last, so a
+/// lost one is made good by the next.
+///
+/// The credit list is one byte of count, then for each destination its address
+/// (four bytes, little-endian) and its credits (one byte).
+
+#ifndef CREDIT_H
+#define CREDIT_H
+
+#include <cnet.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CREDIT_MAX 32             // Destinations in one advertisement.
+#define CREDIT_ENTRY_LENGTH 5     // Bytes per destination in a credit list.
+#define CREDIT_MAX_LENGTH (1 + CREDIT_MAX * CREDIT_ENTRY_LENGTH)
+
+#define CREDIT_NODES 100          // Addresses that credits are kept for; as
+                                  // many as MAXNODES in mobile.c.
+#define CREDIT_UNLIMITED (-1)     // The credits of a destination not listed.
+
+/// This struct holds the credits advertised for one destination.
+///
+struct credit_grant {
+  CnetAddr dest;
+  int credits;
+};
+
+/// The function called by credit_granted() for each destination that may now
+/// be sent to, or may no longer be.
+///
+typedef void (*credit_changed_fn)(CnetAddr dest);
+
+/// Write a credit list of count grants into buf, which must hold
+/// CREDIT_MAX_LENGTH bytes. Returns the number of bytes written.
+///
+size_t credit_encode(const struct credit_grant *grants, int count, char *buf);
+
+/// Read a credit list of at most max grants. Returns the number read, or -1
+/// if the list is truncated.
+///
+int credit_decode(const char *buf,
+                  size_t length,
+                  struct credit_grant *grants,
+                  int max);
+
+/// Give every destination unlimited credit. Called when a mobile reboots.
+///
+void credit_init(void);
+
+/// Replace our credits with the count grants advertised by our AP. The
+/// changed function is called for each destination whose credits ran out or
+/// were restored.
+///
+void credit_granted(const struct credit_grant *grants,
+                    int count,
+                    credit_changed_fn changed);
+
+/// Returns true iff we may send a packet to dest through our AP.
+///
+bool credit_available(CnetAddr dest);
+
+/// Spend count credits on packets sent to dest through our AP.
+///
+void credit_spend(CnetAddr dest, int count);
+
+/// Print the number of times that a destination's credits ran out.
+///
+void credit_report(void);
+
+#endif // CREDIT_H
@@ -2,6 +2,7 @@
 //  we could not get the collision retransmission to work properly so at the moment we sense collisions but do not retransmit.
 
 #include "dll_ethernet.h"
+#include "packet_pool.h"
 
 #include <cnet.h>
 #include <inttypes.h>
@@ -17,10 +18,18 @@
 #define IFG 9.6			// Our interframe gap period that a link will wait before retransmitting if the line is busy.
 #define SLOT 51.2		// Our slot time to be used for exponential backoff in the event of a collision.		
 
-/// This struct specifies the format of an Ethernet frame. When using Ethernet
-/// links in cnet, the first part of the frame must be the destination address.
+#define ETH_JUMBO_MAXDATA PKT_MAXDATA	// The largest bundle, in a jumbo frame.
+#define ETH_BUNDLES 8			// Destinations that bundles are gathered for at once.
+#define ETH_BUNDLE_FLAG 0x8000		// Set in the type field of a frame that holds a bundle.
+#define ETH_RECORD_LENGTH 2		// Bytes of length in front of each payload in a bundle.
+#define EV_ETH_FLUSH EV_TIMER8		// The timer that sends bundles at their deadline.
+#define ETH_QUEUE_DEPTH 16		// Frames that wait for the line at once.
+
+/// This struct specifies the format of the header of an Ethernet frame. When
+/// using Ethernet links in cnet, the first part of the frame must be the
+/// destination address.
 ///
-struct eth_frame {
+struct eth_header {
   // Ethernet address of the destination (receiver).
   CnetNICaddr dest;
 
@@ -29,10 +38,38 @@ struct eth_frame {
 
   // For our protocol the type field will indicate the length of the payload.
   char type[2];
+};
+
+/// This struct specifies the format of an Ethernet frame.
+///
+struct eth_frame {
+  // Header section.
+  struct eth_header header;
 
   // Data must be the last field, because we will truncate the unused area when
-  // sending to the physical layer.
-  char data[ETH_MAXDATA];
+  // sending to the physical layer. A bundle may fill a jumbo frame.
+  char data[ETH_JUMBO_MAXDATA];
+};
+
+/// This struct holds a bundle of payloads being gathered for one destination.
+/// Each payload is preceded by its length, as two little-endian bytes.
+///
+struct eth_bundle {
+  // The pool buffer holding the bundle, or PKT_NULL if none is being gathered.
+  pkt_handle packet;
+
+  // The destination of the bundle, and the number of payloads in it.
+  CnetNICaddr dest;
+  int count;
+};
+
+/// This struct holds a frame waiting for the line: a reference to its payload,
+/// its destination and its type field.
+///
+struct eth_waiting {
+  pkt_handle packet;
+  CnetNICaddr dest;
+  uint16_t type;
 };
 
 /// This struct type will hold the state for one instance of the Ethernet data
@@ -44,6 +81,29 @@ struct dll_eth_state {
   
   // A pointer to the function that is called to pass data up to the next layer.
   up_from_dll_fn_ty nl_callback;
+
+  // The frames waiting for the line to clear, oldest at head, and the timer
+  // that tries them again after the interframe gap, or NULLTIMER.
+  struct eth_waiting waiting[ETH_QUEUE_DEPTH];
+  int waiting_head;
+  int waiting_count;
+  CnetTimerID ifg_timer;
+
+  // The bundles being gathered, their largest size, and the usecs that a
+  // payload may wait in one; a deadline of zero means payloads are not bundled.
+  struct eth_bundle bundles[ETH_BUNDLES];
+  size_t bundle_maxdata;
+  CnetTime bundle_deadline;
+  CnetTimerID flush_timer;
+
+  // The frames sent, the payloads that they carried, and the payloads that
+  // were sent in bundles.
+  int frames_sent;
+  int payloads_sent;
+  int payloads_bundled;
+
+  // The frames dropped because too many were waiting for the line.
+  int frames_dropped;
  
   // This will store a version of the frame incase of collision.
   //struct eth_frame collframe;	// Does not work.
@@ -57,13 +117,24 @@ struct dll_eth_state {
   // Add members to represent the Ethernet link's state here.
 };
 
-CnetTimerID lasttimer = NULLTIMER;	// Create a cnet timer to hold our carrier sense data.
 //CnetTimerID lasttimer4 = NULLTIMER;	// Create a cnet timer to use during our collisions. Doesnt work.
-struct eth_frame tempframe;		// This will hold the temporary frame that has to be delayed when the line is busy.
-uint16_t tempframe_length;		// Hold the frame length for retransmission use.
 
 #define ETH_HEADER_LENGTH (offsetof(struct eth_frame, data))
 
+// The header is written into the headroom of a pool buffer, so it must fit.
+_Static_assert(ETH_HEADER_LENGTH <= PKT_HEADROOM, "Ethernet header exceeds headroom");
+_Static_assert(ETH_MINFRAME <= PKT_MAXDATA, "Ethernet padding exceeds pool buffer");
+_Static_assert(ETH_JUMBO_MAXDATA < ETH_BUNDLE_FLAG, "Bundle length overlaps its flag");
+
+static void send_frame(struct dll_eth_state *state,
+                       CnetNICaddr dest,
+                       pkt_handle handle,
+                       uint16_t type);
+static void write_frame(struct dll_eth_state *state,
+                        const CnetNICaddr dest,
+                        pkt_handle handle,
+                        uint16_t type);
+
 /// This will be called when our frame collides
 ///
 /*static EVENT_HANDLER(coll_timeout) {
@@ -71,10 +142,136 @@ uint16_t tempframe_length;		// Hold the frame length for retransmission use.
   dll_eth_write(state, state->collframe.dest, state->collframe.data, state->collframe_length); 
 }*/	// Does not work.
  
-/// If line is busy try and retransmit.
+/// If line is busy try and retransmit. The waiting frames are sent in order
+/// while the line is clear.
 ///
 static EVENT_HANDLER(IFG_timeout) {
-  dll_eth_write((struct dll_eth_state *)data, tempframe.dest, tempframe.data, tempframe_length);	// Try and retransmit our frame.
+  struct dll_eth_state *state = (struct dll_eth_state *)data;
+  state->ifg_timer = NULLTIMER;
+
+  while (state->waiting_count > 0) {
+    if (CNET_carrier_sense(state->link) == 1) {
+      printf("ETH: line busy, waiting....\n");
+      state->ifg_timer = CNET_start_timer(EV_TIMER1, (CnetTime)IFG, (CnetData)state);
+      return;
+    }
+
+    struct eth_waiting *w = &state->waiting[state->waiting_head];
+    write_frame(state, w->dest, w->packet, w->type);	// Try and retransmit our frame.
+    pkt_release(w->packet);
+    w->packet = PKT_NULL;
+    state->waiting_head = (state->waiting_head + 1) % ETH_QUEUE_DEPTH;
+    --state->waiting_count;
+  }
+}
+
+/// Send the bundle being gathered in b, if any.
+///
+static void flush_bundle(struct dll_eth_state *state, struct eth_bundle *b) {
+  if (b->packet == PKT_NULL) return;
+
+  send_frame(state, b->dest, b->packet,
+             (uint16_t)(ETH_BUNDLE_FLAG | pkt_length(b->packet)));
+  state->payloads_bundled += b->count;
+  state->payloads_sent += b->count - 1;
+
+  pkt_release(b->packet);
+  b->packet = PKT_NULL;
+  b->count = 0;
+}
+
+/// Send the bundles being gathered.
+///
+static void flush_bundles(struct dll_eth_state *state) {
+  for (int i = 0; i < ETH_BUNDLES; ++i)
+    flush_bundle(state, &state->bundles[i]);
+}
+
+/// Called at the deadline of the oldest payload waiting in a bundle.
+///
+static EVENT_HANDLER(flush_timeout) {
+  struct dll_eth_state *state = (struct dll_eth_state *)data;
+  state->flush_timer = NULLTIMER;
+  flush_bundles(state);
+}
+
+/// Returns the bundle being gathered for dest, or NULL if there is none.
+///
+static struct eth_bundle *lookup_bundle(struct dll_eth_state *state,
+                                        CnetNICaddr dest) {
+  for (int i = 0; i < ETH_BUNDLES; ++i) {
+    struct eth_bundle *b = &state->bundles[i];
+    if (b->packet != PKT_NULL && memcmp(b->dest, dest, sizeof(CnetNICaddr)) == 0)
+      return b;
+  }
+  return NULL;
+}
+
+/// Returns the bundle being gathered for dest. If there is none, then an
+/// unused one is taken; if every one is in use, the first is sent to make room.
+///
+static struct eth_bundle *find_bundle(struct dll_eth_state *state,
+                                      CnetNICaddr dest) {
+  struct eth_bundle *b = lookup_bundle(state, dest);
+  if (b != NULL) return b;
+
+  struct eth_bundle *spare = NULL;
+  for (int i = 0; i < ETH_BUNDLES && spare == NULL; ++i) {
+    if (state->bundles[i].packet == PKT_NULL) spare = &state->bundles[i];
+  }
+
+  if (spare == NULL) {
+    spare = &state->bundles[0];
+    flush_bundle(state, spare);
+  }
+
+  memcpy(spare->dest, dest, sizeof(CnetNICaddr));
+  return spare;
+}
+
+/// Add the payload held in the given pool buffer to the bundle for dest. A
+/// payload too large to ever share a frame is sent on its own, after the
+/// bundle ahead of it so that the order of the payloads is kept.
+///
+static void bundle_payload(struct dll_eth_state *state,
+                           CnetNICaddr dest,
+                           pkt_handle handle) {
+  uint16_t length = pkt_length(handle);
+  size_t record = ETH_RECORD_LENGTH + length;
+
+  // A payload that leaves no room for even a one byte payload beside it is
+  // not bundled; on an AP bundling to the MTU, that is every full fragment.
+  if (record + ETH_RECORD_LENGTH + 1 > state->bundle_maxdata) {
+    struct eth_bundle *ahead = lookup_bundle(state, dest);
+    if (ahead != NULL) flush_bundle(state, ahead);
+    send_frame(state, dest, handle, length);
+    return;
+  }
+
+  // Send what has been gathered if this payload will not fit with it.
+  struct eth_bundle *b = find_bundle(state, dest);
+  if (b->packet != PKT_NULL && pkt_length(b->packet) + record > state->bundle_maxdata)
+    flush_bundle(state, b);
+
+  if (b->packet == PKT_NULL) {
+    b->packet = pkt_alloc();
+    if (b->packet == PKT_NULL) {
+      send_frame(state, dest, handle, length);
+      return;
+    }
+    pkt_set_length(b->packet, 0);
+  }
+
+  char *p = pkt_data(b->packet) + pkt_length(b->packet);
+  p[0] = (char)(length & 0xFF);
+  p[1] = (char)(length >> 8);
+  memcpy(p + ETH_RECORD_LENGTH, pkt_data(handle), length);
+  pkt_set_length(b->packet, pkt_length(b->packet) + record);
+  ++b->count;
+
+  if (state->flush_timer == NULLTIMER)
+    state->flush_timer = CNET_start_timer(EV_ETH_FLUSH, state->bundle_deadline,
+                                          (CnetData)state);
 }
 
 /// This function will process our exponential backoff when a collision occurs.
@@ -115,10 +312,15 @@ struct dll_eth_state *dll_eth_new_state(int link, up_from_dll_fn_ty callback) {
   // Initialize the members of the structure.
   state->link = link;
   state->nl_callback = callback;
+  state->ifg_timer = NULLTIMER;
+  state->flush_timer = NULLTIMER;
+  for (int i = 0; i < ETH_QUEUE_DEPTH; ++i) state->waiting[i].packet = PKT_NULL;
+  for (int i = 0; i < ETH_BUNDLES; ++i) state->bundles[i].packet = PKT_NULL;
   //state->collisions = 0;  // Does not work.
     
   // Call our required handlers
   CHECK(CNET_set_handler(EV_TIMER1, IFG_timeout, 0));
+  CHECK(CNET_set_handler(EV_ETH_FLUSH, flush_timeout, 0));
   //CHECK(CNET_set_handler(EV_TIMER4, coll_timeout, 0));	// Does not work.
 
   return state;
@@ -131,53 +333,127 @@ void dll_eth_delete_state(struct dll_eth_state *state) {
   if (state == NULL) return;	// If state is already empty then return.
   
   // Free any dynamic memory that is used by the members of the state.
+  if (state->flush_timer != NULLTIMER) CNET_stop_timer(state->flush_timer);
+  if (state->ifg_timer != NULLTIMER) CNET_stop_timer(state->ifg_timer);
+  for (int i = 0; i < ETH_BUNDLES; ++i) pkt_release(state->bundles[i].packet);
+  for (int i = 0; i < ETH_QUEUE_DEPTH; ++i) pkt_release(state->waiting[i].packet);
   free(state);
 }
 
+/// Returns the largest payload that one frame on the given Ethernet link can carry.
+///
+size_t dll_eth_mtu(const struct dll_eth_state *state) {
+  return ETH_MAXDATA;
+}
+
+/// Bundle the payloads written to the given Ethernet link.
+///
+void dll_eth_bundle(struct dll_eth_state *state,
+                    size_t maxdata,
+                    CnetTime deadline) {
+  if (state == NULL) return;
+
+  // Payloads already gathered go out under the old settings.
+  flush_bundles(state);
+
+  state->bundle_maxdata = (maxdata > ETH_JUMBO_MAXDATA) ? ETH_JUMBO_MAXDATA : maxdata;
+  state->bundle_deadline = (deadline > 0) ? deadline : 0;
+}
+
 /// Write a frame to the given Ethernet link.
 ///
 void dll_eth_write(struct dll_eth_state *state,
                    CnetNICaddr dest,
                    const char *data,
                    uint16_t length) {
+  if (!data || length == 0 || length > ETH_MAXDATA) return;	// If data is invalid discard.
+
+  // Copy the payload into a pool buffer once, and hand that to the link.
+  pkt_handle handle = pkt_copy_in(data, length);
+  if (handle == PKT_NULL) return;
+
+  dll_eth_write_pkt(state, dest, handle);
+  pkt_release(handle);
+}
+
+/// Write the payload held in the given pool buffer to the given Ethernet link.
+///
+void dll_eth_write_pkt(struct dll_eth_state *state,
+                       CnetNICaddr dest,
+                       pkt_handle handle) {
+  if (handle == PKT_NULL) return;
+
+  uint16_t length = pkt_length(handle);
+  if (length == 0 || length > ETH_MAXDATA) return;	// If data is invalid discard.
+
+  if (state->bundle_deadline > 0) bundle_payload(state, dest, handle);
+  else send_frame(state, dest, handle, length);
+}
+
+/// Send the payload held in the given pool buffer as one frame, with the given
+/// type field: the payload's length, with ETH_BUNDLE_FLAG set iff it is a
+/// bundle. If the line is busy, or other frames already wait for it, the
+/// frame waits behind them for the interframe gap.
+///
+static void send_frame(struct dll_eth_state *state,
+                       CnetNICaddr dest,
+                       pkt_handle handle,
+                       uint16_t type) {
   // If line is transmitting
-  if(CNET_carrier_sense(state->link) == 1) {
-    if (!data || length == 0) return;	// If data is invalid discard.
+  if (state->waiting_count > 0 || CNET_carrier_sense(state->link) == 1) {
+    if (state->waiting_count == ETH_QUEUE_DEPTH) {
+      printf("ETH: too many frames waiting, dropping frame.\n");
+      ++state->frames_dropped;
+      return;
+    }
 
-    // Fill our tempframe with buffered details to be retransmitted.
-    memcpy(tempframe.dest, dest, sizeof(CnetNICaddr));
-    memcpy(tempframe.data, data, length);
-    tempframe_length = length;
-    
-    CnetTime backoff = ((CnetTime)IFG);	// Backoff for the interframe gap.
-    lasttimer = CNET_start_timer(EV_TIMER1, backoff, (CnetData)state); // Start timer.
+    // Hold a reference to the payload for retransmission, rather than a copy.
+    struct eth_waiting *w = &state->waiting[(state->waiting_head +
+                                             state->waiting_count) % ETH_QUEUE_DEPTH];
+    w->packet = pkt_ref(handle);
+    memcpy(w->dest, dest, sizeof(CnetNICaddr));
+    w->type = type;
+    ++state->waiting_count;
 
-    printf("ETH: line busy, waiting....\n");
+    if (state->ifg_timer == NULLTIMER) {
+      CnetTime backoff = ((CnetTime)IFG);	// Backoff for the interframe gap.
+      state->ifg_timer = CNET_start_timer(EV_TIMER1, backoff, (CnetData)state); // Start timer.
+      printf("ETH: line busy, waiting....\n");
+    }
     return;
   }
-  if (!data || length == 0) return;	// If data is invalid discard.
-  
-  struct eth_frame frame;                 // This will hold our data for transmission.
+
+  write_frame(state, dest, handle, type);
+}
+
+/// Write the payload held in the given pool buffer as one frame, with the
+/// given type field, now.
+///
+static void write_frame(struct dll_eth_state *state,
+                        const CnetNICaddr dest,
+                        pkt_handle handle,
+                        uint16_t type) {
+  uint16_t length = pkt_length(handle);
+  struct eth_header header;                 // This will hold our header for transmission.
   
   // Set the destination and source address
-  memcpy(frame.dest, dest, sizeof(CnetNICaddr));
-  memcpy(frame.src, linkinfo[state->link].nicaddr, sizeof(CnetNICaddr));
+  memcpy(header.dest, dest, sizeof(CnetNICaddr));
+  memcpy(header.src, linkinfo[state->link].nicaddr, sizeof(CnetNICaddr));
       
-  // Set the length of the payload.
-  memcpy(frame.type, &length, sizeof(length));
+  // Set the length of the payload, and whether it is a bundle.
+  memcpy(header.type, &type, sizeof(type));
     
-  // Copy the payload into the frame.
-  memcpy(frame.data, data, length);
-  
-  // Copy the frame and frame length across to be used in the event of a collision.
-  // state->collframe = iframe;	// Does not work.
-  // state->collframe_length = length;	// Does not work.
+  // Prepend the header to the payload, in the buffer's headroom.
+  char *frame = pkt_headroom(handle, ETH_HEADER_LENGTH);
+  memcpy(frame, &header, ETH_HEADER_LENGTH);
     
   // Calculate the number of bytes to send.
   size_t frame_length = length + ETH_HEADER_LENGTH;
   if (frame_length < ETH_MINFRAME) frame_length = ETH_MINFRAME;	// If frame length is less than the minimum frame size pad the frame to the minimum size.
 
-  CHECK(CNET_write_physical(state->link, &frame, &frame_length));	// Write the frame to the physical layer.
+  CHECK(CNET_write_physical(state->link, frame, &frame_length));	// Write the frame to the physical layer.
+  ++state->frames_sent;
+  ++state->payloads_sent;
 }
 
 /// Called when a frame has been received on the Ethernet link. This function
@@ -197,9 +473,42 @@ void dll_eth_read(struct dll_eth_state *state,
   
   // Extract the length of the payload from the Ethernet frame.
   uint16_t payload_length = 0;
-  memcpy(&payload_length, frame->type, sizeof(payload_length));
+  memcpy(&payload_length, frame->header.type, sizeof(payload_length));
+  
+  // Ignore frames unicast to other nodes on the segment.
+  if (!dll_for_us(state->link, frame->header.dest)) return;
   
-  // Send the frame up to the next layer.
-  if (state->nl_callback)
-    (*(state->nl_callback))(state->link, frame->data, payload_length);
+  if (!state->nl_callback) return;
+
+  if (!(payload_length & ETH_BUNDLE_FLAG)) {
+    // Send the frame up to the next layer.
+    (*(state->nl_callback))(state->link, frame->header.dest, frame->header.src,
+                            frame->data, payload_length);
+    return;
+  }
+
+  // Send each payload of a bundle up in turn, stopping at a truncated one.
+  size_t bundle_length = payload_length & ~ETH_BUNDLE_FLAG;
+  if (bundle_length > length - ETH_HEADER_LENGTH) return;
+
+  const unsigned char *p = (const unsigned char *)frame->data;
+  const unsigned char *end = p + bundle_length;
+  while (end - p >= ETH_RECORD_LENGTH) {
+    size_t record = p[0] | (p[1] << 8);
+    p += ETH_RECORD_LENGTH;
+    if (record > (size_t)(end - p)) return;
+
+    (*(state->nl_callback))(state->link, frame->header.dest, frame->header.src,
+                            (const char *)p, record);
+    p += record;
+  }
+}
+
+/// Print the frames sent on the given Ethernet link.
+///
+void dll_eth_report(const struct dll_eth_state *state) {
+  printf("ETH link %d: %d frames sent carrying %d payloads, %d of them in "
+         "bundles, %d frames dropped waiting for the line.\n", state->link,
+         state->frames_sent, state->payloads_sent, state->payloads_bundled,
+         state->frames_dropped);
 } 
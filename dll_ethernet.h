@@ -4,6 +4,7 @@
 #define DLL_ETHERNET_H
 
 #include "dll_shared.h"
+#include "packet_pool.h"
 
 #include <cnet.h>
 #include <stdint.h>
@@ -26,6 +27,21 @@ struct dll_eth_state *dll_eth_new_state(int link, up_from_dll_fn_ty callback);
 ///
 void dll_eth_delete_state(struct dll_eth_state *state);
 
+/// Returns the largest payload that one frame on the given Ethernet link can carry.
+///
+size_t dll_eth_mtu(const struct dll_eth_state *state);
+
+/// Bundle the payloads written to the given Ethernet link: payloads for the
+/// same destination are gathered into one frame of up to maxdata bytes, which
+/// is sent when it is full or deadline usecs after its first payload was
+/// written. A maxdata above dll_eth_mtu() gives jumbo frames, for links whose
+/// MTU allows them. A payload too large to share a frame with another is sent
+/// on its own. A deadline of zero turns bundling off again.
+///
+void dll_eth_bundle(struct dll_eth_state *state,
+                    size_t maxdata,
+                    CnetTime deadline);
+
 /// Write a frame to the given Ethernet link.
 ///
 void dll_eth_write(struct dll_eth_state *state,
@@ -33,6 +49,15 @@ void dll_eth_write(struct dll_eth_state *state,
                    const char *data,
                    uint16_t length);
 
+/// Write the payload held in the given pool buffer to the given Ethernet link. The
+/// header is prepended in the buffer's headroom, so the payload is not copied.
+/// The caller keeps its own reference; the link takes another if it has to
+/// defer the frame.
+///
+void dll_eth_write_pkt(struct dll_eth_state *state,
+                       CnetNICaddr dest,
+                       pkt_handle handle);
+
 /// Called when a frame has been received on the Ethernet link. This function
 /// will retrieve the payload, and then pass it to the callback function that
 /// is associated with the given state struct.
@@ -41,4 +66,9 @@ void dll_eth_read(struct dll_eth_state *state,
                   const char *data,
                   size_t length);
 
+/// Print the frames sent on the given Ethernet link, how many payloads they
+/// carried, and the frames dropped because too many waited for the line.
+///
+void dll_eth_report(const struct dll_eth_state *state);
+
 #endif // DLL_ETHERNET_H
@@ -3,13 +3,31 @@
 #ifndef DLL_SHARED_H
 #define DLL_SHARED_H
 
+#include <cnet.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
 #define DLL_MTU 8192 // The maximum size of any data link layer frame.
 
 /// Defines the type of callback functions used by the data link layers to send
-/// frame data up to the next layer.
+/// frame data up to the next layer. dest is the NIC address that the frame was
+/// sent to (ours, or the broadcast address), and src is the NIC that sent it.
 ///
-typedef void (*up_from_dll_fn_ty)(int link, char const *data, size_t length);
+typedef void (*up_from_dll_fn_ty)(int link,
+                                  const CnetNICaddr dest,
+                                  const CnetNICaddr src,
+                                  char const *data,
+                                  size_t length);
+
+/// Returns true iff a frame sent to dest should be received on the given link:
+/// dest is the link's own NIC address or the broadcast address.
+///
+static inline bool dll_for_us(int link, const CnetNICaddr dest) {
+  static const CnetNICaddr broadcast = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+  return memcmp(dest, linkinfo[link].nicaddr, sizeof(CnetNICaddr)) == 0 ||
+         memcmp(dest, broadcast, sizeof(CnetNICaddr)) == 0;
+}
 
 #endif // DLL_SHARED_H
@@ -1,8 +1,18 @@
 /// This file implements our WiFi data link layer. We implemented the carrier sense but
 //  we could not get the collision retansmission to work so the wifi data link layer
-//  currently detects collisions but does not attempt to retransmit.
+//  currently detects collisions but does not attempt to retransmit. Large unicast
+//  frames reserve the medium with binary RTS/CTS control frames, and every node
+//  that overhears one defers its own frames until the reservation ends. Data
+//  frames may be protected by parity frames (see fec.h), so that a receiver
+//  can rebuild a lost frame without it being sent again. Each data frame may
+//  be sent with no more power than its receiver needs (see power.h), and at the
+//  fastest rate that its receiver can decode (see rate.h).
 
 #include "dll_wifi.h"
+#include "fec.h"
+#include "packet_pool.h"
+#include "power.h"
+#include "rate.h"
 
 #include <cnet.h>
 #include <inttypes.h>
@@ -10,11 +20,81 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #define WIFI_MAXDATA 2312	// Define max wifi size.
 #define SLOT 39		     	// Define our backoff slot time. Can be between 28 or 50.
 
+#define WIFI_QUEUE_DEPTH 16       // Frames of each priority that wait at once.
+#define WIFI_RTS_THRESHOLD 256    // Unicast payloads of at least this many bytes
+                                  // are preceded by an RTS/CTS exchange.
+#define WIFI_SIFS 10              // Usecs between the frames of one exchange.
+#define WIFI_RTS_RETRIES 4        // RTSs sent for one frame before it is dropped.
+
+#define WIFI_FEC_NONE 0xFF        // The index of a data frame in no parity group.
+#define WIFI_FEC_SENDERS 8        // Senders whose parity groups we follow at once.
+#define WIFI_INITIAL_LOSS 0.05    // The loss that we assume before we observe any.
+
+/// This enumerates the kinds of WiFi frame. RTS and CTS frames are control
+/// frames: a header with no payload. A parity frame is broadcast after a group
+/// of data frames, and carries their XOR.
+///
+enum wifi_frame_type {
+  WIFI_DATA,
+  WIFI_RTS,
+  WIFI_CTS,
+  WIFI_PARITY
+};
+
+/// This struct holds the frames of one priority that are waiting for the
+/// medium: references to their payloads, oldest at head, and their
+/// destinations.
+///
+struct wifi_queue {
+  pkt_handle frames[WIFI_QUEUE_DEPTH];
+  CnetNICaddr dest[WIFI_QUEUE_DEPTH];
+  int head;
+  int count;
+
+  // The frames of this priority sent, and dropped because the queue was full
+  // or the medium never cleared.
+  int sent;
+  int dropped;
+};
+
+/// This struct holds the contention parameters of one priority, after EDCA:
+/// the slots that a frame waits once the medium is free, and the least and
+/// greatest contention windows that its random backoff is drawn from.
+///
+struct wifi_edca {
+  int aifsn;
+  int cw_min;
+  int cw_max;
+};
+
+/// The contention parameters of each priority, from the lowest. Bulk frames
+/// contend like 802.11e background traffic, interactive frames like video and
+/// control frames like voice, so control frames almost always win the medium.
+///
+static const struct wifi_edca edca[WIFI_PRIORITIES] = {
+  { 7, 15, 1023 },
+  { 2, 7, 15 },
+  { 2, 3, 7 }
+};
+
+/// This struct holds the parity group that we are receiving from one sender:
+/// the XOR of the data frames of the group that we have heard.
+///
+struct wifi_fec_rx {
+  bool used;
+  CnetNICaddr src;
+  CnetTime heard;
+
+  // True iff block holds frames of the given group.
+  bool active;
+  uint8_t group;
+  struct fec_block block;
+};
+
 /// This struct type will hold the state for one instance of the WiFi data
 /// link layer. The definition of the type is not important for clients.
 ///
@@ -28,6 +108,24 @@ struct dll_wifi_state {
   // True iff this node is part of the DS (i.e. an access point).
   bool is_ds;
 
+  // The frames waiting for the medium, by priority. The highest priority
+  // queue with frames is always served first.
+  struct wifi_queue queues[WIFI_PRIORITIES];
+
+  // The timer that next tries to send from the queues (or that gives up
+  // waiting for a CTS), or NULLTIMER.
+  CnetTimerID timer;
+
+  // True iff we have sent an RTS for the frame at the head of the queue of
+  // rts_priority, and wait for its CTS; and the RTSs sent for it so far.
+  bool awaiting_cts;
+  int rts_priority;
+  int rts_tries;
+
+  // The network allocation vector: the medium is reserved for another
+  // exchange that we overheard until this time.
+  CnetTime nav_until;
+
   // This will store our frame to be used in case of collision.
   //struct wifi_frame collframe; // Does not work.
 
@@ -40,22 +138,83 @@ struct dll_wifi_state {
   // The number of collisions on our line.
   //int collisions; // Does not work.
 
-// Add members to represent the WiFi link's state here.
+  // Counts of the RTSs we sent, the CTSs that answered them and those that
+  // did not come, and the times that the NAV deferred a frame.
+  int rts_sent;
+  int cts_received;
+  int cts_timeouts;
+  int nav_deferrals;
+
+  // True iff we protect our data frames with parity, and the fraction of our
+  // frames that we see lost, from unanswered RTSs and collisions.
+  bool fec;
+  double loss;
+
+  // The group of data frames being sent, its number and its size (0 if the
+  // frames are not protected), and the parity of the last group iff it
+  // waits for the medium.
+  struct fec_block fec_tx;
+  uint8_t fec_group;
+  int fec_size;
+  struct fec_block fec_parity;
+  uint8_t parity_group;
+  bool parity_pending;
+
+  // The parity groups being received from the senders that we hear.
+  struct wifi_fec_rx fec_rx[WIFI_FEC_SENDERS];
+
+  // Counts of the parity frames that we sent, and the frames that we rebuilt.
+  int parity_sent;
+  int frames_rebuilt;
+
+  // True iff we send each data frame with only the power that its receiver
+  // needs, the power of each receiver, and the power that the link is set to
+  // now.
+  bool tpc;
+  struct power_state power;
+  double tx_power;
+
+  // True iff we send each unicast frame at the rate that its receiver can
+  // take, the rate of each receiver, and the bandwidth that the link is set
+  // to now.
+  bool rate_adapt;
+  struct rate_state rates;
+  CnetInt64 bandwidth;
+
+  // The frames that we heard too weakly to decode at the rate they were sent.
+  int rate_errors;
 };
 
 /// This struct specifies the format of the control section of a WiFi frame.
 struct wifi_control {
   unsigned from_ds : 1;
+  unsigned type : 2;    // An enum wifi_frame_type.
 };
 
-/// This struct specifies the format of a WiFi frame.
+/// This struct specifies the format of the header of a WiFi frame.
 ///
-struct wifi_frame {
+struct wifi_header {
   // Control section.
   struct wifi_control control;
   
   // Number of bytes in the payload.
   uint16_t length;
+
+  // Usecs for which the medium is reserved after this frame, by an RTS or CTS.
+  uint16_t duration;
+
+  // The parity group of a data or parity frame, and the index of a data frame
+  // in its group (or WIFI_FEC_NONE), or the number of frames that a parity
+  // frame covers.
+  uint8_t fec_group;
+  uint8_t fec_index;
+
+  // The margin (dB) by which the RTS that a CTS answers was heard, or
+  // POWER_MARGIN_UNKNOWN.
+  int8_t margin;
+
+  // The rate that a data frame was sent at (see rate.h).
+  uint8_t rate;
   
   // Address of the receiver.
   CnetNICaddr dest;
@@ -65,23 +224,472 @@ struct wifi_frame {
   
   // CRC32 for the entire frame.
   uint32_t checksum;
+};
+
+/// This struct specifies the format of a WiFi frame.
+///
+struct wifi_frame {
+  // Header section.
+  struct wifi_header header;
   
   // Data must be the last field, because we will truncate the unused area when
-  // sending to the physical layer.
-  char data[WIFI_MAXDATA];
+  // sending to the physical layer. A parity frame also codes the length and
+  // destination of its frames.
+  char data[WIFI_MAXDATA + FEC_PREFIX_LENGTH];
 };
 
-CnetTimerID lasttimer2 = NULLTIMER;	// This timer ID will hold our carrier sense timer.
 //CnetTimerID lasttimer3 = NULLTIMER;	// This timer ID will hold our collision timer.
-struct wifi_frame tempframe;		// This will be used to hold our buffered frame for retransmission when line is busy.
-uint16_t tempframe_length;		// This will be used to hold the size of our frame for retransmission use.
 
 #define WIFI_HEADER_LENGTH (offsetof(struct wifi_frame, data))
 
-/// This function will be used to attempt to retransmit our frame that was delayed.
+// The header is written into the headroom of a pool buffer, so it must fit.
+_Static_assert(WIFI_HEADER_LENGTH <= PKT_HEADROOM, "WiFi header exceeds headroom");
+_Static_assert(WIFI_MAXDATA <= PKT_MAXDATA, "WiFi payload exceeds pool buffer");
+_Static_assert(FEC_MAX_GROUP < WIFI_FEC_NONE, "Parity group exceeds frame index");
+
+static void try_send(struct dll_wifi_state *state);
+
+/// Returns the usecs that a frame with a payload of the given length occupies
+/// the medium on the given link, sent at the given rate.
+///
+static CnetTime airtime_at(const struct dll_wifi_state *state,
+                           int rate,
+                           size_t length) {
+  return (CnetTime)((WIFI_HEADER_LENGTH + length) * 8 * 1000000 /
+                    rate_bandwidth(&state->rates, rate)) + 1;
+}
+
+/// Returns the usecs that a frame with a payload of the given length occupies
+/// the medium on the given link, sent at the slowest rate, as control frames
+/// are.
+///
+static CnetTime airtime(const struct dll_wifi_state *state, size_t length) {
+  return airtime_at(state, 0, length);
+}
+
+/// Returns true iff the given NIC address is the broadcast address.
+///
+static bool is_broadcast(const CnetNICaddr dest) {
+  static const CnetNICaddr broadcast = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+  return memcmp(dest, broadcast, sizeof(CnetNICaddr)) == 0;
+}
+
+/// Returns the rate that a data frame to dest is sent at. Broadcasts, and
+/// every frame while rate adaptation is off, go at the slowest rate.
+///
+static int data_rate(const struct dll_wifi_state *state, const CnetNICaddr dest) {
+  if (!state->rate_adapt || is_broadcast(dest)) return 0;
+  return rate_for(&state->rates, dest);
+}
+
+/// Set the bandwidth of the link to that of the given rate, before a frame is
+/// written at it.
+///
+static void set_rate(struct dll_wifi_state *state, int rate) {
+  CnetInt64 bandwidth = rate_bandwidth(&state->rates, rate);
+  if (bandwidth == state->bandwidth) return;
+  
+  CHECK(CNET_set_bandwidth(state->link, bandwidth));
+  state->bandwidth = bandwidth;
+}
+
+/// Returns the margin (dB) by which we heard the frame that has just arrived,
+/// or POWER_MARGIN_UNKNOWN.
+///
+static int arrival_margin(const struct dll_wifi_state *state) {
+  double signal, angle;
+  WLANINFO info;
+  
+  if (CNET_wlan_arrival(state->link, &signal, &angle) != 0 ||
+      CNET_get_wlaninfo(state->link, &info) != 0)
+    return POWER_MARGIN_UNKNOWN;
+  return power_margin(&info, signal);
+}
+
+/// Returns the power (dBm) that a data frame to dest is sent with.
+/// Broadcasts, and every frame while power control is off, go with the full
+/// power of the link.
+///
+static double data_power(const struct dll_wifi_state *state,
+                         const CnetNICaddr dest) {
+  if (!state->tpc || is_broadcast(dest)) return state->power.max;
+  return power_for(&state->power, dest);
+}
+
+/// Set the power of the link to the given power (dBm), before a frame is
+/// written with it.
+///
+static void set_power(struct dll_wifi_state *state, double power) {
+  if (power == state->tx_power) return;
+  
+  WLANINFO info;
+  CHECK(CNET_get_wlaninfo(state->link, &info));
+  info.tx_power_dBm = power;
+  CHECK(CNET_set_wlaninfo(state->link, &info));
+  state->tx_power = power;
+}
+
+/// Start the timer that next tries to send from the queue, after the given
+/// delay. Any timer already running is replaced.
+///
+static void start_timer(struct dll_wifi_state *state, CnetTime delay) {
+  if (state->timer != NULLTIMER) CNET_stop_timer(state->timer);
+  state->timer = CNET_start_timer(EV_TIMER2, delay, (CnetData)state);
+}
+
+/// Returns the priority of the highest priority queue with frames, or -1 if
+/// every queue is empty.
+///
+static int next_priority(const struct dll_wifi_state *state) {
+  for (int priority = WIFI_PRIORITIES - 1; priority >= 0; --priority) {
+    if (state->queues[priority].count > 0) return priority;
+  }
+  return -1;
+}
+
+/// Returns the priority that the next frame to send contends with: a parity
+/// frame goes first, as a control frame. Returns -1 if nothing waits.
+///
+static int waiting_priority(const struct dll_wifi_state *state) {
+  return state->parity_pending ? WIFI_PRIORITIES - 1 : next_priority(state);
+}
+
+/// Fold a sample of whether a frame was lost (1) or not (0) into our estimate
+/// of the loss.
+///
+static void observe_loss(struct dll_wifi_state *state, int lost) {
+  state->loss += FEC_LOSS_ALPHA * (lost - state->loss);
+}
+
+/// Returns the usecs that a frame of the given priority waits for the medium:
+/// its AIFS, and a random backoff drawn from a window that doubles with each
+/// of the given number of failed attempts.
+///
+static CnetTime contend(int priority, int attempts) {
+  const struct wifi_edca *params = &edca[priority < 0 ? 0 : priority];
+  
+  int cw = params->cw_min;
+  for (int i = 0; i < attempts && cw < params->cw_max; ++i) cw = 2 * cw + 1;
+  if (cw > params->cw_max) cw = params->cw_max;
+  
+  return (CnetTime)SLOT * (params->aifsn + CNET_rand() % (cw + 1));
+}
+
+/// Release the frame at the head of the queue of the given priority.
+///
+static void dequeue(struct dll_wifi_state *state, int priority) {
+  struct wifi_queue *q = &state->queues[priority];
+  
+  pkt_release(q->frames[q->head]);
+  q->frames[q->head] = PKT_NULL;
+  q->head = (q->head + 1) % WIFI_QUEUE_DEPTH;
+  --q->count;
+  state->rts_tries = 0;
+}
+
+/// Write a control frame of the given type to dest, reserving the medium for
+/// the given number of usecs after it, and carrying the given margin.
+///
+static void write_control(struct dll_wifi_state *state,
+                          enum wifi_frame_type type,
+                          const CnetNICaddr dest,
+                          CnetTime duration,
+                          int margin) {
+  struct wifi_header header = (struct wifi_header) {
+    .control = (struct wifi_control) {
+      .from_ds = (state->is_ds ? 1 : 0),
+      .type = type
+    },
+    .length = 0,
+    .duration = (uint16_t)(duration < UINT16_MAX ? duration : UINT16_MAX),
+    .margin = (int8_t)margin
+  };
+  
+  memcpy(header.dest, dest, sizeof(CnetNICaddr));
+  memcpy(header.src, linkinfo[state->link].nicaddr, sizeof(CnetNICaddr));
+  header.checksum = CNET_crc32((unsigned char *)&header, WIFI_HEADER_LENGTH);
+  
+  // Control frames go with full power, at the slowest rate, so that every
+  // node that could be hidden from the exchange hears its reservation.
+  size_t frame_length = WIFI_HEADER_LENGTH;
+  set_power(state, state->power.max);
+  set_rate(state, 0);
+  CHECK(CNET_write_physical(state->link, &header, &frame_length));
+}
+
+/// Write the given payload to dest as a data frame, now.
+///
+static void write_data(struct dll_wifi_state *state,
+                       const CnetNICaddr dest,
+                       pkt_handle handle) {
+  uint16_t length = pkt_length(handle);
+  int rate = data_rate(state, dest);
+  
+  // Create a header and initialize the length field.
+  struct wifi_header header = (struct wifi_header) {
+    .control = (struct wifi_control) {
+      .from_ds = (state->is_ds ? 1 : 0),
+      .type = WIFI_DATA
+    },
+    .length = length,
+    .fec_group = state->fec_group,
+    .fec_index = (uint8_t)(state->fec_size > 0 ? state->fec_tx.count
+                                                : WIFI_FEC_NONE),
+    .margin = POWER_MARGIN_UNKNOWN,
+    .rate = (uint8_t)rate
+  };
+  
+  // Set the destination and source address.
+  memcpy(header.dest, dest, sizeof(CnetNICaddr));
+  memcpy(header.src, linkinfo[state->link].nicaddr, sizeof(CnetNICaddr));
+  
+  // Prepend the header to the payload, in the buffer's headroom.
+  char *frame = pkt_headroom(handle, WIFI_HEADER_LENGTH);
+  memcpy(frame, &header, WIFI_HEADER_LENGTH);
+  
+  // Calculate the number of bytes to send.
+  size_t frame_length = WIFI_HEADER_LENGTH + length;
+  
+  // Set the checksum over the header and the payload only.
+  header.checksum = CNET_crc32((unsigned char *)frame, frame_length);
+  memcpy(frame + offsetof(struct wifi_header, checksum),
+         &header.checksum, sizeof(header.checksum));
+  
+  set_power(state, data_power(state, dest));
+  set_rate(state, rate);
+  CHECK(CNET_write_physical(state->link, frame, &frame_length));
+  if (state->rate_adapt) rate_sent(&state->rates, dest, rate);
+}
+
+/// End the group of data frames being sent: its parity waits to be sent next,
+/// replacing the parity of the group before if that has not gone yet. The
+/// parity of a group of one frame would only repeat it, so none is sent.
+///
+static void end_group(struct dll_wifi_state *state) {
+  if (state->fec_tx.count == 0) return;
+  
+  if (state->fec_tx.count == 1) {
+    fec_clear(&state->fec_tx);
+    ++state->fec_group;
+    return;
+  }
+  
+  fec_clear(&state->fec_parity);
+  memcpy(state->fec_parity.data, state->fec_tx.data, state->fec_tx.length);
+  state->fec_parity.length = state->fec_tx.length;
+  state->fec_parity.count = state->fec_tx.count;
+  state->parity_group = state->fec_group;
+  state->parity_pending = true;
+  
+  fec_clear(&state->fec_tx);
+  ++state->fec_group;
+}
+
+/// Send the frame at the head of the queue of the given priority, whose CTS
+/// (if it needed one) has arrived, and try the next frame once it has left.
+///
+static void send_head(struct dll_wifi_state *state, int priority) {
+  struct wifi_queue *q = &state->queues[priority];
+  pkt_handle handle = q->frames[q->head];
+  CnetTime sent = airtime_at(state, data_rate(state, q->dest[q->head]),
+                             pkt_length(handle));
+  
+  // Each group is as large as the loss that we see when it starts calls for.
+  if (state->fec_tx.count == 0)
+    state->fec_size = state->fec ? fec_group_size(state->loss) : 0;
+  
+  write_data(state, q->dest[q->head], handle);
+  if (state->fec_size > 0)
+    fec_add(&state->fec_tx, q->dest[q->head], pkt_data(handle),
+            pkt_length(handle));
+  dequeue(state, priority);
+  ++q->sent;
+  
+  // A group ends when it is full, or when the queues drain, so that no frame
+  // waits in an open group while the link is idle.
+  if (state->fec_tx.count >= state->fec_size || next_priority(state) < 0)
+    end_group(state);
+  
+  // SIFS only separates the frames of one exchange: the next frame contends
+  // for the medium again, with its AIFS and backoff.
+  int next = waiting_priority(state);
+  if (next >= 0) start_timer(state, sent + contend(next, 0));
+}
+
+/// Send the parity of the last group, which is broadcast so that every node
+/// that heard part of the group can use it.
+///
+static void send_parity(struct dll_wifi_state *state) {
+  struct wifi_frame frame;
+  size_t length = state->fec_parity.length;
+  
+  frame.header = (struct wifi_header) {
+    .control = (struct wifi_control) {
+      .from_ds = (state->is_ds ? 1 : 0),
+      .type = WIFI_PARITY
+    },
+    .length = (uint16_t)length,
+    .fec_group = state->parity_group,
+    .fec_index = (uint8_t)state->fec_parity.count,
+    .margin = POWER_MARGIN_UNKNOWN
+  };
+  memset(frame.header.dest, 0xff, sizeof(CnetNICaddr));
+  memcpy(frame.header.src, linkinfo[state->link].nicaddr, sizeof(CnetNICaddr));
+  memcpy(frame.data, state->fec_parity.data, length);
+  
+  size_t frame_length = WIFI_HEADER_LENGTH + length;
+  frame.header.checksum = CNET_crc32((unsigned char *)&frame, frame_length);
+  set_power(state, state->power.max);
+  set_rate(state, 0);
+  CHECK(CNET_write_physical(state->link, &frame, &frame_length));
+  
+  state->parity_pending = false;
+  ++state->parity_sent;
+  
+  int next = next_priority(state);
+  if (next >= 0) start_timer(state, airtime(state, length) + contend(next, 0));
+}
+
+/// Called when it is time to try the queue again, or when a CTS has not come.
 ///
 static EVENT_HANDLER(backoff) {
-  dll_wifi_write((struct dll_wifi_state *)data, tempframe.dest, tempframe.data, tempframe_length);
+  struct dll_wifi_state *state = (struct dll_wifi_state *)data;
+  
+  state->timer = NULLTIMER;
+  
+  if (state->awaiting_cts) {
+    state->awaiting_cts = false;
+    ++state->cts_timeouts;
+    observe_loss(state, 1);
+    printf("WIFI: no CTS, backing off....\n");
+    
+    // Our RTS may not have reached its receiver: speak up, and slow down.
+    const struct wifi_queue *q = &state->queues[state->rts_priority];
+    if (state->tpc) power_lost(&state->power, q->dest[q->head]);
+    if (state->rate_adapt) rate_lost(&state->rates, q->dest[q->head]);
+    
+    if (state->rts_tries >= WIFI_RTS_RETRIES) {
+      ++state->queues[state->rts_priority].dropped;
+      dequeue(state, state->rts_priority);
+    } else {
+      wifi_exp_backoff(state);
+      return;
+    }
+  }
+  
+  try_send(state);
+}
+
+/// Try to send the frame at the head of the highest priority queue. It waits
+/// while the NAV reserves the medium for another exchange, or while the
+/// carrier is busy; a large unicast frame first reserves the medium itself
+/// with an RTS.
+///
+static void try_send(struct dll_wifi_state *state) {
+  int priority = waiting_priority(state);
+  if (priority < 0 || state->awaiting_cts) return;
+  if (state->timer != NULLTIMER) return;
+  
+  // Wait out the exchange that we overheard, then contend as usual.
+  if (nodeinfo.time_in_usec < state->nav_until) {
+    ++state->nav_deferrals;
+    start_timer(state, state->nav_until - nodeinfo.time_in_usec +
+                       contend(priority, 0));
+    return;
+  }
+  
+  // Check if the link is busy or not
+  if(CNET_carrier_sense(state->link) == 1) {
+    printf("WIFI: line busy, waiting....\n");
+    wifi_exp_backoff(state); // Call our exponential delay.
+    return;
+  }
+  state->busy = 0;	// Reset our count because the line is clear.
+  
+  // The parity of the last group follows it before any other frame.
+  if (state->parity_pending) {
+    send_parity(state);
+    return;
+  }
+  
+  struct wifi_queue *q = &state->queues[priority];
+  pkt_handle handle = q->frames[q->head];
+  const unsigned char *dest = q->dest[q->head];
+  
+  if (pkt_length(handle) < WIFI_RTS_THRESHOLD || is_broadcast(dest)) {
+    send_head(state, priority);
+    return;
+  }
+  
+  // Reserve the medium for the CTS and the frame, and wait for the CTS.
+  CnetTime cts = airtime(state, 0);
+  CnetTime reserve = WIFI_SIFS + cts + WIFI_SIFS +
+                     airtime_at(state, data_rate(state, dest), pkt_length(handle));
+  
+  write_control(state, WIFI_RTS, dest, reserve, POWER_MARGIN_UNKNOWN);
+  ++state->rts_sent;
+  ++state->rts_tries;
+  state->awaiting_cts = true;
+  state->rts_priority = priority;
+  start_timer(state, airtime(state, 0) + 2 * WIFI_SIFS + cts +
+                     2 * linkinfo[state->link].propagationdelay + SLOT);
+}
+
+/// Handle an RTS or CTS frame. One that is for another node reserves the
+/// medium for its exchange; one for us is answered, or lets our frame go.
+///
+static void read_control(struct dll_wifi_state *state,
+                         const struct wifi_header *header) {
+  if (!dll_for_us(state->link, header->dest) || is_broadcast(header->dest)) {
+    CnetTime until = nodeinfo.time_in_usec + header->duration;
+    if (until > state->nav_until) state->nav_until = until;
+    return;
+  }
+  
+  switch (header->control.type) {
+    case WIFI_RTS: {
+      // Only answer while we do not know of another exchange.
+      if (nodeinfo.time_in_usec < state->nav_until) return;
+      
+      CnetTime cts = airtime(state, 0);
+      CnetTime left = header->duration > WIFI_SIFS + cts
+                        ? header->duration - WIFI_SIFS - cts : 0;
+      
+      // Tell the sender how well we heard its RTS, so it can use less power
+      // and a faster rate.
+      write_control(state, WIFI_CTS, header->src, left, arrival_margin(state));
+      break;
+    }
+    
+    case WIFI_CTS: {
+      // A CTS is only ours if it comes from the node that we sent our RTS to.
+      const struct wifi_queue *q = &state->queues[state->rts_priority];
+      if (!state->awaiting_cts ||
+          memcmp(header->src, q->dest[q->head], sizeof(CnetNICaddr)) != 0)
+        return;
+      
+      if (state->timer != NULLTIMER) CNET_stop_timer(state->timer);
+      state->timer = NULLTIMER;
+      state->awaiting_cts = false;
+      ++state->cts_received;
+      observe_loss(state, 0);
+      
+      // Our RTS went with full power, so its margin chooses the rate, and
+      // the rest of the margin that the rate does not need is spent on
+      // sending the data frame with less power.
+      if (header->margin != POWER_MARGIN_UNKNOWN) {
+        int needed = 0;
+        if (state->rate_adapt)
+          needed = rate_margin(rate_reported(&state->rates, header->src,
+                                             header->margin));
+        if (state->tpc)
+          power_reported(&state->power, header->src, state->power.max,
+                         header->margin - needed);
+      }
+      send_head(state, state->rts_priority);
+      break;
+    }
+  }
 }
 
 /// This function will be used to with our frame collision.
@@ -96,6 +704,7 @@ static EVENT_HANDLER(backoff) {
 void wifi_coll_exp_backoff(struct dll_wifi_state *state) {
   //state->collisions++;
   printf("WIFI: collision, waiting....\n");
+  if (state != NULL) observe_loss(state, 1);
   //srand(time(NULL)); // Create a new seed to be used in our rand function.
   //int c;        // Create an integer to be used to help generate our random backoff time.
 
@@ -112,23 +721,27 @@ void wifi_coll_exp_backoff(struct dll_wifi_state *state) {
   return;                      
 }
 
-/// This function will process our exponential backoff. 
+/// This function will process our exponential backoff. The window that the
+/// backoff is drawn from depends on the priority of the frame that waits.
 ///
 void wifi_exp_backoff(struct dll_wifi_state *state) {
   state->busy++;	// Increment our state because the line is busy.
-  srand(time(NULL)); // Create a new seed to be used in our rand function.
-  int c;	// Create an integer to be used to help generate our random backoff time.
+  int priority = waiting_priority(state);
      
   // If more than 16 delays discard the frame.
   if(state->busy > 16) {
     state->busy = 0;
+    if (state->parity_pending) {
+      state->parity_pending = false;
+    } else if (priority >= 0) {
+      ++state->queues[priority].dropped;
+      dequeue(state, priority);
+    }
+    if (waiting_priority(state) >= 0) start_timer(state, SLOT);
     return;
   }
-  else if(state->busy >= 10) c = rand() % (int)pow(2, 10);	// Back off for maximum time.
-  else if(state->busy < 10) c = rand() % (int)pow(2, state->busy);	// Calculate backoff time.
     
-  CnetTime backoff = ((CnetTime)SLOT * c);	// Set amount of time to delay.
-  lasttimer2 = CNET_start_timer(EV_TIMER2, backoff, (CnetData)state);	// Start timer.
+  start_timer(state, contend(priority, state->busy));	// Start timer.
   return;
 }
 
@@ -150,6 +763,22 @@ struct dll_wifi_state *dll_wifi_new_state(int link,
   state->link = link;
   state->nl_callback = callback;
   state->is_ds = is_ds;
+  for (int priority = 0; priority < WIFI_PRIORITIES; ++priority) {
+    for (int i = 0; i < WIFI_QUEUE_DEPTH; ++i)
+      state->queues[priority].frames[i] = PKT_NULL;
+  }
+  state->timer = NULLTIMER;
+  state->loss = WIFI_INITIAL_LOSS;
+  
+  // Until power control is enabled, we send with the power the link has.
+  WLANINFO info;
+  CHECK(CNET_get_wlaninfo(link, &info));
+  power_init(&state->power, info.tx_power_dBm);
+  state->tx_power = info.tx_power_dBm;
+  
+  // The configured bandwidth of the link is its slowest rate.
+  rate_init(&state->rates, linkinfo[link].bandwidth);
+  state->bandwidth = linkinfo[link].bandwidth;
   //state->collisions = 0;  // Does not work.
   
   // Call our required event handlers
@@ -167,57 +796,168 @@ void dll_wifi_delete_state(struct dll_wifi_state *state) {
   if (state == NULL) return;
   
   // Free any dynamic memory that is used by the members of the state.
+  if (state->timer != NULLTIMER) CNET_stop_timer(state->timer);
+  for (int priority = 0; priority < WIFI_PRIORITIES; ++priority) {
+    while (state->queues[priority].count > 0) dequeue(state, priority);
+  }
   free(state);
 }
 
+/// Returns the largest payload that one frame on the given WiFi link can carry.
+///
+size_t dll_wifi_mtu(const struct dll_wifi_state *state) {
+  return WIFI_MAXDATA;
+}
+
+/// Protect the data frames sent on the given WiFi link with parity, or not.
+///
+void dll_wifi_fec(struct dll_wifi_state *state, bool enabled) {
+  if (state == NULL) return;
+  
+  // A group being sent is finished under the old setting.
+  end_group(state);
+  state->fec = enabled;
+}
+
+/// Send each frame on the given WiFi link with only the power that its
+/// receiver needs, or not.
+///
+void dll_wifi_power_control(struct dll_wifi_state *state, bool enabled) {
+  if (state == NULL) return;
+  state->tpc = enabled;
+}
+
+/// Send each unicast frame on the given WiFi link at the rate that its
+/// receiver can take, or not.
+///
+void dll_wifi_rate_adaptation(struct dll_wifi_state *state, bool enabled) {
+  if (state == NULL) return;
+  state->rate_adapt = enabled;
+}
+
+/// Returns the usecs that a payload of the given length to dest takes on the
+/// given WiFi link.
+///
+CnetTime dll_wifi_airtime(const struct dll_wifi_state *state,
+                          const CnetNICaddr dest,
+                          size_t length) {
+  return airtime_at(state, data_rate(state, dest), length);
+}
+
 /// Write a frame to the given WiFi link.
 ///
 void dll_wifi_write(struct dll_wifi_state *state,
                     CnetNICaddr dest,
                     const char *data,
-                    uint16_t length) {
+                    uint16_t length,
+                    int priority) {
   // If data is empty or length is larger than maximum discard data.
   if (!data || length == 0 || length > WIFI_MAXDATA) return;
- 
-  // Check if the link is busy or not
-  if(CNET_carrier_sense(state->link) == 1) {
-    // Copy our data into a temp frame for retransmission.
-    memcpy(tempframe.dest, dest, sizeof(CnetNICaddr));
-    memcpy(tempframe.data, data, length);
-    tempframe_length = length;
-    
-    printf("WIFI: line busy, waiting....\n");
-    wifi_exp_backoff(state); // Call our exponential delay.
+  
+  // Copy the payload into a pool buffer once, and hand that to the link.
+  pkt_handle handle = pkt_copy_in(data, length);
+  if (handle == PKT_NULL) return;
+  
+  dll_wifi_write_pkt(state, dest, handle, priority);
+  pkt_release(handle);
+}
+
+/// Write the payload held in the given pool buffer to the given WiFi link.
+///
+void dll_wifi_write_pkt(struct dll_wifi_state *state,
+                        CnetNICaddr dest,
+                        pkt_handle handle,
+                        int priority) {
+  if (handle == PKT_NULL) return;
+  
+  uint16_t length = pkt_length(handle);
+  
+  // If data is empty or length is larger than maximum discard data.
+  if (length == 0 || length > WIFI_MAXDATA) return;
+  
+  if (priority < 0) priority = 0;
+  if (priority >= WIFI_PRIORITIES) priority = WIFI_PRIORITIES - 1;
+  struct wifi_queue *q = &state->queues[priority];
+  
+  // If the queue is full then discard.
+  if (q->count == WIFI_QUEUE_DEPTH) {
+    printf("WIFI: queue full, dropping frame.\n");
+    ++q->dropped;
     return;
   }
-  state->busy = 0;	// Reset our count because the line is clear.
   
-  // Create a frame and initialize the length field.
-  struct wifi_frame frame = (struct wifi_frame) {
-    .control = (struct wifi_control) {
-      .from_ds = (state->is_ds ? 1 : 0)
-    },
-    .length = length
-  };
+  // Hold a reference to the payload until it is sent, rather than a copy.
+  int tail = (q->head + q->count) % WIFI_QUEUE_DEPTH;
+  q->frames[tail] = pkt_ref(handle);
+  memcpy(q->dest[tail], dest, sizeof(CnetNICaddr));
+  ++q->count;
   
-  // Set the destination and source address.
-  memcpy(frame.dest, dest, sizeof(CnetNICaddr));
-  memcpy(frame.src, linkinfo[state->link].nicaddr, sizeof(CnetNICaddr));
+  try_send(state);
+}
+
+/// Returns the parity group being received from src. A sender that we do not
+/// follow yet takes a free entry, or that of the sender heard least recently.
+///
+static struct wifi_fec_rx *fec_sender(struct dll_wifi_state *state,
+                                      const CnetNICaddr src) {
+  struct wifi_fec_rx *spare = NULL;
   
-  // Copy in the payload.
-  memcpy(frame.data, data, length);
+  for (int i = 0; i < WIFI_FEC_SENDERS; ++i) {
+    struct wifi_fec_rx *rx = &state->fec_rx[i];
+    
+    if (rx->used && memcmp(rx->src, src, sizeof(CnetNICaddr)) == 0) {
+      rx->heard = nodeinfo.time_in_usec;
+      return rx;
+    }
+    if (spare == NULL || (spare->used && (!rx->used || rx->heard < spare->heard)))
+      spare = rx;
+  }
   
-  // Set the checksum.
-  frame.checksum = CNET_crc32((unsigned char *)&frame, sizeof(frame));
+  spare->used = true;
+  memcpy(spare->src, src, sizeof(CnetNICaddr));
+  spare->heard = nodeinfo.time_in_usec;
+  spare->active = false;
+  fec_clear(&spare->block);
+  return spare;
+}
 
-  // Copy data into our collision frames in case there is a collision.
-  //state->collframe = frame;	// Does not work. 
-  //state->collframe_length = length;	// Does not work.
+/// Copy the data or parity frame of the given length into frame, and return
+/// true iff its checksum is intact.
+///
+static bool read_frame(const char *data, size_t length, struct wifi_frame *frame) {
+  memcpy(frame, data, length);
   
-  // Calculate the number of bytes to send.
-  size_t frame_length = WIFI_HEADER_LENGTH + length;
+  uint32_t checksum = frame->header.checksum;
+  frame->header.checksum = 0;
+  return CNET_crc32((unsigned char *)frame, WIFI_HEADER_LENGTH +
+                    frame->header.length) == checksum;
+}
+
+/// Handle an intact parity frame. If we missed exactly one frame of its
+/// group, then that frame is rebuilt and, if it is for us, sent up.
+///
+static void read_parity(struct dll_wifi_state *state,
+                        const struct wifi_frame *frame) {
+  struct wifi_fec_rx *rx = fec_sender(state, frame->header.src);
+  if (!rx->active || rx->group != frame->header.fec_group) fec_clear(&rx->block);
   
-  CHECK(CNET_write_physical(state->link, &frame, &frame_length));  
+  int missed = frame->header.fec_index - rx->block.count;
+  if (missed == 1) {
+    CnetNICaddr dest;
+    char payload[PKT_MAXDATA];
+    int rebuilt = fec_recover(&rx->block, frame->data, frame->header.length,
+                              dest, payload);
+    
+    if (rebuilt > 0 && rebuilt <= WIFI_MAXDATA &&
+        dll_for_us(state->link, dest) && state->nl_callback) {
+      ++state->frames_rebuilt;
+      (*(state->nl_callback))(state->link, dest, frame->header.src,
+                              payload, (size_t)rebuilt);
+    }
+  }
+  
+  rx->active = false;
+  fec_clear(&rx->block);
 }
 
 /// Called when a frame has been received on the WiFi link. This function will
@@ -227,21 +967,106 @@ void dll_wifi_write(struct dll_wifi_state *state,
 void dll_wifi_read(struct dll_wifi_state *state,
                    const char *data,
                    size_t length) {
-  // If frame is too large then discard.
-  if (length > sizeof(struct wifi_frame)) {
+  // If frame is too large or too small then discard.
+  if (length > sizeof(struct wifi_frame) || length < WIFI_HEADER_LENGTH) {
     return;
   }
   
   // Treat the data as a WiFi frame.
   const struct wifi_frame *frame = (const struct wifi_frame *)data;
   
+  // Control frames are handled here, whoever sent them: every node that hears
+  // one must respect its reservation.
+  if (frame->header.control.type == WIFI_RTS ||
+      frame->header.control.type == WIFI_CTS) {
+    struct wifi_header header;
+    memcpy(&header, data, WIFI_HEADER_LENGTH);
+    
+    uint32_t checksum = header.checksum;
+    header.checksum = 0;
+    if (CNET_crc32((unsigned char *)&header, WIFI_HEADER_LENGTH) != checksum)
+      return;
+    
+    read_control(state, &header);
+    return;
+  }
+  
   // Ignore WiFi frames received from other APs.
-  if (frame->control.from_ds && state->is_ds) {
+  if (frame->header.control.from_ds && state->is_ds) {
     printf("\tWiFi: Ignoring frame from access point.\n");
     return;
   }
   
+  if (frame->header.length > length - WIFI_HEADER_LENGTH) return;
+  
+  // A corrupted frame is treated as missing, so that it is not counted in a
+  // parity group, and can be rebuilt from the group's parity.
+  struct wifi_frame received;
+  if (!read_frame(data, length, &received)) return;
+  frame = &received;
+  
+  if (frame->header.control.type == WIFI_PARITY) {
+    read_parity(state, frame);
+    return;
+  }
+  
+  // A frame sent faster than its signal allows cannot be decoded.
+  if (frame->header.rate > 0 &&
+      arrival_margin(state) < rate_margin(frame->header.rate)) {
+    ++state->rate_errors;
+    return;
+  }
+  
+  // Every protected frame that we hear may help rebuild one that we miss,
+  // whoever it is for.
+  if (frame->header.fec_index != WIFI_FEC_NONE) {
+    struct wifi_fec_rx *rx = fec_sender(state, frame->header.src);
+    if (!rx->active || rx->group != frame->header.fec_group) {
+      fec_clear(&rx->block);
+      rx->group = frame->header.fec_group;
+      rx->active = true;
+    }
+    fec_add(&rx->block, frame->header.dest, frame->data, frame->header.length);
+  }
+  
+  // Ignore frames unicast to other nodes.
+  if (!dll_for_us(state->link, frame->header.dest)) return;
+  
   // Send the frame up to the next layer.
   if (state->nl_callback)
-    (*(state->nl_callback))(state->link, frame->data, frame->length);
+    (*(state->nl_callback))(state->link, frame->header.dest, frame->header.src,
+                            frame->data, frame->header.length);
+}
+
+/// Returns the number of frames waiting for the medium.
+///
+int dll_wifi_queued(const struct dll_wifi_state *state) {
+  int queued = 0;
+  for (int priority = 0; priority < WIFI_PRIORITIES; ++priority)
+    queued += state->queues[priority].count;
+  return queued;
+}
+
+/// Print the RTS/CTS counters of the given WiFi link.
+///
+void dll_wifi_report(const struct dll_wifi_state *state) {
+  printf("WIFI link %d: %d RTS sent, %d CTS received, %d CTS timeouts, "
+         "%d deferrals to the NAV.\n", state->link, state->rts_sent,
+         state->cts_received, state->cts_timeouts, state->nav_deferrals);
+  
+  for (int priority = WIFI_PRIORITIES - 1; priority >= 0; --priority) {
+    printf("WIFI link %d: priority %d sent %d frames, dropped %d.\n",
+           state->link, priority, state->queues[priority].sent,
+           state->queues[priority].dropped);
+  }
+  
+  printf("WIFI link %d: loss %.3f, %d parity frames sent, %d frames rebuilt.\n",
+         state->link, state->loss, state->parity_sent, state->frames_rebuilt);
+  
+  if (state->tpc) power_report(&state->power, state->link);
+  if (state->rate_adapt) {
+    printf("WIFI link %d: %d frames heard too weakly for their rate.\n",
+           state->link, state->rate_errors);
+    rate_report(&state->rates, state->link);
+  }
 }
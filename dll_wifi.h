@@ -4,10 +4,13 @@
 #define DLL_WIFI_H
 
 #include "dll_shared.h"
+#include "packet_pool.h"
 
 #include <cnet.h>
 #include <stdint.h>
 
+#define WIFI_PRIORITIES 3   // Frames are queued by priority, from 0 (lowest).
+
 /// This struct type will hold the state for one instance of the WiFi data
 /// link layer. The definition of the type is not important for clients.
 ///
@@ -33,12 +36,58 @@ struct dll_wifi_state *dll_wifi_new_state(int link,
 ///
 void dll_wifi_delete_state(struct dll_wifi_state *state);
 
-/// Write a frame to the given WiFi link.
+/// Returns the largest payload that one frame on the given WiFi link can carry.
+///
+size_t dll_wifi_mtu(const struct dll_wifi_state *state);
+
+/// Protect the data frames sent on the given WiFi link with parity frames iff
+/// enabled is true (see fec.h). The groups that each parity frame covers
+/// shrink as the loss that we see grows. Parity from other nodes is always
+/// used to rebuild the frames that we miss.
+///
+void dll_wifi_fec(struct dll_wifi_state *state, bool enabled);
+
+/// Send each unicast data frame on the given WiFi link with only the power
+/// that its receiver needs iff enabled is true (see power.h). Receivers report
+/// how well they heard us in the CTSs that answer our RTSs; control frames and
+/// broadcasts are always sent with the full power of the link.
+///
+void dll_wifi_power_control(struct dll_wifi_state *state, bool enabled);
+
+/// Send each unicast frame on the given WiFi link at the fastest rate that its
+/// receiver can decode iff enabled is true (see rate.h). The rate follows the
+/// margins that receivers report in their CTSs, and steps down after a loss.
+/// Control frames and broadcasts are always sent at the slowest rate.
+///
+void dll_wifi_rate_adaptation(struct dll_wifi_state *state, bool enabled);
+
+/// Returns the usecs of airtime that a payload of the given length takes to
+/// dest on the given WiFi link, at the rate that dest is sent at now.
+///
+CnetTime dll_wifi_airtime(const struct dll_wifi_state *state,
+                          const CnetNICaddr dest,
+                          size_t length);
+
+/// Write a frame to the given WiFi link, queued with the given priority.
 ///
 void dll_wifi_write(struct dll_wifi_state *state,
                     CnetNICaddr dest,
                     const char *data,
-                    uint16_t length);
+                    uint16_t length,
+                    int priority);
+
+/// Write the payload held in the given pool buffer to the given WiFi link. The
+/// header is prepended in the buffer's headroom, so the payload is not copied.
+/// The caller keeps its own reference; the link takes another while the frame
+/// waits for the medium. Large unicast frames are sent after an RTS/CTS
+/// exchange, and every frame waits while an overheard exchange holds the
+/// medium. Frames of a higher priority go first, and contend for the medium
+/// with a shorter wait and backoff window.
+///
+void dll_wifi_write_pkt(struct dll_wifi_state *state,
+                        CnetNICaddr dest,
+                        pkt_handle handle,
+                        int priority);
 
 /// Called when a frame has been received on the WiFi link. This function will
 /// retrieve the payload, and then pass it to the callback function that is
@@ -48,4 +97,15 @@ void dll_wifi_read(struct dll_wifi_state *state,
                    const char *data,
                    size_t length);
 
+/// Returns the number of frames waiting for the medium on the given WiFi link.
+///
+int dll_wifi_queued(const struct dll_wifi_state *state);
+
+/// Print the RTS/CTS counters of the given WiFi link, the frames of each
+/// priority sent and dropped, the parity frames sent and frames rebuilt, and
+/// the transmit power that receivers' reports left us with, and the rate
+/// table of each receiver.
+///
+void dll_wifi_report(const struct dll_wifi_state *state);
+
 #endif // DLL_WIFI_H
@@ -0,0 +1,307 @@
+/// This file implements the downlink scheduler kept by each access point.
+/// Queues with packets are visited in turn; on each turn a queue gains the
+/// quantum, and sends packets while its deficit covers their airtime.
+
+#include "downlink.h"
+#include "codel.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+#include <string.h>
+
+/// This struct holds the packets queued for one mobile.
+///
+struct downlink_queue {
+  bool used;
+  CnetAddr mobile;
+
+  // The queued packets, oldest at head.
+  struct downlink_frame frames[DOWNLINK_DEPTH];
+  int head;
+  int count;
+
+  // The airtime that the mobile may still use (usecs), and whether it has
+  // been given the quantum for its current turn.
+  CnetTime deficit;
+  bool in_turn;
+
+  // The active queue management of this queue.
+  struct codel_state codel;
+
+  // The counters reported at shutdown.
+  int max_count;
+  int sent;
+  int dropped;
+  CnetTime airtime;
+};
+
+static struct downlink_queue queues[DOWNLINK_MOBILES];
+
+// The queue whose turn it is, the packets queued in all, and the airtime
+// used by all the mobiles.
+static int current = 0;
+static int queued = 0;
+static CnetTime total_airtime = 0;
+
+// The number of packets sent after each range of sojourn times.
+static int sojourns[DOWNLINK_BUCKETS];
+
+/// Count a packet sent after the given sojourn time.
+///
+static void record_sojourn(CnetTime sojourn) {
+  int bucket = 0;
+  for (CnetTime limit = DOWNLINK_BUCKET_BASE;
+       sojourn >= limit && bucket < DOWNLINK_BUCKETS - 1; limit *= 2)
+    ++bucket;
+  ++sojourns[bucket];
+}
+
+/// Returns the upper bound of the sojourn bucket that holds the given
+/// fraction of the packets sent.
+///
+static CnetTime percentile(double fraction) {
+  int total = 0;
+  for (int i = 0; i < DOWNLINK_BUCKETS; ++i) total += sojourns[i];
+
+  int seen = 0;
+  CnetTime limit = DOWNLINK_BUCKET_BASE;
+  for (int i = 0; i < DOWNLINK_BUCKETS; ++i, limit *= 2) {
+    seen += sojourns[i];
+    if (seen >= fraction * total) return limit;
+  }
+  return limit;
+}
+
+/// Returns the queue of the given mobile. If it has none, then an unused
+/// queue is claimed, or failing that an empty one; NULL is returned if every
+/// queue holds packets.
+///
+static struct downlink_queue *find(CnetAddr mobile) {
+  struct downlink_queue *unused = NULL;
+  struct downlink_queue *empty = NULL;
+
+  for (int i = 0; i < DOWNLINK_MOBILES; ++i) {
+    struct downlink_queue *q = &queues[i];
+
+    if (q->used && q->mobile == mobile) return q;
+    if (unused == NULL && !q->used) unused = q;
+    if (empty == NULL && q->used && q->count == 0) empty = q;
+  }
+
+  // A queue taken from another mobile starts afresh.
+  struct downlink_queue *spare = (unused != NULL) ? unused : empty;
+  if (spare == NULL) return NULL;
+
+  bool in_turn = spare->in_turn;
+  memset(spare, 0, sizeof(*spare));
+  spare->used = true;
+  spare->mobile = mobile;
+  spare->in_turn = in_turn;
+  codel_init(&spare->codel);
+  return spare;
+}
+
+/// Pass the turn to the next queue.
+///
+static void next_turn(void) {
+  queues[current].in_turn = false;
+  current = (current + 1) % DOWNLINK_MOBILES;
+}
+
+/// Forget every queued packet and clear the counters.
+///
+void downlink_init(void) {
+  memset(queues, 0, sizeof(queues));
+  for (int i = 0; i < DOWNLINK_MOBILES; ++i) codel_init(&queues[i].codel);
+  memset(sojourns, 0, sizeof(sojourns));
+  current = 0;
+  queued = 0;
+  total_airtime = 0;
+}
+
+/// Queue a copy of a packet for mobile.
+///
+bool downlink_enqueue(CnetAddr mobile,
+                      int link,
+                      const CnetNICaddr nic,
+                      pkt_handle packet,
+                      CnetTime cost) {
+  struct downlink_queue *q = find(mobile);
+  if (q == NULL) return false;
+
+  if (q->count == DOWNLINK_DEPTH) {
+    ++q->dropped;
+    return false;
+  }
+
+  struct downlink_frame *frame = &q->frames[(q->head + q->count) % DOWNLINK_DEPTH];
+  frame->mobile = mobile;
+  frame->packet = pkt_ref(packet);
+  frame->link = link;
+  memcpy(frame->nic, nic, sizeof(CnetNICaddr));
+  frame->cost = cost;
+  frame->enqueued = nodeinfo.time_in_usec;
+
+  if (++q->count > q->max_count) q->max_count = q->count;
+  ++queued;
+  return true;
+}
+
+/// Take the next packet to send.
+///
+bool downlink_dequeue(struct downlink_frame *frame) {
+  if (queued == 0) return false;
+
+  // Each queue with packets gains a quantum per visit, so within two rounds
+  // some queue can pay for its head packet, unless that packet costs more
+  // than a quantum; it is then paid for over several rounds.
+  for (;;) {
+    struct downlink_queue *q = &queues[current];
+
+    if (!q->used || q->count == 0) {
+      q->deficit = 0;
+      next_turn();
+      continue;
+    }
+
+    if (!q->in_turn) {
+      q->deficit += DOWNLINK_QUANTUM;
+      q->in_turn = true;
+    }
+
+    struct downlink_frame *head = &q->frames[q->head];
+    if (head->cost > q->deficit) {
+      next_turn();
+      continue;
+    }
+
+    *frame = *head;
+    head->packet = PKT_NULL;
+    q->head = (q->head + 1) % DOWNLINK_DEPTH;
+    --q->count;
+    --queued;
+
+    // A packet that CoDel drops costs the mobile nothing.
+    CnetTime sojourn = nodeinfo.time_in_usec - frame->enqueued;
+    if (codel_drop(&q->codel, sojourn, q->count)) {
+      pkt_release(frame->packet);
+      if (q->count == 0) {
+        q->deficit = 0;
+        next_turn();
+      }
+      if (queued == 0) return false;
+      continue;
+    }
+
+    record_sojourn(sojourn);
+    q->deficit -= frame->cost;
+    q->airtime += frame->cost;
+    total_airtime += frame->cost;
+    ++q->sent;
+
+    // An emptied queue keeps no credit for later.
+    if (q->count == 0) {
+      q->deficit = 0;
+      next_turn();
+    }
+    return true;
+  }
+}
+
+/// Take a matching packet out of turn.
+///
+bool downlink_take(CnetAddr mobile,
+                   downlink_match_fn match,
+                   void *context,
+                   struct downlink_frame *frame) {
+  for (int i = 0; i < DOWNLINK_MOBILES; ++i) {
+    struct downlink_queue *q = &queues[i];
+    if (!q->used || q->mobile != mobile) continue;
+
+    for (int n = 0; n < q->count; ++n) {
+      struct downlink_frame *f = &q->frames[(q->head + n) % DOWNLINK_DEPTH];
+      if (!match(f, context)) continue;
+
+      *frame = *f;
+
+      // Close the gap, keeping the later packets in order.
+      for (int m = n; m + 1 < q->count; ++m) {
+        q->frames[(q->head + m) % DOWNLINK_DEPTH] =
+            q->frames[(q->head + m + 1) % DOWNLINK_DEPTH];
+      }
+      q->frames[(q->head + q->count - 1) % DOWNLINK_DEPTH].packet = PKT_NULL;
+      --q->count;
+      --queued;
+
+      record_sojourn(nodeinfo.time_in_usec - frame->enqueued);
+      ++q->sent;
+      return true;
+    }
+    return false;
+  }
+  return false;
+}
+
+/// Hand over and release the packets queued for a mobile that has left.
+///
+int downlink_forget(CnetAddr mobile, downlink_emit_fn emit, void *context) {
+  for (int i = 0; i < DOWNLINK_MOBILES; ++i) {
+    struct downlink_queue *q = &queues[i];
+    if (!q->used || q->mobile != mobile) continue;
+
+    int forgotten = q->count;
+    while (q->count > 0) {
+      struct downlink_frame *head = &q->frames[q->head];
+      emit(head->packet, context);
+      pkt_release(head->packet);
+      head->packet = PKT_NULL;
+      q->head = (q->head + 1) % DOWNLINK_DEPTH;
+      --q->count;
+      --queued;
+    }
+    q->deficit = 0;
+    return forgotten;
+  }
+  return 0;
+}
+
+/// Returns true iff any packets are queued.
+///
+bool downlink_pending(void) {
+  return queued > 0;
+}
+
+/// Returns the room left in the queues that hold packets.
+///
+int downlink_credits(struct credit_grant *grants, int max) {
+  int count = 0;
+
+  for (int i = 0; i < DOWNLINK_MOBILES && count < max; ++i) {
+    const struct downlink_queue *q = &queues[i];
+    if (!q->used || q->count == 0) continue;
+
+    grants[count].dest = q->mobile;
+    grants[count].credits = DOWNLINK_DEPTH - q->count;
+    ++count;
+  }
+  return count;
+}
+
+/// Print the per-mobile queue counters.
+///
+void downlink_report(void) {
+  for (int i = 0; i < DOWNLINK_MOBILES; ++i) {
+    const struct downlink_queue *q = &queues[i];
+    if (!q->used) continue;
+
+    printf("AP %" PRId32 ": mobile %" PRId32 " queue %d (max %d), %d sent, "
+           "%d dropped, %d dropped by CoDel, %.1f%% of airtime.\n",
+           nodeinfo.address, q->mobile, q->count, q->max_count, q->sent,
+           q->dropped, q->codel.drops,
+           total_airtime > 0 ? 100.0 * q->airtime / total_airtime : 0.0);
+  }
+
+  printf("AP %" PRId32 ": downlink sojourn p50 < %" PRId64 " usecs, "
+         "p99 < %" PRId64 " usecs.\n", nodeinfo.address,
+         (int64_t)percentile(0.50), (int64_t)percentile(0.99));
+}
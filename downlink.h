@@ -0,0 +1,109 @@
+/// This file declares the downlink scheduler kept by each access point. The
+/// packets that an AP sends into its cell wait in a queue per mobile, and are
+/// released to the WiFi link by deficit round robin. Each turn gives a mobile
+/// DOWNLINK_QUANTUM usecs of airtime, so a mobile with many (or large)
+/// packets cannot starve the others in the cell. Each queue is managed by
+/// CoDel, so a congested cell drops packets rather than letting them queue.
+
+#ifndef DOWNLINK_H
+#define DOWNLINK_H
+
+#include "credit.h"
+#include "packet_pool.h"
+
+#include <cnet.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define EV_DOWNLINK EV_TIMER7
+
+#define DOWNLINK_MOBILES 32       // Mobiles with a queue at once.
+#define DOWNLINK_DEPTH 16         // Packets queued for each mobile.
+#define DOWNLINK_QUANTUM 2000     // Usecs of airtime per mobile per turn.
+#define DOWNLINK_BACKLOG 2        // Frames left waiting in the WiFi link, so it
+                                  // never idles while we hold packets.
+#define DOWNLINK_TICK 1000        // Usecs between attempts to release packets.
+#define DOWNLINK_BUCKETS 16       // Sojourn times are counted in buckets of
+#define DOWNLINK_BUCKET_BASE 250  // 0-250 usecs, then doubling up to 2^15 x 250.
+
+/// This struct holds one packet waiting to be sent to a mobile: the mobile,
+/// the pool buffer, the link and NIC address that it goes to, its airtime,
+/// and the time that it was queued.
+///
+struct downlink_frame {
+  CnetAddr mobile;
+  pkt_handle packet;
+  int link;
+  CnetNICaddr nic;
+  CnetTime cost;
+  CnetTime enqueued;
+};
+
+/// Forget every queued packet and clear the counters. Called when an access
+/// point reboots, after its pool has been reset.
+///
+void downlink_init(void);
+
+/// Queue the packet held in the given buffer for mobile, to be sent on link
+/// to nic, where it takes cost usecs of airtime. The queue takes a reference
+/// of its own. Returns false if the packet was dropped because the mobile's
+/// queue is full.
+///
+bool downlink_enqueue(CnetAddr mobile,
+                      int link,
+                      const CnetNICaddr nic,
+                      pkt_handle packet,
+                      CnetTime cost);
+
+/// Take the next packet to send, as deficit round robin chooses it, into
+/// frame. Packets that CoDel drops on the way are released. The caller owns
+/// the frame's buffer. Returns false if no packets are queued.
+///
+bool downlink_dequeue(struct downlink_frame *frame);
+
+/// This function type decides whether a queued frame is wanted by the caller
+/// of downlink_take().
+///
+typedef bool (*downlink_match_fn)(const struct downlink_frame *frame,
+                                  void *context);
+
+/// Take the oldest packet queued for mobile that match accepts into frame,
+/// out of turn and without charging the mobile's airtime, for a packet that
+/// rides free with another. The caller owns the frame's buffer. Returns false
+/// if no queued packet matches.
+///
+bool downlink_take(CnetAddr mobile,
+                   downlink_match_fn match,
+                   void *context,
+                   struct downlink_frame *frame);
+
+/// The type of function that is given each packet taken by downlink_forget.
+/// The buffer remains owned by downlink_forget.
+///
+typedef void (*downlink_emit_fn)(pkt_handle packet, void *context);
+
+/// Called when mobile has moved to another AP. Passes each packet still
+/// queued for the mobile to emit, oldest first, then releases them all, so
+/// that none is sent into a cell that the mobile has left. Returns the number
+/// of packets passed to emit.
+///
+int downlink_forget(CnetAddr mobile, downlink_emit_fn emit, void *context);
+
+/// Returns true iff any packets are queued.
+///
+bool downlink_pending(void);
+
+/// Fill grants with the room left in each queue that holds packets, for the
+/// mobiles in our cell to be advertised, and return the number filled. At most
+/// max are filled.
+///
+int downlink_credits(struct credit_grant *grants, int max);
+
+/// Print, for each mobile that we have queued packets for, its queue depth
+/// (now and at most), the packets sent, dropped on arrival and dropped by
+/// CoDel, and its share of the airtime that we have used. Then print the
+/// 50th and 99th percentile sojourn times of the packets sent.
+///
+void downlink_report(void);
+
+#endif // DOWNLINK_H
@@ -0,0 +1,70 @@
+/// This file implements the duplicate cache kept by each access point. A
+/// packet is identified by its source, destination, type, sequence number and
+/// fragment offset, and remembered with the way it came. The cache is direct
+/// mapped: a new digest simply replaces whatever shared its slot, which can
+/// only let a duplicate through.
+
+#include "dupcache.h"
+
+#include <cnet.h>
+#include <stdint.h>
+#include <string.h>
+
+/// This struct holds the digest of one packet that was seen recently.
+///
+struct digest {
+  CnetAddr src;
+  CnetAddr dest;
+  uint8_t type;
+  uint16_t seq;
+  uint32_t offset;
+  CnetTime seen;
+
+  // The link and the neighbour that the packet came from.
+  int link;
+  CnetNICaddr from;
+};
+
+#define DUP_CACHE_SIZE (1 << DUP_CACHE_BITS)
+
+static struct digest cache[DUP_CACHE_SIZE];
+
+/// Clear the duplicate cache.
+///
+void dup_init(void) {
+  memset(cache, 0, sizeof(cache));
+  for (int i = 0; i < DUP_CACHE_SIZE; ++i) cache[i].seen = -DUP_LIFETIME - 1;
+}
+
+/// Returns true iff a copy of the given packet came another way recently.
+///
+bool dup_seen(const struct nl_header *header, int link, const CnetNICaddr src) {
+  struct digest digest = {
+    .src = header->src,
+    .dest = header->dest,
+    .type = (uint8_t)header->type,
+    .seq = header->seqNum,
+    .offset = header->offset,
+    .seen = nodeinfo.time_in_usec,
+    .link = link
+  };
+  memcpy(digest.from, src, sizeof(CnetNICaddr));
+
+  uint32_t hash = (uint32_t)digest.src * 31u + (uint32_t)digest.dest;
+  hash = hash * 31u + digest.type;
+  hash = hash * 31u + digest.seq;
+  hash = hash * 31u + digest.offset;
+  hash *= 2654435761u;
+
+  struct digest *slot = &cache[hash >> (32 - DUP_CACHE_BITS)];
+
+  if (slot->src == digest.src && slot->dest == digest.dest &&
+      slot->type == digest.type && slot->seq == digest.seq &&
+      slot->offset == digest.offset &&
+      digest.seen - slot->seen <= DUP_LIFETIME &&
+      (slot->link != link || memcmp(slot->from, src, sizeof(CnetNICaddr)) != 0))
+    return true;
+
+  *slot = digest;
+  return false;
+}
@@ -0,0 +1,32 @@
+/// This file declares the duplicate cache kept by each access point. Several
+/// APs often hear the same frame from a mobile, and the forwarding election
+/// (see association.h) stops all but one of them bridging it. The cache is a
+/// safety net for the copies that still get through while an election is being
+/// settled: it remembers a digest of each packet forwarded recently, with the
+/// link and neighbour that it came from, and reports a second copy of one as
+/// a duplicate if it came another way. A copy that comes the same way again
+/// is a retransmission by its sender, and is never suppressed.
+
+#ifndef DUPCACHE_H
+#define DUPCACHE_H
+
+#include "network.h"
+
+#include <cnet.h>
+#include <stdbool.h>
+
+#define DUP_CACHE_BITS 6        // The cache holds 2^DUP_CACHE_BITS digests.
+#define DUP_LIFETIME 2000       // Usecs that a digest is held: long enough for
+                                // the copies relayed by other APs to arrive.
+
+/// Clear the duplicate cache. Called when an access point reboots.
+///
+void dup_init(void);
+
+/// Returns true iff a copy of the given packet, which arrived on link from the
+/// neighbour src, has been seen within DUP_LIFETIME arriving on another link
+/// or from another neighbour. Otherwise records the packet and returns false.
+///
+bool dup_seen(const struct nl_header *header, int link, const CnetNICaddr src);
+
+#endif // DUPCACHE_H
@@ -0,0 +1,155 @@
+/// This file implements the forward error correction used by the WiFi links.
+/// Blocks are XORed a machine word at a time, so coding a frame costs about as
+/// much as copying it.
+
+#include "fec.h"
+
+#include <cnet.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef FEC_BENCHMARK
+#include <time.h>
+#endif
+
+/// The group size to use below each fraction of lost frames, in order.
+///
+static const struct fec_level {
+  double loss;
+  int group;
+} levels[] = {
+  { 0.01, 0 },
+  { 0.03, 16 },
+  { 0.06, 8 },
+  { 0.12, 4 },
+  { 0.25, 3 },
+  { 1.01, 2 }
+};
+
+#define FEC_LEVELS (sizeof(levels) / sizeof(levels[0]))
+
+/// XOR src into dst.
+///
+void fec_xor(unsigned char *dst, const unsigned char *src, size_t length) {
+  size_t i = 0;
+
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t a, b;
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+
+  for (; i < length; ++i) dst[i] ^= src[i];
+}
+
+/// Empty the given block.
+///
+void fec_clear(struct fec_block *block) {
+  memset(block->data, 0, block->length);
+  block->length = 0;
+  block->count = 0;
+}
+
+/// XOR a frame into the given block.
+///
+void fec_add(struct fec_block *block,
+             const CnetNICaddr dest,
+             const char *payload,
+             size_t length) {
+  if (length > PKT_MAXDATA) return;
+
+  unsigned char prefix[FEC_PREFIX_LENGTH];
+  prefix[0] = (unsigned char)(length & 0xFF);
+  prefix[1] = (unsigned char)(length >> 8);
+  memcpy(prefix + 2, dest, sizeof(CnetNICaddr));
+
+  // The block beyond its length is always zero, so it grows without clearing.
+  fec_xor(block->data, prefix, FEC_PREFIX_LENGTH);
+  fec_xor(block->data + FEC_PREFIX_LENGTH, (const unsigned char *)payload,
+           length);
+
+  if (FEC_PREFIX_LENGTH + length > block->length)
+    block->length = FEC_PREFIX_LENGTH + length;
+  ++block->count;
+}
+
+/// Rebuild the frame missing from a block.
+///
+int fec_recover(const struct fec_block *block,
+                const char *parity,
+                size_t parity_length,
+                CnetNICaddr dest,
+                char *payload) {
+  if (parity_length < FEC_PREFIX_LENGTH || parity_length > FEC_BLOCK_MAX)
+    return -1;
+
+  unsigned char missing[FEC_BLOCK_MAX];
+  memcpy(missing, parity, parity_length);
+  fec_xor(missing, block->data,
+           block->length < parity_length ? block->length : parity_length);
+
+  size_t length = missing[0] | (missing[1] << 8);
+  if (length == 0 || FEC_PREFIX_LENGTH + length > parity_length) return -1;
+
+  memcpy(dest, missing + 2, sizeof(CnetNICaddr));
+  memcpy(payload, missing + FEC_PREFIX_LENGTH, length);
+  return (int)length;
+}
+
+/// Look up the group size for the given loss.
+///
+int fec_group_size(double loss) {
+  for (size_t i = 0; i < FEC_LEVELS; ++i) {
+    if (loss < levels[i].loss) return levels[i].group;
+  }
+  return levels[FEC_LEVELS - 1].group;
+}
+
+#ifdef FEC_BENCHMARK
+#define FEC_BENCH_FRAMES 4096     // Frames coded by the benchmark.
+#define FEC_BENCH_LENGTH 1500     // Bytes in the payload of each.
+
+/// Time the coding of full-size frames.
+///
+void fec_benchmark(void) {
+  static struct fec_block block;
+  static char frames[FEC_MAX_GROUP][FEC_BENCH_LENGTH];
+  char rebuilt[PKT_MAXDATA];
+  CnetNICaddr dest = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+  for (int i = 0; i < FEC_MAX_GROUP; ++i) {
+    for (int j = 0; j < FEC_BENCH_LENGTH; ++j) frames[i][j] = (char)(i * 31 + j);
+  }
+
+  // Encode: XOR each frame of each group into its parity.
+  clock_t start = clock();
+  for (int n = 0; n < FEC_BENCH_FRAMES; ++n) {
+    if (n % FEC_MAX_GROUP == 0) fec_clear(&block);
+    fec_add(&block, dest, frames[n % FEC_MAX_GROUP], FEC_BENCH_LENGTH);
+  }
+  double encode = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  // Decode: rebuild a lost frame from the parity and the rest of its group.
+  struct fec_block parity = block;
+  int rebuilt_ok = 0;
+  start = clock();
+  for (int n = 0; n < FEC_BENCH_FRAMES / FEC_MAX_GROUP; ++n) {
+    fec_clear(&block);
+    for (int i = 1; i < FEC_MAX_GROUP; ++i)
+      fec_add(&block, dest, frames[i], FEC_BENCH_LENGTH);
+    if (fec_recover(&block, (const char *)parity.data, parity.length,
+                    dest, rebuilt) == FEC_BENCH_LENGTH)
+      ++rebuilt_ok;
+  }
+  double decode = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  double bytes = (double)FEC_BENCH_FRAMES * FEC_BENCH_LENGTH / 1e6;
+  printf("FEC: %d frames of %d bytes, encode %.1f Mbytes/sec, decode %.1f "
+         "Mbytes/sec, %d of %d groups rebuilt.\n", FEC_BENCH_FRAMES,
+         FEC_BENCH_LENGTH, encode > 0 ? bytes / encode : 0.0,
+         decode > 0 ? bytes / decode : 0.0, rebuilt_ok,
+         FEC_BENCH_FRAMES / FEC_MAX_GROUP);
+}
+#endif // FEC_BENCHMARK
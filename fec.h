@@ -0,0 +1,79 @@
+/// This file declares the forward error correction used by the WiFi links.
+/// A sender gathers its data frames into groups, and after each group sends a
+/// parity frame: the XOR of the group's frames. A receiver that heard all but
+/// one frame of a group rebuilds the missing one from the parity frame and the
+/// frames it heard, with no round trip.
+///
+/// Each frame is coded as a block: its payload length (two bytes,
+/// little-endian) and its destination NIC address, then its payload. Blocks
+/// shorter than the longest in a group are padded with zeroes. A parity frame
+/// carries the XOR of the blocks of its group.
+///
+/// The group size is looked up from the loss that the sender observes: the
+/// more frames are lost, the smaller the groups, and the more parity is sent.
+
+#ifndef FEC_H
+#define FEC_H
+
+#include "packet_pool.h"
+
+#include <cnet.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define FEC_MAX_GROUP 16          // The most data frames that share one parity frame.
+#define FEC_PREFIX_LENGTH 8       // Bytes of length and destination before a payload.
+#define FEC_BLOCK_MAX (FEC_PREFIX_LENGTH + PKT_MAXDATA)
+#define FEC_LOSS_ALPHA 0.0625     // Weight of each new loss sample.
+
+/// This struct holds the XOR of the blocks of the frames of one group seen so
+/// far, and the number of frames in it.
+///
+struct fec_block {
+  unsigned char data[FEC_BLOCK_MAX];
+  size_t length;
+  int count;
+};
+
+/// XOR length bytes of src into dst, a machine word at a time.
+///
+void fec_xor(unsigned char *dst, const unsigned char *src, size_t length);
+
+/// Empty the given block.
+///
+void fec_clear(struct fec_block *block);
+
+/// XOR the block of a frame for dest, with the given payload, into block.
+///
+void fec_add(struct fec_block *block,
+             const CnetNICaddr dest,
+             const char *payload,
+             size_t length);
+
+/// Rebuild the one frame missing from block, given the parity of its group,
+/// of the given length. The frame's destination is written to dest, and its
+/// payload to the start of payload, which must hold PKT_MAXDATA bytes.
+/// Returns the length of the payload, or -1 if the rebuilt frame is not
+/// well formed.
+///
+int fec_recover(const struct fec_block *block,
+                const char *parity,
+                size_t parity_length,
+                CnetNICaddr dest,
+                char *payload);
+
+/// Returns the number of data frames to send per parity frame when the given
+/// fraction of frames is being lost, or 0 if no parity is worth sending.
+///
+int fec_group_size(double loss);
+
+#ifdef FEC_BENCHMARK
+/// Time the coding of groups of full-size frames, and print how many Mbytes
+/// per second are encoded and decoded. Only built when FEC_BENCHMARK is
+/// defined (add -DFEC_BENCHMARK to the compile line); an AP then runs it once
+/// at shutdown.
+///
+void fec_benchmark(void);
+#endif
+
+#endif // FEC_H
@@ -0,0 +1,226 @@
+/// This file implements the fragmentation and reassembly of network layer
+/// packets. Reassembly uses a fixed set of preallocated message buffers,
+/// indexed directly by fragment offset, so no memory is allocated per
+/// fragment. A partial message is dropped once its timeout passes.
+
+#include "fragment.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NL_MAXUNITS (NL_MAXMESSAGE / NL_FRAG_UNIT)
+
+/// This struct holds the state of one message being reassembled.
+///
+struct reassembly {
+  // True iff this buffer holds a partial message.
+  bool used;
+
+  // The source and identifier of the message.
+  CnetAddr src;
+  uint16_t ident;
+
+  // The time after which the partial message is dropped.
+  CnetTime deadline;
+
+  // The length of the message, or zero until its last fragment arrives.
+  size_t total;
+
+  // The number of NL_FRAG_UNIT sized units of the message received so far.
+  size_t units;
+
+  // One bit per unit of the message, set once that unit has been received.
+  uint8_t have[NL_MAXUNITS / 8];
+
+  // The message itself, with each fragment copied to its offset.
+  char data[NL_MAXMESSAGE];
+};
+
+static struct reassembly *slots = NULL;   // The preallocated message buffers.
+
+/// Returns the largest fragment payload that fits in the given MTU.
+///
+size_t nl_fragment_payload(size_t mtu) {
+  size_t payload = mtu - NL_HEADER_LENGTH - NL_ACK_HEADER_LENGTH -
+                   NL_FRAG_HEADER_LENGTH;
+  if (payload > NL_MAXDATA) payload = NL_MAXDATA;
+
+  // Every fragment but the last must end on a unit boundary.
+  return payload - (payload % NL_FRAG_UNIT);
+}
+
+/// Build one encoded fragment of a message in a new pool buffer.
+///
+pkt_handle nl_build_fragment(const struct nl_header *header,
+                             const char *payload,
+                             uint32_t offset,
+                             size_t count,
+                             bool more) {
+  pkt_handle handle = pkt_alloc();
+  if (handle == PKT_NULL) return PKT_NULL;
+
+  struct nl_header fragment = *header;
+  fragment.flags |= NL_FLAG_FRAGMENT;
+  fragment.flags = more ? (fragment.flags | NL_FLAG_MORE)
+                        : (fragment.flags & ~NL_FLAG_MORE);
+  fragment.offset = offset;
+  fragment.length = count;
+  fragment.checksum = 0;
+
+  // Encode the headers, copy the payload in behind them and seal the result.
+  char *buf = pkt_data(handle);
+  nl_encode_header(&fragment, buf);
+  memcpy(buf + NL_HEADERS_LENGTH(fragment), payload, count);
+  nl_seal(buf, NL_PACKET_LENGTH(fragment));
+  pkt_set_length(handle, NL_PACKET_LENGTH(fragment));
+
+  return handle;
+}
+
+/// Split the encoded packet in the given buffer into fragments that fit in mtu.
+///
+int nl_fragment(pkt_handle packet,
+                size_t mtu,
+                nl_emit_fn emit,
+                void *context) {
+  const char *buf = pkt_data(packet);
+  size_t length = pkt_length(packet);
+
+  struct nl_header header;
+  if (!nl_decode_header(buf, length, &header)) return 0;
+
+  // A packet that already fits is sent as it is.
+  if (NL_PACKET_LENGTH(header) <= mtu) {
+    (*emit)(packet, context);
+    return 1;
+  }
+
+  // An unfragmented packet needs an identifier for its message, apart from
+  // those that its source gives. Its checksum distinguishes it from the other
+  // recent messages of its source, and gives every node that relays it the
+  // same identifier.
+  if (!(header.flags & NL_FLAG_FRAGMENT)) {
+    header.ident = (uint16_t)(NL_IDENT_REFRAGMENTED |
+                              (header.checksum & NL_IDENT_MASK));
+    header.offset = 0;
+  }
+
+  const char *payload = buf + NL_HEADERS_LENGTH(header);
+  size_t piece = nl_fragment_payload(mtu);
+  int emitted = 0;
+
+  for (size_t done = 0; done < header.length; done += piece) {
+    size_t count = header.length - done;
+    if (count > piece) count = piece;
+
+    // The last piece is the last fragment only if the packet was.
+    bool more = (done + count < header.length) ||
+                (header.flags & NL_FLAG_MORE);
+
+    pkt_handle fragment = nl_build_fragment(&header, payload + done,
+                                            header.offset + done, count, more);
+    if (fragment == PKT_NULL) return -1;
+
+    (*emit)(fragment, context);
+    pkt_release(fragment);
+    ++emitted;
+  }
+
+  return emitted;
+}
+
+/// Clear every reassembly buffer.
+///
+void nl_reassembly_init(void) {
+  if (slots == NULL) {
+    slots = calloc(NL_REASSEMBLY_SLOTS, sizeof(struct reassembly));
+    if (slots == NULL) {
+      fprintf(stderr, "%s: cannot allocate reassembly buffers\n", nodeinfo.nodename);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (int i = 0; i < NL_REASSEMBLY_SLOTS; ++i) slots[i].used = false;
+}
+
+/// Find the reassembly buffer for the given message, claiming one if there is
+/// none. Partial messages whose timeout has passed are dropped on the way.
+///
+static struct reassembly *find_slot(CnetAddr src, uint16_t ident) {
+  CnetTime now = nodeinfo.time_in_usec;
+  struct reassembly *free_slot = NULL;
+  struct reassembly *oldest = NULL;
+
+  for (int i = 0; i < NL_REASSEMBLY_SLOTS; ++i) {
+    struct reassembly *slot = &slots[i];
+
+    if (slot->used && slot->deadline < now) {
+      printf("\tReassembly of message %u from %" PRId32 " timed out.\n",
+             slot->ident, slot->src);
+      slot->used = false;
+    }
+
+    if (!slot->used) {
+      if (free_slot == NULL) free_slot = slot;
+      continue;
+    }
+
+    if (slot->src == src && slot->ident == ident) return slot;
+    if (oldest == NULL || slot->deadline < oldest->deadline) oldest = slot;
+  }
+
+  // With every buffer busy, give up on the message that started first.
+  if (free_slot == NULL) {
+    printf("\tDropping partial message %u from %" PRId32 " for space.\n",
+           oldest->ident, oldest->src);
+    free_slot = oldest;
+  }
+
+  free_slot->used = true;
+  free_slot->src = src;
+  free_slot->ident = ident;
+  free_slot->deadline = now + NL_REASSEMBLY_TIMEOUT;
+  free_slot->total = 0;
+  free_slot->units = 0;
+  memset(free_slot->have, 0, sizeof(free_slot->have));
+
+  return free_slot;
+}
+
+/// Add a verified fragment to the reassembly buffer for its message.
+///
+const char *nl_reassemble(const struct nl_header *header,
+                          const char *payload,
+                          size_t *length) {
+  size_t end = header->offset + header->length;
+  if (end > NL_MAXMESSAGE) return NULL;
+
+  struct reassembly *slot = find_slot(header->src, header->ident);
+
+  // Copy the payload to its offset, and mark the units it covers.
+  memcpy(slot->data + header->offset, payload, header->length);
+
+  for (size_t unit = header->offset / NL_FRAG_UNIT;
+       unit * NL_FRAG_UNIT < end; ++unit) {
+    uint8_t bit = (uint8_t)(1 << (unit % 8));
+    if (!(slot->have[unit / 8] & bit)) {
+      slot->have[unit / 8] |= bit;
+      ++slot->units;
+    }
+  }
+
+  // The last fragment tells us the length of the whole message.
+  if (!(header->flags & NL_FLAG_MORE)) slot->total = end;
+
+  if (slot->total == 0 ||
+      slot->units < (slot->total + NL_FRAG_UNIT - 1) / NL_FRAG_UNIT)
+    return NULL;
+
+  // The message is complete. Its buffer is free for reuse from the next call.
+  slot->used = false;
+  *length = slot->total;
+  return slot->data;
+}
@@ -0,0 +1,71 @@
+/// This file declares the fragmentation and reassembly of network layer
+/// packets. Fragments carry the byte offset of their payload within the
+/// message, so any node may split a packet (or a fragment) again to fit a
+/// link with a smaller MTU; only the destination reassembles.
+
+#ifndef FRAGMENT_H
+#define FRAGMENT_H
+
+#include "network.h"
+#include "packet_pool.h"
+
+#include <cnet.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define NL_REASSEMBLY_SLOTS 4           // Messages being reassembled at once.
+#define NL_REASSEMBLY_TIMEOUT 2000000   // Usecs before a partial message is dropped.
+
+// Message identifiers are split in two spaces, so that they cannot collide:
+// a source numbers the messages that it fragments itself below
+// NL_IDENT_REFRAGMENTED, and a node that has to fragment a whole packet on
+// the way sets NL_IDENT_REFRAGMENTED in the identifier that it gives it.
+#define NL_IDENT_MASK 0x7FFF
+#define NL_IDENT_REFRAGMENTED 0x8000
+
+/// The type of function that is given each fragment produced by nl_fragment.
+/// The fragment's buffer remains owned by nl_fragment, so the function must
+/// take its own reference if it keeps the fragment.
+///
+typedef void (*nl_emit_fn)(pkt_handle fragment, void *context);
+
+/// Returns the largest fragment payload that fits, with its headers, in a
+/// link whose MTU is the given number of bytes.
+///
+size_t nl_fragment_payload(size_t mtu);
+
+/// Build one encoded fragment of a message in a new pool buffer. The header
+/// provides the addresses, type and sequence number; count bytes of payload
+/// are copied from the given pointer, and offset is their position within
+/// the message. Returns PKT_NULL if the pool is exhausted.
+///
+pkt_handle nl_build_fragment(const struct nl_header *header,
+                             const char *payload,
+                             uint32_t offset,
+                             size_t count,
+                             bool more);
+
+/// Split the encoded packet in the given buffer into fragments that each fit
+/// in mtu bytes, and pass each of them to emit in order. A packet that already
+/// fits is passed to emit unchanged. Returns the number of fragments emitted,
+/// or -1 if the pool was exhausted part of the way through.
+///
+int nl_fragment(pkt_handle packet,
+                size_t mtu,
+                nl_emit_fn emit,
+                void *context);
+
+/// Clear every reassembly buffer. Called when a node reboots.
+///
+void nl_reassembly_init(void);
+
+/// Add a verified fragment to the reassembly buffer for its message. Returns
+/// the complete message, and sets *length, when this fragment fills the last
+/// gap; otherwise returns NULL. The returned message remains valid until the
+/// next call to nl_reassemble.
+///
+const char *nl_reassemble(const struct nl_header *header,
+                          const char *payload,
+                          size_t *length);
+
+#endif // FRAGMENT_H
@@ -0,0 +1,144 @@
+/// This file implements the handoff buffer kept by each access point. Each
+/// mobile has a small ring of references to pool buffers; packets older than
+/// HANDOFF_WINDOW are assumed to have been delivered, and are released as new
+/// packets arrive.
+
+#include "handoff.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+#include <string.h>
+
+/// This struct holds the packets recently sent to one mobile.
+///
+struct handoff_queue {
+  bool used;
+  CnetAddr mobile;
+
+  // The buffered packets, oldest at head, and the times that they were sent.
+  pkt_handle packets[HANDOFF_DEPTH];
+  CnetTime sent[HANDOFF_DEPTH];
+  int head;
+  int count;
+};
+
+static struct handoff_queue queues[HANDOFF_MOBILES];
+
+// The handoff counters reported at shutdown.
+static int handoffs = 0;
+static CnetTime total_latency = 0;
+static int forwarded = 0;
+static int lost = 0;
+
+/// Release the oldest packet buffered in the given queue.
+///
+static void drop_oldest(struct handoff_queue *q) {
+  pkt_release(q->packets[q->head]);
+  q->packets[q->head] = PKT_NULL;
+  q->head = (q->head + 1) % HANDOFF_DEPTH;
+  --q->count;
+}
+
+/// Release the packets in the given queue that are too old to matter.
+///
+static void expire(struct handoff_queue *q) {
+  while (q->count > 0 &&
+         nodeinfo.time_in_usec - q->sent[q->head] > HANDOFF_WINDOW)
+    drop_oldest(q);
+}
+
+/// Returns the queue for the given mobile. If it has none, then a free queue
+/// (or one whose packets have all expired) is claimed if claim is true.
+///
+static struct handoff_queue *find(CnetAddr mobile, bool claim) {
+  struct handoff_queue *spare = NULL;
+
+  for (int i = 0; i < HANDOFF_MOBILES; ++i) {
+    struct handoff_queue *q = &queues[i];
+
+    if (q->used && q->mobile == mobile) return q;
+    if (q->used) expire(q);
+    if (spare == NULL && (!q->used || q->count == 0)) spare = q;
+  }
+
+  if (!claim || spare == NULL) return NULL;
+
+  spare->used = true;
+  spare->mobile = mobile;
+  spare->head = 0;
+  spare->count = 0;
+  return spare;
+}
+
+/// Forget every buffered packet and clear the counters.
+///
+void handoff_init(void) {
+  for (int i = 0; i < HANDOFF_MOBILES; ++i) {
+    queues[i].used = false;
+    queues[i].count = 0;
+    for (int j = 0; j < HANDOFF_DEPTH; ++j) queues[i].packets[j] = PKT_NULL;
+  }
+
+  handoffs = 0;
+  total_latency = 0;
+  forwarded = 0;
+  lost = 0;
+}
+
+/// Buffer a packet that we have just sent to mobile.
+///
+void handoff_record(CnetAddr mobile, pkt_handle packet) {
+  struct handoff_queue *q = find(mobile, true);
+  if (q == NULL) return;
+
+  expire(q);
+
+  // A packet pushed out while it might still be needed is lost to a handoff.
+  if (q->count == HANDOFF_DEPTH) {
+    drop_oldest(q);
+    ++lost;
+  }
+
+  int tail = (q->head + q->count) % HANDOFF_DEPTH;
+  q->packets[tail] = pkt_ref(packet);
+  q->sent[tail] = nodeinfo.time_in_usec;
+  ++q->count;
+}
+
+/// Hand over the packets buffered for a mobile that has moved to another AP.
+///
+int handoff_forward(CnetAddr mobile,
+                    CnetTime last_heard,
+                    handoff_emit_fn emit,
+                    void *context) {
+  CnetTime latency = nodeinfo.time_in_usec - last_heard;
+  ++handoffs;
+  total_latency += latency;
+
+  struct handoff_queue *q = find(mobile, false);
+  int count = 0;
+
+  if (q != NULL) {
+    expire(q);
+    while (q->count > 0) {
+      (*emit)(q->packets[q->head], context);
+      drop_oldest(q);
+      ++count;
+    }
+    q->used = false;
+  }
+
+  forwarded += count;
+  printf("HANDOFF: mobile %" PRId32 " left after %" PRId64 " usecs, "
+         "%d packets handed over.\n", mobile, (int64_t)latency, count);
+  return count;
+}
+
+/// Print the handoff counters.
+///
+void handoff_report(void) {
+  printf("AP %" PRId32 ": %d handoffs, mean latency %" PRId64 " usecs, "
+         "%d packets handed over, %d lost.\n", nodeinfo.address, handoffs,
+         (int64_t)(handoffs > 0 ? total_latency / handoffs : 0),
+         forwarded, lost);
+}
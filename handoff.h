@@ -0,0 +1,61 @@
+/// This file declares the handoff buffer kept by each access point. The AP
+/// keeps a reference to each downlink packet that it has recently sent into
+/// its cell. When a mobile reassociates with another AP, those packets may
+/// never have reached it, so the old AP hands them to the new AP over the LAN
+/// rather than leaving the mobile's peers to time out and retransmit them.
+/// WiFi frames are not acknowledged, so some of these packets may already
+/// have been delivered by the old cell; the mobile discards the repeats as
+/// duplicates.
+///
+/// The handshake is: the mobile sends an ASSOC request to its new AP; the new
+/// AP announces the association on the LAN; and the old AP, on seeing that it
+/// has lost the mobile, forwards the mobile's buffered packets to the new AP.
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "packet_pool.h"
+
+#include <cnet.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HANDOFF_MOBILES 32         // Mobiles whose packets are buffered at once.
+#define HANDOFF_DEPTH 8            // Packets buffered for each mobile.
+#define HANDOFF_WINDOW 1000000     // Usecs for which a sent packet is buffered.
+
+/// The type of function that is given each packet handed over by
+/// handoff_forward. The buffer remains owned by handoff_forward.
+///
+typedef void (*handoff_emit_fn)(pkt_handle packet, void *context);
+
+/// Forget every buffered packet and clear the counters. Called when an
+/// access point reboots, after its pool has been reset.
+///
+void handoff_init(void);
+
+/// Buffer the packet held in the given buffer, which we have just written to
+/// the WiFi link for mobile, by taking a reference to it. Packets still
+/// queued by the downlink scheduler are not buffered here; they are handed
+/// over by downlink_forget. The oldest packet for the mobile is
+/// dropped if its buffer is full.
+///
+void handoff_record(CnetAddr mobile, pkt_handle packet);
+
+/// Called when mobile, which we last heard at last_heard, has moved to
+/// another AP. Passes each packet buffered for the mobile within
+/// HANDOFF_WINDOW to emit, oldest first, then releases them all and updates
+/// the handoff counters. Returns the number of packets passed to emit.
+///
+int handoff_forward(CnetAddr mobile,
+                    CnetTime last_heard,
+                    handoff_emit_fn emit,
+                    void *context);
+
+/// Print the handoff counters: the number of handoffs, their mean latency
+/// (from last hearing the mobile to learning of its new AP), and the packets
+/// forwarded and lost.
+///
+void handoff_report(void);
+
+#endif // HANDOFF_H
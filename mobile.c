@@ -6,97 +6,680 @@
 #include <string.h>
 #include <assert.h>
 
+#include "beacon.h"
+#include "association.h"
+#include "coding.h"
+#include "congestion.h"
+#include "credit.h"
 #include "dll_wifi.h"
+#include "fragment.h"
 #include "mapping.h"
+#include "neighbor.h"
 #include "network.h"
+#include "packet_pool.h"
+#include "peer.h"
+#include "poll.h"
 #include "walking.h"
 
 // Mobile nodes can only have WLAN links, so we always use the WiFi data link
 // layer.
 static struct dll_wifi_state **dll_states;
 
-#define MAX_BUFFER 100;
-struct nl_packet lastpacket;	// Define a variable to hold our last packet data.
-static size_t lastlength = 0;	// Define a variabe to hold our length.
-//static CnetTimerID lasttimer3 = NULLTIMER;	// Will store our timer data.
+#define PACKET_MEMORY_LENGTH 1024
 
-static int ackexpected = 0;	// Will store the ACK expected.
-//static  int             nextframetosend         = 0;
-//static  int             frameexpected           = 0;
+#define   MAXNODES   100                                       //// MUST BE BIG ENOUGH!!!!!!!!
+#define   SEND_WINDOW   CC_MAX_WINDOW   // The most messages held for one destination.
 
-#define PACKET_MEMORY_LENGTH 1024
+/// This struct holds the state of our flow of messages to one destination.
+/// Messages base..next-1 are held for retransmission, and resend is the next
+/// of them to (re)transmit; after a loss it goes back to base (go-back-N).
+///
+struct flow {
+  uint16_t base;
+  uint16_t resend;
+  uint16_t next;
 
-#define   WINDOWSIZE   100                                     //// MUST BE BIG ENOUGH!!!!!!!!
-static  struct nl_packet packetsSent[WINDOWSIZE];
-//static  struct nl_packet toSendPackets[WINDOWSIZE];
-#define   MAXSEQ   2*WINDOWSIZE 
-static CnetTimerID  timers[WINDOWSIZE];
-//static bool arrived[WINDOWSIZE];
-// Keep a list of checksums that we have seen recently.
-static int sentSeqNums[MAXSEQ] = {0}; // Will store the  sequence numbers sent.
-static int expectedSeqNums[MAXSEQ] = {0};// Will store the expected sequence numbers.
-static uint32_t seen_checksums[PACKET_MEMORY_LENGTH];
+  // The packet chains of the held messages, indexed by seqNum % SEND_WINDOW.
+  pkt_handle sent[SEND_WINDOW];
 
-void sendPri(int);
-typedef struct MESSAGE
-{
-	int dest;
-	char * data;
-} MESSAGE;
+  // The retransmission timer for the oldest held message, which runs from
+  // when that message left us.
+  CnetTimerID timer;
 
-static int first = 0;
-static int last = 0;
-static struct MESSAGE buffer[100];
+  // The smoothed round trip time and its variation, from the ACKs for
+  // messages sent once, and the retransmission timeout that they give.
+  CnetTime srtt;
+  CnetTime rttvar;
+  CnetTime rto;
 
-static int CAN_SEND = 0;	// Will determine if we can send.
+  // When each held message last left us, whether it has left since it was
+  // last queued, and how many times it has been queued. Only a message queued
+  // once gives a round trip time sample (Karn's algorithm).
+  CnetTime sent_at[SEND_WINDOW];
+  bool on_air[SEND_WINDOW];
+  int sends[SEND_WINDOW];
+
+  // The congestion window limits how many messages may be held.
+  struct cc_state cc;
+
+  // True after a loss until base passes recover. Further NACKs for the same
+  // window report the same gap, so they are ignored meanwhile.
+  bool recovering;
+  uint16_t recover;
+};
+
+static struct flow flows[MAXNODES];
+static uint16_t expectedSeqNums[MAXNODES];// Will store the expected sequence numbers.
+
+// The expected sequence number that we last sent a NACK for, per source.
+static bool nacked[MAXNODES];
+static uint16_t nackedSeqNums[MAXNODES];
+
+// Keep a list of checksums that we have seen recently.
+static uint32_t seen_checksums[PACKET_MEMORY_LENGTH];
 
 // The next index we should overwrite in seen_checksums.
 static size_t next_seen_checksum = 0;
 
+// Messages from the application are read here before being split into packets.
+static char message[NL_MAXMESSAGE];
 
-/// Will print out a message
-void sendNext() {
-  // Create a packet.
-  struct nl_packet packet = (struct nl_packet){
-    .src = nodeinfo.address,
-    .length = NL_MAXDATA
-  };
+// The identifier given to the next message that we have to fragment.
+static uint16_t next_ident = 0;
 
+// The number of pool buffers that the largest possible message needs.
+#define MAX_FRAGMENTS (NL_MAXMESSAGE / NL_FRAG_UNIT / (NL_MAXDATA / NL_FRAG_UNIT) + 1)
 
-  strcpy(packet.data, buffer[first].data);
-  first ++;
-  packet.checksum = CNET_crc32((unsigned char *)&packet, sizeof(packet));
+// The pool buffers kept back for ACKs, NACKs and received frames.
+#define POOL_RESERVE 16
 
-  CnetNICaddr wifi_dest;
-  CHECK(CNET_parse_nicaddr(wifi_dest, "ff:ff:ff:ff:ff:ff"));
+// True iff the application is disabled because the pool is running low.
+static bool pool_throttled = false;
+
+// True for each destination that the application is disabled for because our
+// uplink queues lack room for another message.
+static bool uplink_waiting[MAXNODES];
+
+#define ACK_HOLD 5000   // Usecs that an ACK waits for DATA to ride on.
+
+#define RTO_INITIAL 50000       // Usecs of the timeout before any RTT sample.
+#define RTO_MIN (2 * ACK_HOLD)  // The receiver may hold its ACK for ACK_HOLD.
+#define RTO_MAX 2000000         // The longest timeout, after backing off.
+
+// The ACK we owe each source, held back in the hope of piggybacking it.
+static bool ackPending[MAXNODES];
+static int ackPendingSeq[MAXNODES];
+static CnetTimerID ackTimers[MAXNODES];
 
-  uint16_t packet_length = NL_PACKET_LENGTH(packet);
+// The signal strength (dBm) of the frame being read from our WiFi link.
+static double rx_signal = 0.0;
+
+// The time that we last sent a frame to our AP, so that it knows we are in
+// reach, and the time that we last sent a beacon to the mobiles around us.
+static CnetTime last_sent = 0;
+static CnetTime last_beacon = 0;
+
+// The number of packets sent straight to a peer, rather than through our AP.
+static int sentDirect = 0;
+
+// The most frames held for our AP to poll in each class: room for two of the
+// largest messages, so that one can be queued while the last drains.
+#define UPLINK_DEPTH (2 * MAX_FRAGMENTS)
+
+// The frames held until our AP polls us, one queue per traffic class with the
+// oldest at uplink_head, the number held in all queues, and the timer that
+// repeats our request to be polled.
+static pkt_handle uplink[NL_CLASSES][UPLINK_DEPTH];
+static int uplink_head[NL_CLASSES];
+static int uplink_queued[NL_CLASSES];
+static int uplink_count = 0;
+static CnetTimerID poll_retry = NULLTIMER;
+
+// The number of frames dropped because the uplink queue was full.
+static int uplinkDropped = 0;
+
+// Counts of the ACKs sent on their own and carried by DATA packets.
+static int acksStandalone = 0;
+static int acksPiggybacked = 0;
+
+// Packets are built in place in pool buffers, so one must fit in a buffer.
+_Static_assert(NL_PACKET_MAXLENGTH <= PKT_MAXDATA, "nl packet exceeds pool buffer");
+
+/// Encode the given header into the given buffer, set the packet's checksum,
+/// and record its length.
+///
+static void seal_packet(pkt_handle handle, const struct nl_header *header) {
+  nl_encode_header(header, pkt_data(handle));
+  nl_seal(pkt_data(handle), NL_PACKET_LENGTH(*header));
+  pkt_set_length(handle, NL_PACKET_LENGTH(*header));
+}
+
+/// Returns the number of buffers on the chain starting at the given buffer.
+///
+static int chain_count(pkt_handle handle) {
+  int count = 0;
+  for (; handle != PKT_NULL; handle = pkt_next(handle)) ++count;
+  return count;
+}
+
+/// Returns the smallest MTU of our WiFi links, which bounds our fragments.
+///
+static size_t link_mtu(void) {
+  size_t mtu = NL_PACKET_MAXLENGTH;
+  for (int i = 1; i <= nodeinfo.nlinks; ++i) {
+    if (dll_states[i] != NULL && dll_wifi_mtu(dll_states[i]) < mtu)
+      mtu = dll_wifi_mtu(dll_states[i]);
+  }
+  return mtu;
+}
+
+static void data_sent(pkt_handle handle);
+
+/// Write the packet held in the given buffer to wifi_dest on all of our WiFi
+/// links. Packets that an AP may code with another are kept, so that we can
+/// decode them.
+///
+static void transmit(pkt_handle handle, CnetNICaddr wifi_dest) {
+  struct nl_header header;
+  if (nl_decode_header(pkt_data(handle), pkt_length(handle), &header) &&
+      (header.type == DATA || header.type == ACK || header.type == NACK))
+    coding_keep(handle);
+  data_sent(handle);
 
   for (int i = 1; i <= nodeinfo.nlinks; ++i) {
     if (dll_states[i] != NULL) {
-	fprintf(stdout, "Node %d has sent a package to node %d \n",nodeinfo.address, packet.dest);  
-	dll_wifi_write(dll_states[i], wifi_dest, (char *)&packet, packet_length);
+      dll_wifi_write_pkt(dll_states[i], wifi_dest, handle,
+                         nl_packet_class(pkt_data(handle), pkt_length(handle)));
     }
   }
-  //packetSent[packet.dest]= packet;  ///???
+}
+
+/// Send the packet held in the given buffer, for dest, on all of our WiFi
+/// links now. It goes straight to dest if we hear it well; otherwise it goes
+/// to the AP that we are associated with. Until we have heard an AP, it is
+/// broadcast to every AP in range.
+///
+static void send_now(pkt_handle handle, CnetAddr dest) {
+  if (handle == PKT_NULL) return;
+
+  CnetNICaddr wifi_dest;
+  const struct peer *peer = peer_direct(dest);
+  if (peer != NULL) {
+    memcpy(wifi_dest, peer->nic, sizeof(CnetNICaddr));
+    transmit(handle, wifi_dest);
+    ++sentDirect;
+    return;
+  }
+
+  const struct neighbor *ap = neighbor_associated();
+  if (ap != NULL) memcpy(wifi_dest, ap->nic, sizeof(CnetNICaddr));
+  else CHECK(CNET_parse_nicaddr(wifi_dest, "ff:ff:ff:ff:ff:ff"));
+
+  transmit(handle, wifi_dest);
+  last_sent = nodeinfo.time_in_usec;
+}
+
+/// Tell our AP how many frames we hold for it, so that it polls us. Unless we
+/// hold none, the request is repeated every POLL_RETRY until we are polled.
+///
+static void request_poll(void) {
+  if (poll_retry != NULLTIMER) {
+    CNET_stop_timer(poll_retry);
+    poll_retry = NULLTIMER;
+  }
+
+  const struct neighbor *ap = neighbor_associated();
+  if (ap == NULL) return;
+
+  pkt_handle handle = pkt_alloc();
+  if (handle == PKT_NULL) return;
+
+  struct nl_header header = (struct nl_header) {
+    .src = nodeinfo.address,
+    .dest = ap->ap,
+    .length = POLL_PAYLOAD_LENGTH,
+    .type = POLL,
+    .flags = NL_CLASS_CONTROL << NL_CLASS_SHIFT
+  };
+
+  pkt_data(handle)[NL_HEADERS_LENGTH(header)] =
+    (char)(uplink_count < UINT8_MAX ? uplink_count : UINT8_MAX);
+  seal_packet(handle, &header);
+
+  CnetNICaddr wifi_dest;
+  memcpy(wifi_dest, ap->nic, sizeof(CnetNICaddr));
+  transmit(handle, wifi_dest);
+  pkt_release(handle);
+  last_sent = nodeinfo.time_in_usec;
+
+  if (uplink_count > 0)
+    poll_retry = CNET_start_timer(EV_POLL, POLL_RETRY, 0);
+}
+
+/// Called when our AP has not polled us in time, to ask again.
+///
+static EVENT_HANDLER(poll_timeout) {
+  poll_retry = NULLTIMER;
+  if (uplink_count > 0) request_poll();
+}
+
+static void uplink_drained(void);
+
+/// Send up to grant of the frames that we hold for our AP, most urgent class
+/// first and oldest first within a class, then report what is left, which ends
+/// our grant.
+///
+static void send_burst(int grant) {
+  const struct neighbor *ap = neighbor_associated();
+  if (ap == NULL) return;
+
+  CnetNICaddr wifi_dest;
+  memcpy(wifi_dest, ap->nic, sizeof(CnetNICaddr));
+
+  for (int i = 0; i < grant && uplink_count > 0; ++i) {
+    int c = NL_CLASSES - 1;
+    while (uplink_queued[c] == 0) --c;
+
+    pkt_handle handle = uplink[c][uplink_head[c]];
+    uplink[c][uplink_head[c]] = PKT_NULL;
+    uplink_head[c] = (uplink_head[c] + 1) % UPLINK_DEPTH;
+    --uplink_queued[c];
+    --uplink_count;
+
+    transmit(handle, wifi_dest);
+    pkt_release(handle);
+  }
+
+  request_poll();
+  uplink_drained();
+}
+
+/// Send the packet held in the given buffer, for dest. A packet for our AP is
+/// held until the AP polls us; anything else is sent now.
+///
+static void send_packet(pkt_handle handle, CnetAddr dest) {
+  if (handle == PKT_NULL) return;
+
+  if (peer_direct(dest) != NULL || neighbor_associated() == NULL) {
+    send_now(handle, dest);
+    return;
+  }
+
+  // A full queue drops only its own class, so bulk DATA cannot crowd out ACKs.
+  int c = nl_packet_class(pkt_data(handle), pkt_length(handle));
+  if (c >= NL_CLASSES) c = NL_CLASS_BULK;
+  if (uplink_queued[c] == UPLINK_DEPTH) {
+    ++uplinkDropped;
+    data_sent(handle);  // Lost here rather than on air; it still times out.
+    return;
+  }
+
+  uplink[c][(uplink_head[c] + uplink_queued[c]) % UPLINK_DEPTH] = pkt_ref(handle);
+  ++uplink_queued[c];
+  if (++uplink_count == 1) request_poll();
+}
+
+/// Returns true iff the uplink queue of the class of the chain starting at the
+/// given buffer has room for all of it, or the chain for dest is not held for
+/// our AP. A message that does not fit whole would lose fragments, and so
+/// fail to reassemble.
+///
+static bool uplink_fits(pkt_handle handle, CnetAddr dest) {
+  if (handle == PKT_NULL || peer_direct(dest) != NULL ||
+      neighbor_associated() == NULL)
+    return true;
+
+  int c = nl_packet_class(pkt_data(handle), pkt_length(handle));
+  if (c >= NL_CLASSES) c = NL_CLASS_BULK;
+  return uplink_queued[c] + chain_count(handle) <= UPLINK_DEPTH;
+}
+
+/// Returns true iff the uplink queues of both classes that DATA may take have
+/// room for a message of the largest size.
+///
+static bool uplink_room(void) {
+  return uplink_queued[NL_CLASS_BULK] + MAX_FRAGMENTS <= UPLINK_DEPTH &&
+         uplink_queued[NL_CLASS_INTERACTIVE] + MAX_FRAGMENTS <= UPLINK_DEPTH;
+}
+
+/// Send every fragment on the chain starting at the given buffer, for dest.
+///
+static void send_chain(pkt_handle handle, CnetAddr dest) {
+  for (; handle != PKT_NULL; handle = pkt_next(handle))
+    send_packet(handle, dest);
+}
+
+/// Build and send a control packet (ACK, NACK or ASSOC) with no payload.
+///
+static void send_control(enum networkAck type, CnetAddr dest, int seqNum) {
+  pkt_handle handle = pkt_alloc();
+  if (handle == PKT_NULL) return;
+
+  struct nl_header header = (struct nl_header) {
+    .src = nodeinfo.address,
+    .dest = dest,
+    .length = 0,
+    .type = type,
+    .flags = NL_CLASS_CONTROL << NL_CLASS_SHIFT,
+    .seqNum = seqNum
+  };
+
+  seal_packet(handle, &header);
+
+  // An ASSOC tells our AP that we are here, so that it can poll us.
+  if (type == ASSOC) send_now(handle, dest);
+  else send_packet(handle, dest);
+  pkt_release(handle);
+}
+
+/// Broadcast a beacon, so that the mobiles in range know that they can send
+/// to us directly. Beacons do not count as traffic for our AP.
+///
+static void send_beacon(void) {
+  pkt_handle handle = pkt_alloc();
+  if (handle == PKT_NULL) return;
+
+  struct nl_header header = (struct nl_header) {
+    .src = nodeinfo.address,
+    .dest = ALLNODES,
+    .length = BEACON_PAYLOAD_LENGTH,
+    .type = BEACON,
+    .flags = NL_CLASS_CONTROL << NL_CLASS_SHIFT
+  };
+
+  CnetPosition position;
+  CHECK(CNET_get_position(&position, NULL));
+  beacon_encode(&position, false, pkt_data(handle) + NL_HEADERS_LENGTH(header));
+  seal_packet(handle, &header);
+
+  CnetNICaddr broadcast;
+  CHECK(CNET_parse_nicaddr(broadcast, "ff:ff:ff:ff:ff:ff"));
+  transmit(handle, broadcast);
+  pkt_release(handle);
+
+  last_beacon = nodeinfo.time_in_usec;
+}
+
+/// Returns the number of messages held for retransmission on the given flow.
+///
+static uint16_t outstanding(const struct flow *f) {
+  return (uint16_t)(f->next - f->base);
+}
+
+/// Returns true iff the given flow may take another message: it must have
+/// space to hold it, and room in its congestion window.
+///
+static bool window_open(const struct flow *f) {
+  return outstanding(f) < SEND_WINDOW && outstanding(f) < cc_window(&f->cc);
+}
+
+/// Returns true iff the application may generate a message for dest: its
+/// flow's window must be open, our AP must have room for it, and so must our
+/// uplink queues.
+///
+static bool may_send(CnetAddr dest) {
+  return window_open(&flows[dest]) && credit_available(dest) && uplink_room();
+}
+
+/// (Re)start the retransmission timer for the oldest message held for dest,
+/// if that message has left us; otherwise the timer starts once it does.
+///
+static void start_timer(CnetAddr dest) {
+  struct flow *f = &flows[dest];
+
+  if (f->timer != NULLTIMER) CNET_stop_timer(f->timer);
+  f->timer = NULLTIMER;
+  if (outstanding(f) == 0 || !f->on_air[f->base % SEND_WINDOW]) return;
+
+  f->timer = CNET_start_timer(EV_TIMER3, f->rto, (CnetData)dest);
+}
+
+/// Called as the packet held in the given buffer leaves us. If it is a
+/// fragment of one of our held messages, note when it was sent, and start the
+/// retransmission timer if it is the oldest.
+///
+static void data_sent(pkt_handle handle) {
+  struct nl_header header;
+  if (!nl_decode_header(pkt_data(handle), pkt_length(handle), &header) ||
+      header.type != DATA || header.src != nodeinfo.address ||
+      header.dest < 0 || header.dest >= MAXNODES)
+    return;
+
+  struct flow *f = &flows[header.dest];
+  if ((uint16_t)(header.seqNum - f->base) >= outstanding(f)) return;
+
+  f->sent_at[header.seqNum % SEND_WINDOW] = nodeinfo.time_in_usec;
+  f->on_air[header.seqNum % SEND_WINDOW] = true;
+  if (header.seqNum == f->base && f->timer == NULLTIMER)
+    start_timer(header.dest);
+}
+
+/// Fold a round trip time sample into the estimates for the given flow, and
+/// set its timeout from them (RFC 6298).
+///
+static void rtt_sample(struct flow *f, CnetTime rtt) {
+  if (f->srtt == 0) {
+    f->srtt = rtt;
+    f->rttvar = rtt / 2;
+  } else {
+    CnetTime error = rtt > f->srtt ? rtt - f->srtt : f->srtt - rtt;
+    f->rttvar = (3 * f->rttvar + error) / 4;
+    f->srtt = (7 * f->srtt + rtt) / 8;
+  }
+
+  f->rto = f->srtt + 4 * f->rttvar;
+  if (f->rto < RTO_MIN) f->rto = RTO_MIN;
+  if (f->rto > RTO_MAX) f->rto = RTO_MAX;
+}
+
+/// Transmit the held messages for dest from resend onwards, as far as the
+/// congestion window allows, and while each fits whole in our uplink queue.
+/// The rest follow as our AP polls the queue empty.
+///
+static void send_window(CnetAddr dest) {
+  struct flow *f = &flows[dest];
+
+  while (f->resend != f->next &&
+         (uint16_t)(f->resend - f->base) < cc_window(&f->cc) &&
+         uplink_fits(f->sent[f->resend % SEND_WINDOW], dest)) {
+    f->on_air[f->resend % SEND_WINDOW] = false;
+    ++f->sends[f->resend % SEND_WINDOW];
+    send_chain(f->sent[f->resend % SEND_WINDOW], dest);
+    printf("DATA transmitted, seq=%d\n", f->resend);
+    ++f->resend;
+  }
+}
+
+/// Called while the application is disabled because the pool is running low.
+/// Once the pool and our uplink queues could both hold one more message of the
+/// largest size, every destination that may_send() allows is enabled again.
+///
+static void resume_application(void) {
+  if (pkt_pool_free() < MAX_FRAGMENTS + POOL_RESERVE || !uplink_room()) return;
+
+  // Enable every destination whose window is open.
+  pool_throttled = false;
+  CNET_enable_application(ALLNODES);
+  for (CnetAddr addr = 0; addr < MAXNODES; ++addr) {
+    if (!may_send(addr)) CNET_disable_application(addr);
+  }
+}
+
+/// Called when the window or the credits for dest may have changed. The
+/// application may generate another message for dest iff may_send() allows it,
+/// unless the pool is still too low to hold one more message of the largest
+/// size.
+///
+static void update_application(CnetAddr dest) {
+  if (pool_throttled) {
+    resume_application();
+    return;
+  }
+
+  if (may_send(dest)) {
+    uplink_waiting[dest] = false;
+    CNET_enable_application(dest);
+  } else {
+    uplink_waiting[dest] = !uplink_room();
+    CNET_disable_application(dest);
+  }
+}
+
+/// Called when our AP has polled frames out of our uplink queues: the
+/// messages that waited for room are sent, and the application may go on for
+/// the destinations that it was stopped for.
+///
+static void uplink_drained(void) {
+  for (CnetAddr dest = 0; dest < MAXNODES; ++dest) {
+    bool unsent = flows[dest].resend != flows[dest].next;
+    if (!unsent && !uplink_waiting[dest]) continue;
+
+    if (unsent) send_window(dest);
+    update_application(dest);
+  }
+
+  if (pool_throttled) resume_application();
+}
+
+/// Note that we owe src an ACK for seqNum. The ACK is held for ACK_HOLD, so
+/// that DATA we send to src in the meantime can carry it, and so that the
+/// copies of one packet relayed by several APs are answered only once.
+///
+static void schedule_ack(CnetAddr src, int seqNum) {
+  ackPendingSeq[src] = seqNum;
+  if (ackPending[src]) return;
 
+  ackPending[src] = true;
+  ackTimers[src] = CNET_start_timer(EV_TIMER4, ACK_HOLD, (CnetData)src);
+}
+
+/// Take the ACK we owe dest, if any, so that it rides on a DATA packet.
+///
+static void piggyback_ack(CnetAddr dest, struct nl_header *header) {
+  if (!ackPending[dest]) return;
+
+  CNET_stop_timer(ackTimers[dest]);
+  ackPending[dest] = false;
+
+  header->flags |= NL_FLAG_ACK;
+  header->ackSeq = ackPendingSeq[dest];
+  ++acksPiggybacked;
+  printf("ACK piggybacked, seq=%d\n", header->ackSeq);
+}
+
+/// Called when an ACK has been held for ACK_HOLD without any DATA to carry it.
+///
+static EVENT_HANDLER(ack_timeout) {
+  CnetAddr src = (CnetAddr)data;
+
+  if (!ackPending[src]) return;
+  ackPending[src] = false;
+
+  send_control(ACK, src, ackPendingSeq[src]);
+  ++acksStandalone;
+  printf("ACK transmitted, seq=%d\n", ackPendingSeq[src]);
+}
+
+/// Handle a cumulative ACK for seqNum (and every message before it) from src,
+/// whether it arrived on its own or on a DATA packet. ACKs for messages that
+/// are not held are stale.
+///
+static void handle_ack(CnetAddr src, uint16_t seqNum) {
+  struct flow *f = &flows[src];
+
+  if ((uint16_t)(seqNum - f->base) >= outstanding(f)) {
+    printf("\tStale ACK, seq=%d from node %d \n", seqNum, src);
+    return;
+  }
+
+  printf("\t\t\t\tACK received, seq=%d from node %d \n", seqNum, src);
+
+  // An ACK for a message sent only once times the round trip.
+  int i = seqNum % SEND_WINDOW;
+  if (f->sends[i] == 1 && f->on_air[i])
+    rtt_sample(f, nodeinfo.time_in_usec - f->sent_at[i]);
+
+  // The messages up to seqNum have been delivered, so drop our references.
+  int acked = 0;
+  while (f->base != (uint16_t)(seqNum + 1)) {
+    pkt_release_chain(f->sent[f->base % SEND_WINDOW]);
+    f->sent[f->base % SEND_WINDOW] = PKT_NULL;
+    ++f->base;
+    ++acked;
+  }
+  if ((uint16_t)(f->resend - f->base) > outstanding(f)) f->resend = f->base;
+  if (f->recovering && (int16_t)(f->base - f->recover) >= 0)
+    f->recovering = false;
+
+  cc_on_ack(&f->cc, acked);
+  cc_trace(&f->cc, src, "ack");
+
+  start_timer(src);
+  send_window(src);
+  update_application(src);
+}
+
+/// Handle the loss of the oldest message held for dest: shrink the window and
+/// go back to resend from the oldest message.
+///
+static void handle_loss(CnetAddr dest, bool timeout) {
+  struct flow *f = &flows[dest];
+
+  if (outstanding(f) == 0) return;
+  if (!timeout && f->recovering) return;
+
+  cc_on_loss(&f->cc, timeout);
+  cc_trace(&f->cc, dest, timeout ? "timeout" : "nack");
+  f->recovering = true;
+  f->recover = f->next;
+
+  // Back off the timeout, and time the oldest message again once it is resent.
+  if (timeout) f->rto = f->rto < RTO_MAX / 2 ? 2 * f->rto : RTO_MAX;
+  if (f->timer != NULLTIMER) CNET_stop_timer(f->timer);
+  f->timer = NULLTIMER;
+
+  f->resend = f->base;
+  send_window(dest);
+  update_application(dest);
 }
 
 /// This function will handle our frame timeouts.
 ///
 EVENT_HANDLER(timeouts) {
+  CnetAddr dest = (CnetAddr)data;
 
-  struct nl_packet packet = lastpacket;
- 
-  CnetNICaddr wifi_dest;
-  CHECK(CNET_parse_nicaddr(wifi_dest, "ff:ff:ff:ff:ff:ff"));
-  
-  for (int i = 1; i <= nodeinfo.nlinks; ++i) {
-    if (dll_states[i] != NULL) {
-      //dll_wifi_write(dll_states[i], wifi_dest, (char *)&packet, packet.length);
-    }
+  flows[dest].timer = NULLTIMER;
+
+  // The ACK may have arrived as the timer expired.
+  if (outstanding(&flows[dest]) == 0) return;
+
+  // Retransmit from the references we are holding, rather than from copies.
+  // If we sent straight to dest, then it may be out of reach, so the AP takes
+  // the retransmissions.
+  printf("\t\t\t\t\t\tTime out DATA re-transmitted, seq=%d\n", flows[dest].base);
+  peer_failed(dest);
+  handle_loss(dest, true);
+}
+
+/// Called when the simulation ends, to report our network layer statistics.
+///
+static EVENT_HANDLER(shutdown) {
+  printf("Mobile %" PRId32 ": %d ACKs sent alone, %d piggybacked on DATA.\n",
+         nodeinfo.address, acksStandalone, acksPiggybacked);
+  printf("Mobile %" PRId32 ": %d packets sent straight to a peer.\n",
+         nodeinfo.address, sentDirect);
+  printf("Mobile %" PRId32 ": %d frames dropped waiting to be polled.\n",
+         nodeinfo.address, uplinkDropped);
+  credit_report();
+  coding_report();
+
+  for (int link = 1; link <= nodeinfo.nlinks; ++link) {
+    if (dll_states[link] != NULL) dll_wifi_report(dll_states[link]);
+  }
+
+  for (CnetAddr dest = 0; dest < MAXNODES; ++dest) {
+    if (flows[dest].next != 0) cc_trace(&flows[dest].cc, dest, "final");
   }
-  printf("\t\t\t\t\t\tTime out DATA re-transmitted, seq=%d\n",packet.seqNum);
 }
 
 /// Called when we encounter a collision.
@@ -112,29 +695,60 @@ static EVENT_HANDLER(physical_ready) {
   char frame[DLL_MTU];
   size_t length	= sizeof(frame);
   int link;
+  double rx_angle;
 
   CHECK(CNET_read_physical(&link, frame, &length));
-  
+
   // Now we forward this information to the data link layer, if it exists.
   if (link > nodeinfo.nlinks || dll_states[link] == NULL) return;
-  
+
+  // Note how strongly we heard this frame, for choosing our AP.
+  if (CNET_wlan_arrival(link, &rx_signal, &rx_angle) != 0) rx_signal = -100.0;
+
   dll_wifi_read(dll_states[link], frame, length);
 }
 
+/// Take the credits advertised by our AP in the credit list of the given
+/// length. A packet without a list leaves our credits alone.
+///
+static void granted(const char *list, size_t length) {
+  struct credit_grant grants[CREDIT_MAX];
+  int count = credit_decode(list, length, grants, CREDIT_MAX);
+  if (count >= 0) credit_granted(grants, count, update_application);
+}
+
 /// Called when we receive data from one of our data link layers.
 ///
-static void up_from_dll(int link, const char *data, size_t length) {  
+static void up_from_dll(int link,
+                        const CnetNICaddr dest,
+                        const CnetNICaddr src,
+                        const char *data,
+                        size_t length) {
   // If length of data is greater than packet length then discard.
-  if (length > sizeof(struct nl_packet)) {
+  if (length > NL_PACKET_MAXLENGTH) {
     printf("Mobile: %zu is larger than a nl_packet! ignoring.\n", length);
     return;
   }
-  // Treat this frame as a network layer packet.
-  struct nl_packet packet;
-  memset(&packet, 0, sizeof(packet));
-  memcpy(&packet, data, length);
+  // Decode the header of this frame; the payload is read where it lies.
+  struct nl_header packet;
+  if (!nl_decode_header(data, length, &packet)) return;
+  const char *payload = data + NL_HEADERS_LENGTH(packet);
+  size_t payload_length = packet.length;
 
-  if (packet.dest == nodeinfo.address) 
+  // A CODED packet holds one for us if we sent the packet it was coded with.
+  if (packet.type == CODED) {
+    if (!nl_verify(data, length)) return;
+    char native[NL_PACKET_MAXLENGTH];
+    size_t native_length = coding_decode(payload, payload_length, native);
+    if (native_length > 0) {
+      printf("Mobile: Decoded a packet of %zu bytes from a CODED packet.\n",
+             native_length);
+      up_from_dll(link, dest, src, native, native_length);
+    }
+    return;
+  }
+
+  if (packet.dest == nodeinfo.address)
   {
 	fprintf(stdout, "I GOT A MESSAGE");
 	fprintf(stdout, "from %d\n", packet.src);//I had packet.dest here. I was so confused :(
@@ -144,299 +758,341 @@ static void up_from_dll(int link, const char *data, size_t length) {
 
   printf("Mobile: Received frame from dll on link %d from node %" PRId32   ////this was dodgy SIGNAL 11 !!!!!!
          " for node %" PRId32 ".\n", link, packet.src, packet.dest);
-     
+
   printf("Mobile: type %d seqNum %d \n", packet.type, packet.seqNum);
-  printf("Mobile data: %s\n", data);
-  
+
+  // Beacons tell us which APs and mobiles we can hear, and how well.
+  if (packet.type == BEACON) {
+    if (nl_verify(data, length)) {
+      CnetPosition position;
+      bool from_ap = true;
+      bool located = beacon_decode(payload, payload_length, &position, &from_ap);
+
+      if (!from_ap) {
+        peer_heard(packet.src, src, rx_signal);
+        return;
+      }
+      neighbor_heard(packet.src, src, rx_signal, located ? &position : NULL);
+
+      // Ask a new AP to take us over from our old one, which then hands it
+      // the packets that it was holding for us. If we have been quiet, tell
+      // our AP that we are still in reach, so it sends what it has held.
+      bool moved = neighbor_reselect();
+      const struct neighbor *ap = neighbor_associated();
+
+      // Our AP's beacons carry the credits that pace us.
+      if (located && ap != NULL && ap->ap == packet.src)
+        granted(payload + BEACON_PAYLOAD_LENGTH,
+                payload_length - BEACON_PAYLOAD_LENGTH);
+      if (ap != NULL &&
+          (moved || nodeinfo.time_in_usec - last_sent >= ASSOC_KEEPALIVE))
+        send_control(ASSOC, ap->ap, 0);
+
+      // The frames that we hold are now for the new AP to poll.
+      if (ap != NULL && moved && uplink_count > 0) request_poll();
+
+      // Our own beacons are paced by our AP's.
+      if (nodeinfo.time_in_usec - last_beacon >= PEER_INTERVAL) send_beacon();
+    }
+    return;
+  }
+
   // Hold our checksum.
   uint32_t checksum = packet.checksum;
-  packet.checksum = 0;
-  
-  // Set our broadcast.
-  CnetNICaddr wifi_dest;
-  CHECK(CNET_parse_nicaddr(wifi_dest, "ff:ff:ff:ff:ff:ff"));
-   
 
- 
-  
   // If packet destination does not match our address then discard.
   if (packet.dest != nodeinfo.address) {
     printf("\tThat's not for me.\n");
-    
-    //check the first three letters to see if it's "CTS" 
-    char a[4];
-    strncpy(a, packet.data, 3);
-    //fprintf(stdout, "node %d:data is %s\n", nodeinfo.address, a);	// Strncpy is not working RTS is not being assigned.
-
-    //If it's a CTS get who has the CTS
-    if(0 == strcmp(a, "CTS")) {
-      char access [5];
-      memcpy(access, &packet.data[3], 2);
-      //fprintf(stdout, "node %d: %s:\n", nodeinfo.address, a);
-	
-      printf("CTS to: %s\n", access);
-      if(nodeinfo.address == atoi(access)) {
-        CAN_SEND = 1; 
-        printf("I am cleared to send\n");
-       // sendNext();
-      }  	
-      else {
-        CAN_SEND = -1;
-        printf("I better not be sending\n");
-      }
+    return;
+  }
+
+  // A poll from our AP grants us a burst of the frames that we hold for it.
+  if (packet.type == POLL) {
+    if (nl_verify(data, length) && payload_length >= POLL_PAYLOAD_LENGTH) {
+      granted(payload + POLL_PAYLOAD_LENGTH,
+              payload_length - POLL_PAYLOAD_LENGTH);
+      send_burst((unsigned char)payload[0]);
     }
     return;
-  }  
-  
-  // Check if we've seen this packet recently.
-  for (size_t i = 0; i < PACKET_MEMORY_LENGTH; ++i) {
+  }
+
+  // Ignore packets from addresses we cannot keep state for.
+  if (packet.src < 0 || packet.src >= MAXNODES) return;
+
+  // Check if we've seen this packet recently. DATA is left to its sequence
+  // number instead: a message discarded out of order comes back unchanged.
+  bool fragment = (packet.flags & NL_FLAG_FRAGMENT) != 0;
+  bool remember = !fragment && packet.type != DATA;
+  for (size_t i = 0; remember && i < PACKET_MEMORY_LENGTH; ++i) {
     if (seen_checksums[i] == checksum) {
       printf("\tI seem to have seen this recently.\n");
       return;
     }
   }
-  
+
   // Remember the checksum of this packet.
-  seen_checksums[next_seen_checksum++] = checksum;
-  next_seen_checksum %= PACKET_MEMORY_LENGTH;
-  
+  if (remember) {
+    seen_checksums[next_seen_checksum++] = checksum;
+    next_seen_checksum %= PACKET_MEMORY_LENGTH;
+  }
+
+
 
-  
- // Ensure checksum is valid.
-  if(CNET_crc32((unsigned char *)&packet, sizeof(packet)) != checksum ) {
+ // Ensure checksum is valid. A corrupted length field also fails here.
+  if(!nl_verify(data, length)) {
 	printf("\tChecksum failed  for packet type %d \n", packet.type);
-    // Put something to send NACK here.
-
-	printf( "DB::: strcmp: %d\n", 0 == strcmp((char *)&packet.type,"DATA"));
-	if (strcmp((char *)&packet.type,"DATA")){
-   	 	struct nl_packet npacket = (struct nl_packet) {
-    	  		.src = nodeinfo.address,
-    	  		.dest = packet.src,
-      	  		.length = 0,
-     	  		.type = NACK,
-    	  		.seqNum = packet.seqNum 
-   	 	};     
-  	   //uint16_t packet_length = NL_PACKET_LENGTH(npacket);
-	   npacket.checksum = CNET_crc32((unsigned char *)&npacket, sizeof(npacket));
-   	   // dll_wifi_write(dll_states[link], wifi_dest, (char *)&npacket, packet_length);
-	   packetsSent[npacket.dest]= npacket;		
-	   sendPri(npacket.dest);
-   	   printf("NACK transmitted, seq=%d \n",npacket.seqNum);
+
+	if (packet.type == DATA){
+	   send_control(NACK, packet.src, expectedSeqNums[packet.src]);
+   	   printf("NACK transmitted, seq=%d \n",expectedSeqNums[packet.src]);
 	}
     return;
-  } 
-  
- 
+  }
+
+  // DATA may carry the ACK for our last packet to its source.
+  if (packet.flags & NL_FLAG_ACK) handle_ack(packet.src, packet.ackSeq);
+
+  // Discard DATA that is out of order before reassembling it; go-back-N will
+  // send it again once the gap has been filled.
+  if (packet.type == DATA && packet.seqNum != expectedSeqNums[packet.src]) {
+    uint16_t expected = expectedSeqNums[packet.src];
+    printf("ignored. packet seqNum: %d  expected: %d \n",packet.seqNum, expected);
+
+    if ((int16_t)(packet.seqNum - expected) > 0) {
+      // A message is missing, so report the gap once.
+      if (!nacked[packet.src] || nackedSeqNums[packet.src] != expected) {
+        nacked[packet.src] = true;
+        nackedSeqNums[packet.src] = expected;
+        send_control(NACK, packet.src, expected);
+        printf("NACK transmitted, seq=%d \n", expected);
+      }
+    } else {
+      // We delivered this one already, so our ACK must have been lost.
+      schedule_ack(packet.src, (uint16_t)(expected - 1));
+    }
+    return;
+  }
+
+  // Hold fragments back until the whole message has arrived.
+  if (fragment) {
+    payload = nl_reassemble(&packet, payload, &payload_length);
+    if (payload == NULL) return;
+    printf("\tReassembled message %u of %zu bytes.\n", packet.ident, payload_length);
+  }
 
-    printf("ELSE");
     switch(packet.type) {
       case ACK: {
     	printf("\t seqNum received:%d expected: %d \n", packet.seqNum, expectedSeqNums[packet.src]);
-       // if(packet.seqNum == expectedSeqNums[packet.src]) {
-          printf("\t\t\t\tACK received, seq=%d from node %d \n", packet.seqNum, packet.src );
-          CNET_stop_timer(timers[packet.src]);
-		CNET_enable_application(packet.src);
-          //ackexpected = 1-ackexpected;
-          //CNET_enable_application(ALLNODES);
-       // }
+          handle_ack(packet.src, packet.seqNum);
         break;
       }
       case NACK: {
-       // if(packet.seqNum == expectedSeqNums[packet.src]) {
           printf("\t\t\t\tNACK received, seq=%d\n", packet.seqNum);
-          CNET_stop_timer(timers[packet.src]);
-          printf("timeout, seq=%d\n", ackexpected);
-	  struct nl_packet rpacket = packetsSent[packet.src];
-          ackexpected = 1;     
-          //uint16_t packet_length = NL_PACKET_LENGTH(rpacket);
-	  rpacket.checksum = CNET_crc32((unsigned char *)&rpacket, sizeof(rpacket));
-          //dll_wifi_write(dll_states[link], wifi_dest, (char *)&rpacket, packet_length);
-	  sendPri(packet.src);
-          printf("DATA re-transmitted, seq=%d\n",rpacket.seqNum);
-        //}
+          if (packet.seqNum == flows[packet.src].base)
+            handle_loss(packet.src, false);
         break;
       }
       case DATA: {
         printf("\t\t\t\tDATA received, seq=%d, \n", packet.seqNum);
-        if(packet.seqNum == expectedSeqNums[packet.src]) {
           printf("up to application\n");
-          //CHECK(CNET_write_application(packet.data, &payload_length));
-          expectedSeqNums[packet.src]= 1-expectedSeqNums[packet.src];
-	
-		 struct nl_packet apacket = (struct nl_packet){
-         		 .src = nodeinfo.address,
-          		.dest = packet.src,
-          		.length = 0,
-          		.type = ACK,
-          		.seqNum = packet.seqNum 
-       		 };
-         
-       		 //uint16_t packet_length = NL_PACKET_LENGTH(apacket);
-		packet.checksum = CNET_crc32((unsigned char *)&apacket, sizeof(apacket));
-       		// dll_wifi_write(dll_states[link], wifi_dest, (char *)&apacket, packet_length);
-		packetsSent[apacket.dest]= apacket;
-		sendPri(apacket.dest);
-        	printf("ACK transmitted, seq=%d\n",apacket.seqNum);
-
-  		size_t payload_length = packet.length;
+          ++expectedSeqNums[packet.src];
+
+		schedule_ack(packet.src, packet.seqNum);
+
   		if (payload_length == 0) {printf("got zero length payload.\n");}
   		else	{ // Send this packet to the application layer.
-			printf("\t\t\t\t\t&payload_length: %d packet.data:%d \n", packet.data, &payload_length);
-    			CHECK(CNET_write_application(packet.data, &payload_length));
+    			CHECK(CNET_write_application((char *)payload, &payload_length));
  			printf("\tUp to the application layer!\n");
        			 }
-		}	
-        else {printf("ignored. packet seqNum: %d  expected: %d \n",packet.seqNum, expectedSeqNums[packet.src]);}
-              
-       
 	}
         break;
+      case ASSOC:
+      case BEACON:
+      case POLL:
+      case CODED:
+        break;  // Beacons and CODED packets are handled above; ASSOC is only
+                // sent between APs.
       }
-    
-  
+}
 
+/// Build the packets for a message of the given length, held in message[],
+/// and return them as a chain. A message that fits in one packet is sent
+/// whole; a larger one is split into fragments that fit our links.
+///
+static pkt_handle build_message(const struct nl_header *header, size_t length) {
+  size_t mtu = link_mtu();
 
-	
+  if (NL_HEADERS_LENGTH(*header) + length <= mtu) {
+    pkt_handle handle = pkt_alloc();
+    if (handle == PKT_NULL) return PKT_NULL;
+
+    struct nl_header packet = *header;
+    packet.length = length;
+    memcpy(pkt_data(handle) + NL_HEADERS_LENGTH(packet), message, length);
+    seal_packet(handle, &packet);
+    return handle;
+  }
+
+  struct nl_header packet = *header;
+  packet.ident = next_ident++ & NL_IDENT_MASK;
+
+  size_t piece = nl_fragment_payload(mtu);
+  pkt_handle head = PKT_NULL;
+  pkt_handle tail = PKT_NULL;
+
+  for (size_t offset = 0; offset < length; offset += piece) {
+    size_t count = (length - offset < piece) ? length - offset : piece;
+    pkt_handle fragment = nl_build_fragment(&packet, message + offset, offset,
+                                            count, offset + count < length);
+    if (fragment == PKT_NULL) {
+      pkt_release_chain(head);
+      return PKT_NULL;
+    }
+
+    // Keep the fragments in order on one chain.
+    if (tail == PKT_NULL) head = fragment;
+    else pkt_set_next(tail, fragment);
+    tail = fragment;
+  }
+
+  printf("\tFragmented message %u of %zu bytes for an MTU of %zu.\n",
+         packet.ident, length, mtu);
+  return head;
 }
 
 /// Called when this mobile node's application layer has generated a new
 /// message.
 ///
 static EVENT_HANDLER(application_ready) {
-  // Create a packet.
-  struct nl_packet packet = (struct nl_packet){
+  struct nl_header packet = (struct nl_header){
     .src = nodeinfo.address,
-    .length = NL_MAXDATA,
     .type = DATA,
-    //.seqNum = 1-nextSeqNum /// global next seqNum
   };
 
-  // Create a RTS packet.
- // struct nl_packet rts = (struct nl_packet) {
-  //  .src = nodeinfo.address,
- //   .length = NL_MAXDATA
- // }; 
-  
-  CHECK(CNET_read_application(&packet.dest, packet.data, &packet.length));
- 
-  //strcpy(rts.data, "RTS");
-  //fprintf(stdout, "node %d %s:\n", nodeinfo. address, rts.data);
-
-  // Create checksum for RTS
- // rts.checksum = CNET_crc32((unsigned char*)&rts, sizeof(rts));
-  packet.checksum = CNET_crc32((unsigned char *)&packet, sizeof(packet));
-  
+  // Read the message; it is split into packets once we know its length.
+  size_t length = NL_MAXMESSAGE;
+  CHECK(CNET_read_application(&packet.dest, message, &length));
+
   fprintf(stdout, "Mobile: Generated message for %" PRId32
          ", broadcasting on all data link layers\n",
          packet.dest);
-  
- 
-  //lastpacket = packet;
-    
-  // Create a broadcast address.
-  CnetNICaddr wifi_dest;
-  CHECK(CNET_parse_nicaddr(wifi_dest, "ff:ff:ff:ff:ff:ff"));
-  //CnetNICaddr rts_dest; 
-  //CHECK(CNET_parse_nicaddr(rts_dest, "ff:ff:ff:ff:ff:ff"));
- 
-  uint16_t packet_length = NL_PACKET_LENGTH(packet);
-  lastlength = packet_length;
-  //printf("RTS DATA: %s\n", rts.data);
-
-  //printf("packt.data: %s\n", packet.data); 
-  //printf("Packet size: %zu\n", sizeof(packet));
-  printf("wifi dest: %zu\n", packet.dest);
-  //printf("Node info: %zu\n", nodeinfo.nlinks);
-  CnetTime timeout;
-  timeout = (packet_length*800000000 / linkinfo[1].bandwidth) + /// fix this to expected average
-  	linkinfo[1].propagationdelay;
-  timers[packet.dest]= CNET_start_timer(EV_TIMER3, timeout, 0);
-  
-  for (int i = 1; i <= nodeinfo.nlinks; ++i) {
-    if (dll_states[i] != NULL) {
-	fprintf(stdout, "Node %d has RTS\n",nodeinfo.address);                                                 
-        //dll_wifi_write(dll_states[i], wifi_dest, (char *)&rts, packet_length); 
-
-	MESSAGE m = {
-		.dest = packet.dest,
-		.data = packet.data
-	};
-	
-	buffer[last] = m;
-	last ++;
-	
-	dll_wifi_write(dll_states[i], wifi_dest, (char *)&packet, packet_length);
+
+  assert(packet.dest < MAXNODES);
+  struct flow *f = &flows[packet.dest];
+  packet.seqNum = f->next;
+  piggyback_ack(packet.dest, &packet);
+
+  // A message that starts a burst jumps ahead of bulk traffic. One sent while
+  // others are in flight stays bulk, so that it cannot overtake them and be
+  // NACKed as out of order.
+  NL_SET_CLASS(packet, outstanding(f) == 0 ? NL_CLASS_INTERACTIVE
+                                           : NL_CLASS_BULK);
+
+  pkt_handle handle = build_message(&packet, length);
+  if (handle == PKT_NULL) {
+    printf("Mobile: no buffers for a %zu byte message! dropping.\n", length);
+
+    // The ACK that was to ride on the message is still owed.
+    if (packet.flags & NL_FLAG_ACK) {
+      --acksPiggybacked;
+      schedule_ack(packet.dest, packet.ackSeq);
     }
+    return;
   }
- assert(packet.dest < WINDOWSIZE);
-sentSeqNums[packet.dest]= 1- sentSeqNums[packet.dest];
-  packet.seqNum = sentSeqNums[packet.dest];
- sendPri(packet.dest);
-CNET_disable_application(packet.dest);
-    printf("DATA transmitted, seq=%d\n",packet.seqNum);
-	//ackexpected = 1;
 
-packetsSent[packet.dest] = packet;
+  printf("wifi dest: %" PRId32 "\n", packet.dest);
+
+  // Each packet that goes through our AP spends one of its credits.
+  if (peer_direct(packet.dest) == NULL && neighbor_associated() != NULL) {
+    int count = 0;
+    for (pkt_handle h = handle; h != PKT_NULL; h = pkt_next(h)) ++count;
+    credit_spend(packet.dest, count);
+  }
+
+  // Keep our reference for retransmission, and send it if the window allows.
+  f->sent[f->next % SEND_WINDOW] = handle;
+  f->on_air[f->next % SEND_WINDOW] = false;
+  f->sends[f->next % SEND_WINDOW] = 0;
+  ++f->next;
+
+  send_window(packet.dest);
+
+  // Stop the application while the pool could not hold another large message.
+  if (pkt_pool_free() < MAX_FRAGMENTS + POOL_RESERVE) {
+    pool_throttled = true;
+    CNET_disable_application(ALLNODES);
+  }
+  update_application(packet.dest);
 }
 
-    void sendPri(int num)
-    {
-    // Create a RTS packet.
-    struct nl_packet rts = (struct nl_packet) {
-    .src = nodeinfo.address,
-    .length = NL_MAXDATA
-    };
-    //CHECK(CNET_read_application(&packet.dest, packet.data, &packet.length));
-    sprintf(rts.data, "%s%d", "RTS_PRI", num);                                 /////// this was dodgy SIGNAL 11!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-    // Create checksum for RTS
-   // rts.checksum = CNET_crc32((unsigned char*)&rts, sizeof(rts));
-    // Create a broadcast address.
-   // CnetNICaddr wifi_dest;
-    //CHECK(CNET_parse_nicaddr(wifi_dest, "ff:ff:ff:ff:ff:ff"));
-    //CnetNICaddr rts_dest;
-    //CHECK(CNET_parse_nicaddr(rts_dest, "ff:ff:ff:ff:ff:ff"));
-   // uint16_t packet_length = NL_PACKET_LENGTH(rts);
-    //for (int i = 1; i <= nodeinfo.nlinks; ++i) {
-   // if (dll_states[i] != NULL) {
-    //fprintf(stdout, "Node %d has RTS_PRI %d\n", nodeinfo.address, num);
-   // dll_wifi_write(dll_states[i], wifi_dest, (char *)&rts, packet_length);
-    //}
-   // }
-    }
 /// Called when this mobile node is booted up.
 ///
 void reboot_mobile() {
   // We require each node to have a different stream of random numbers.
   CNET_srand(nodeinfo.time_of_day.sec + nodeinfo.nodenumber);
 
+  // Preallocate this node's packet buffers.
+  pkt_pool_init();
+  nl_reassembly_init();
+  neighbor_init();
+  peer_init();
+  credit_init();
+  coding_init();
+
+  // Nothing waits to be polled.
+  for (int c = 0; c < NL_CLASSES; ++c) {
+    for (int i = 0; i < UPLINK_DEPTH; ++i) uplink[c][i] = PKT_NULL;
+    uplink_head[c] = 0;
+    uplink_queued[c] = 0;
+  }
+  uplink_count = 0;
+  poll_retry = NULLTIMER;
+
+  // Every flow starts empty, in slow start.
+  for (int i = 0; i < MAXNODES; ++i) {
+    for (int j = 0; j < SEND_WINDOW; ++j) flows[i].sent[j] = PKT_NULL;
+    flows[i].timer = NULLTIMER;
+    flows[i].srtt = 0;
+    flows[i].rttvar = 0;
+    flows[i].rto = RTO_INITIAL;
+    cc_init(&flows[i].cc);
+    uplink_waiting[i] = false;
+  }
+
   // Provide the required event handlers.
   CHECK(CNET_set_handler(EV_PHYSICALREADY, physical_ready, 0));
   CHECK(CNET_set_handler(EV_APPLICATIONREADY, application_ready, 0));
   CHECK(CNET_set_handler(EV_FRAMECOLLISION, collision, 0));
   CHECK(CNET_set_handler(EV_TIMER3, timeouts, 0));
-  
+  CHECK(CNET_set_handler(EV_TIMER4, ack_timeout, 0));
+  CHECK(CNET_set_handler(EV_POLL, poll_timeout, 0));
+  CHECK(CNET_set_handler(EV_SHUTDOWN, shutdown, 0));
+
   // Initialize mobility.
   init_walking();
   start_walking();
 
   // Prepare to talk via our wireless connection.
   CNET_set_wlan_model(my_WLAN_model);
-  
+
   // Setup our data link layer instances.
   dll_states = calloc(nodeinfo.nlinks + 1, sizeof(struct dll_wifi_state *));
-  
+
   // Set our wifi states.
   for (int link = 1; link <= nodeinfo.nlinks; ++link) {
     if (linkinfo[link].linktype == LT_WLAN) {
       dll_states[link] = dll_wifi_new_state(link,
                                             up_from_dll,
                                             false /* is_ds */);
+      dll_wifi_fec(dll_states[link], true);
+      dll_wifi_power_control(dll_states[link], true);
+      dll_wifi_rate_adaptation(dll_states[link], true);
     }
   }
-  
+
   // Start cnet's default application layer.
   CNET_enable_application(ALLNODES);
-  
+
   printf("reboot_mobile() complete.\n");
   printf("\tMy address: %" PRId32 ".\n", nodeinfo.address);
 }
@@ -0,0 +1,139 @@
+/// This file implements the neighbor table kept by each mobile node. Signal
+/// strength is smoothed with an exponentially weighted moving average, so one
+/// faded beacon does not move our association.
+
+#include "neighbor.h"
+#include "walking.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+
+static struct neighbor table[NEIGHBOR_MAX];
+
+// The entry of the AP that we are associated with, or NULL.
+static struct neighbor *current = NULL;
+
+/// Returns true iff we have heard the given AP within NEIGHBOR_TIMEOUT.
+///
+static bool in_range(const struct neighbor *n) {
+  return n->used && nodeinfo.time_in_usec - n->heard <= NEIGHBOR_TIMEOUT;
+}
+
+/// Returns the distance in metres between two positions, but at least one metre.
+///
+static double distance(const CnetPosition *a, const CnetPosition *b) {
+  double dx = a->x - b->x;
+  double dy = a->y - b->y;
+  return fmax(sqrt(dx * dx + dy * dy), 1.0);
+}
+
+/// Returns the signal strength (dBm) that we expect from the given AP when we
+/// have moved from here to there. The measured signal is scaled by the change
+/// in path loss, so no absolute model of the radio is needed.
+///
+static double predict(const struct neighbor *n,
+                      const CnetPosition *here,
+                      const CnetPosition *there) {
+  if (!n->located || there == NULL) return n->rssi;
+  
+  return n->rssi - 10.0 * NEIGHBOR_PATHLOSS *
+         log10(distance(there, &n->position) / distance(here, &n->position));
+}
+
+/// Clear the neighbor table.
+///
+void neighbor_init(void) {
+  memset(table, 0, sizeof(table));
+  current = NULL;
+}
+
+/// Record a frame heard from ap.
+///
+void neighbor_heard(CnetAddr ap,
+                    const CnetNICaddr nic,
+                    double rssi,
+                    const CnetPosition *position) {
+  struct neighbor *slot = NULL;
+
+  // Find the AP's entry; failing that, take a free entry or the one heard
+  // from least recently (which is never our current AP, if it is in range).
+  for (int i = 0; i < NEIGHBOR_MAX; ++i) {
+    struct neighbor *n = &table[i];
+
+    if (n->used && n->ap == ap) {
+      slot = n;
+      break;
+    }
+    if (n == current && in_range(n)) continue;
+    if (slot == NULL || !n->used || (slot->used && n->heard < slot->heard))
+      slot = n;
+  }
+  if (slot == NULL) return;
+
+  if (!slot->used || slot->ap != ap || !in_range(slot)) {
+    // A new (or returning) AP starts from its first sample.
+    if (slot == current) current = NULL;
+    slot->used = true;
+    slot->ap = ap;
+    slot->rssi = rssi;
+  } else {
+    slot->rssi += NEIGHBOR_ALPHA * (rssi - slot->rssi);
+  }
+
+  memcpy(slot->nic, nic, sizeof(CnetNICaddr));
+  slot->heard = nodeinfo.time_in_usec;
+  slot->located = (position != NULL);
+  if (position != NULL) slot->position = *position;
+}
+
+/// Choose the AP to associate with.
+///
+bool neighbor_reselect(void) {
+  // Where we are, and where our walk will have taken us (if we are walking).
+  CnetPosition here, ahead;
+  const CnetPosition *there = NULL;
+  
+  if (am_walking()) {
+    CHECK(CNET_get_position(&here, NULL));
+    walking_predict(NEIGHBOR_LOOKAHEAD, &ahead);
+    there = &ahead;
+  }
+  
+  struct neighbor *best = NULL;
+  double best_rssi = 0.0;
+
+  for (int i = 0; i < NEIGHBOR_MAX; ++i) {
+    if (!in_range(&table[i])) continue;
+
+    double rssi = predict(&table[i], &here, there);
+    if (best == NULL || rssi > best_rssi) {
+      best = &table[i];
+      best_rssi = rssi;
+    }
+  }
+
+  // Stay with our AP while it is in range and not much weaker than the best.
+  if (current != NULL && in_range(current) &&
+      (best == NULL ||
+       best_rssi <= predict(current, &here, there) + NEIGHBOR_HYSTERESIS))
+    return false;
+
+  if (best == current) return false;
+  current = best;
+
+  if (current == NULL)
+    printf("Mobile %" PRId32 ": no longer associated.\n", nodeinfo.address);
+  else
+    printf("Mobile %" PRId32 ": associated with AP %" PRId32
+           " (%.1f dBm, %.1f dBm expected).\n",
+           nodeinfo.address, current->ap, current->rssi, best_rssi);
+  return true;
+}
+
+/// Returns the AP that we are associated with.
+///
+const struct neighbor *neighbor_associated(void) {
+  return (current != NULL && in_range(current)) ? current : NULL;
+}
@@ -0,0 +1,69 @@
+/// This file declares the neighbor table kept by each mobile node. The table
+/// tracks the signal strength of every access point that the mobile hears,
+/// smoothed over the AP's beacons, and chooses the AP that the mobile is
+/// associated with. Frames for the network are addressed to the NIC of that
+/// AP, so the other APs in range do not have to handle them.
+///
+/// While the mobile walks, the choice is made on the signal strengths that
+/// we expect NEIGHBOR_LOOKAHEAD usecs ahead, given where each AP is and where
+/// the walk is taking us. We so reassociate before we leave our AP's cell,
+/// while it can still hand our packets to the new AP.
+
+#ifndef NEIGHBOR_H
+#define NEIGHBOR_H
+
+#include <cnet.h>
+#include <stdbool.h>
+
+#define NEIGHBOR_MAX 8              // The most APs tracked at once.
+#define NEIGHBOR_ALPHA 0.25         // The weight of each new signal sample.
+#define NEIGHBOR_TIMEOUT 500000     // Usecs without a beacon before an AP is lost.
+#define NEIGHBOR_HYSTERESIS 6.0     // dB by which another AP must be stronger
+                                    // than ours before we reassociate.
+#define NEIGHBOR_LOOKAHEAD 2000000  // Usecs ahead that signals are predicted.
+#define NEIGHBOR_PATHLOSS 3.0       // The exponent of the path loss with distance.
+
+/// This struct holds what a mobile knows about one access point in range.
+///
+struct neighbor {
+  // True iff this entry holds an AP.
+  bool used;
+
+  // The AP, and the NIC address of its WiFi link.
+  CnetAddr ap;
+  CnetNICaddr nic;
+
+  // The smoothed signal strength of the AP's frames (dBm), and the time that
+  // we last heard from it.
+  double rssi;
+  CnetTime heard;
+
+  // The position of the AP, iff located is true.
+  bool located;
+  CnetPosition position;
+};
+
+/// Clear the neighbor table. Called when a mobile reboots.
+///
+void neighbor_init(void);
+
+/// Record a frame heard from ap, sent by nic with a signal of rssi dBm. The
+/// position of the AP is given, if it is known, or is NULL.
+///
+void neighbor_heard(CnetAddr ap,
+                    const CnetNICaddr nic,
+                    double rssi,
+                    const CnetPosition *position);
+
+/// Choose the AP to associate with: the strongest AP in range, unless our
+/// current AP is still in range and within NEIGHBOR_HYSTERESIS of it. While
+/// we walk, the signals predicted for NEIGHBOR_LOOKAHEAD usecs ahead are
+/// compared. Returns true iff our association changed.
+///
+bool neighbor_reselect(void);
+
+/// Returns the AP that we are associated with, or NULL if there is none.
+///
+const struct neighbor *neighbor_associated(void);
+
+#endif // NEIGHBOR_H
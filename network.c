@@ -0,0 +1,135 @@
+/// This file implements the encoding and decoding of our network layer header.
+/// Fields are written a byte at a time, so the wire format is little-endian on
+/// every host.
+
+#include "network.h"
+
+#include <cnet.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FIELD(NAME) offsetof(struct nl_wire_header, NAME)
+#define ACK_FIELD(NAME) \
+  (NL_HEADER_LENGTH + offsetof(struct nl_wire_ack_header, NAME))
+#define FRAG_FIELD(START, NAME) \
+  ((START) + offsetof(struct nl_wire_frag_header, NAME))
+
+/// Write a 16-bit value in little-endian byte order.
+///
+static void put_le16(char *buf, uint16_t value) {
+  buf[0] = (char)(value & 0xFF);
+  buf[1] = (char)(value >> 8);
+}
+
+/// Write a 32-bit value in little-endian byte order.
+///
+static void put_le32(char *buf, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    buf[i] = (char)((value >> (8 * i)) & 0xFF);
+}
+
+/// Read a 16-bit value in little-endian byte order.
+///
+static uint16_t get_le16(const char *buf) {
+  const unsigned char *b = (const unsigned char *)buf;
+  return (uint16_t)(b[0] | (b[1] << 8));
+}
+
+/// Read a 32-bit value in little-endian byte order.
+///
+static uint32_t get_le32(const char *buf) {
+  const unsigned char *b = (const unsigned char *)buf;
+  return (uint32_t)b[0] | ((uint32_t)b[1] << 8) |
+         ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+/// Write the given header into the first NL_HEADER_LENGTH bytes of buf.
+///
+void nl_encode_header(const struct nl_header *header, char *buf) {
+  put_le32(buf + FIELD(checksum), header->checksum);
+  buf[FIELD(type_flags)] = (char)((header->type & NL_TYPE_MASK) |
+                                  (header->flags & NL_FLAGS_MASK));
+  put_le16(buf + FIELD(seq), header->seqNum);
+  put_le16(buf + FIELD(length), header->length);
+  put_le32(buf + FIELD(dest), (uint32_t)header->dest);
+  put_le32(buf + FIELD(src), (uint32_t)header->src);
+
+  // The optional headers follow in a fixed order: ACK, then fragment.
+  size_t frag = NL_HEADER_LENGTH;
+  if (header->flags & NL_FLAG_ACK) {
+    put_le16(buf + ACK_FIELD(ack), header->ackSeq);
+    frag += NL_ACK_HEADER_LENGTH;
+  }
+
+  if (header->flags & NL_FLAG_FRAGMENT) {
+    put_le16(buf + FRAG_FIELD(frag, ident), header->ident);
+    put_le16(buf + FRAG_FIELD(frag, offset), header->offset / NL_FRAG_UNIT);
+  }
+}
+
+/// Read a header from the first NL_HEADER_LENGTH bytes of buf.
+///
+bool nl_decode_header(const char *buf, size_t length, struct nl_header *header) {
+  if (length < NL_HEADER_LENGTH) return false;
+
+  uint8_t type_flags = (uint8_t)buf[FIELD(type_flags)];
+
+  header->checksum = get_le32(buf + FIELD(checksum));
+  header->type = (enum networkAck)(type_flags & NL_TYPE_MASK);
+  header->flags = type_flags & NL_FLAGS_MASK;
+  header->seqNum = get_le16(buf + FIELD(seq));
+  header->length = get_le16(buf + FIELD(length));
+  header->dest = (CnetAddr)get_le32(buf + FIELD(dest));
+  header->src = (CnetAddr)get_le32(buf + FIELD(src));
+
+  if (length < NL_HEADERS_LENGTH(*header)) return false;
+
+  // The optional headers follow in a fixed order: ACK, then fragment.
+  size_t frag = NL_HEADER_LENGTH;
+  header->ackSeq = 0;
+  if (header->flags & NL_FLAG_ACK) {
+    header->ackSeq = get_le16(buf + ACK_FIELD(ack));
+    frag += NL_ACK_HEADER_LENGTH;
+  }
+
+  header->ident = 0;
+  header->offset = 0;
+  if (header->flags & NL_FLAG_FRAGMENT) {
+    header->ident = get_le16(buf + FRAG_FIELD(frag, ident));
+    header->offset = (uint32_t)get_le16(buf + FRAG_FIELD(frag, offset)) * NL_FRAG_UNIT;
+  }
+
+  return true;
+}
+
+/// Compute the checksum of the encoded packet in buf, and store it.
+///
+void nl_seal(char *buf, size_t length) {
+  uint32_t checksum = CNET_crc32((unsigned char *)buf + sizeof(uint32_t),
+                                 length - sizeof(uint32_t));
+  put_le32(buf + FIELD(checksum), checksum);
+}
+
+/// Returns the traffic class of the encoded packet in buf.
+///
+enum nl_class nl_packet_class(const char *buf, size_t length) {
+  if (length < NL_HEADER_LENGTH) return NL_CLASS_BULK;
+
+  uint8_t type_flags = (uint8_t)buf[FIELD(type_flags)];
+  return (enum nl_class)((type_flags & NL_CLASS_MASK) >> NL_CLASS_SHIFT);
+}
+
+/// Returns true iff the encoded packet in buf is complete and valid.
+///
+bool nl_verify(const char *buf, size_t length) {
+  struct nl_header header;
+  if (!nl_decode_header(buf, length, &header)) return false;
+
+  // A corrupted length field must not send the checksum past the frame.
+  size_t packet_length = NL_PACKET_LENGTH(header);
+  if (header.length > NL_MAXDATA || packet_length > length) return false;
+
+  uint32_t checksum = CNET_crc32((unsigned char *)buf + sizeof(uint32_t),
+                                 packet_length - sizeof(uint32_t));
+  return checksum == get_le32(buf + FIELD(checksum));
+}
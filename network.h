@@ -5,50 +5,204 @@
 #define NETWORK_H
 
 #include <cnet.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-// Make this small for now, so that we don't need to worry about fragmenting
-// packets.
+// The largest payload carried by a single packet. Messages larger than the
+// MTU of a link are split into fragments of at most this size.
 //
-#define NL_MAXDATA 1024
+#define NL_MAXDATA 2288
+
+// The largest application message that can be fragmented and reassembled.
+//
+#define NL_MAXMESSAGE 65536
 
 // Define an enum to represent our frame.
 enum networkAck {
     ACK,
     NACK,
-    DATA 
+    DATA,
+    ASSOC,      // Sent between APs over the LAN to share an association.
+    BEACON,     // Broadcast by APs into their cells, so mobiles can find them.
+    POLL,       // Sent between a mobile and its AP to schedule the mobile's frames.
+    CODED       // Broadcast by an AP: two packets XORed, for two mobiles that
+                // each sent one of them (see coding.h).
 };
 
-/// This struct defines the format for a network layer packet.
+#define NL_TYPE_MASK 0x07   // The bits of type_flags that hold the type.
+#define NL_FLAGS_MASK 0xF8  // The bits of type_flags that are free for flags.
+
+#define NL_FLAG_FRAGMENT 0x08   // A fragment header follows the header.
+#define NL_FLAG_MORE 0x10       // More fragments of this message follow.
+#define NL_FLAG_ACK 0x20        // An ACK header follows the header.
+
+#define NL_CLASS_MASK 0xC0      // The bits of type_flags that hold the class.
+#define NL_CLASS_SHIFT 6
+
+/// This enumerates the traffic classes that a packet may belong to, from the
+/// least urgent. The classes are numbered so that they can be given to the
+/// data link layers as priorities.
 ///
-struct nl_packet {
+enum nl_class {
+    NL_CLASS_BULK,          // DATA that follows other DATA still in flight.
+    NL_CLASS_INTERACTIVE,   // DATA that starts a burst, such as a request.
+    NL_CLASS_CONTROL        // ACKs, NACKs, and every other non-DATA packet.
+};
+
+#define NL_CLASSES 3
+
+/// This struct documents the layout of a network layer header on the wire.
+/// Every multi-byte field is little-endian, whatever the host byte order, and
+/// the struct is packed so that no alignment holes are transmitted. Headers are
+/// only ever read and written through nl_encode_header and nl_decode_header.
+///
+struct nl_wire_header {
+  /// CRC32 over every byte of the packet that follows this field. Keeping it
+  /// first lets a receiver verify a packet without modifying it.
+  uint32_t checksum;
+
+  /// The packet type in the low three bits, and flags in the remaining bits.
+  uint8_t type_flags;
+
+  /// The sequence number of this packet.
+  uint16_t seq;
+
+  /// Length of this packet's payload.
+  uint16_t length;
+
+  /// The node that this packet is destined for.
+  int32_t dest;
+
+  /// The node that this packet was created by.
+  int32_t src;
+} __attribute__((packed));
+
+#define NL_HEADER_LENGTH (sizeof(struct nl_wire_header))
+
+_Static_assert(sizeof(struct nl_wire_header) == 17, "nl_wire_header must be 17 bytes");
+_Static_assert(NL_MAXDATA <= UINT16_MAX, "payload length must fit in 16 bits");
+
+/// This struct documents the layout of the ACK header, which follows the header
+/// on the wire iff NL_FLAG_ACK is set. It lets a DATA packet carry the ACK for
+/// the last packet received from its destination.
+///
+struct nl_wire_ack_header {
+  /// The sequence number being acknowledged.
+  uint16_t ack;
+} __attribute__((packed));
+
+#define NL_ACK_HEADER_LENGTH (sizeof(struct nl_wire_ack_header))
+
+_Static_assert(sizeof(struct nl_wire_ack_header) == 2, "nl_wire_ack_header must be 2 bytes");
+
+#define NL_FRAG_UNIT 8  // Fragment offsets are measured in units of this many bytes.
+
+/// This struct documents the layout of the fragment header, which follows the
+/// header (and the ACK header, if any) on the wire iff NL_FLAG_FRAGMENT is set. Unfragmented packets (and
+/// so every ACK and NACK) do not carry it.
+///
+struct nl_wire_frag_header {
+  /// Identifies the message that this fragment belongs to, for its source.
+  uint16_t ident;
+
+  /// The offset of this fragment's payload within the message, in units of
+  /// NL_FRAG_UNIT bytes.
+  uint16_t offset;
+} __attribute__((packed));
+
+#define NL_FRAG_HEADER_LENGTH (sizeof(struct nl_wire_frag_header))
+
+_Static_assert(sizeof(struct nl_wire_frag_header) == 4, "nl_wire_frag_header must be 4 bytes");
+_Static_assert(NL_MAXDATA % NL_FRAG_UNIT == 0, "fragments must end on a unit boundary");
+_Static_assert(NL_MAXMESSAGE / NL_FRAG_UNIT <= UINT16_MAX + 1, "fragment offsets must fit in 16 bits");
+
+/// This struct holds a decoded network layer header in host form. The payload
+/// always follows the encoded header directly in the same buffer.
+///
+struct nl_header {
   /// The node that this packet is destined for.
   CnetAddr dest;
-  
+
   /// The node that this packet was created by.
   CnetAddr src;
-    
-    enum networkAck type;
-    
-    int seqNum;
-  
+
+  enum networkAck type;
+
+  /// Flag bits, already positioned within NL_FLAGS_MASK.
+  uint8_t flags;
+
+  uint16_t seqNum;
+
   /// Checksum for this packet.
   uint32_t checksum;
-  
+
   /// Length of this packet's payload.
-  size_t length;
-  
-  /// The payload of this packet.
-  char data[NL_MAXDATA];
+  uint16_t length;
+
+  /// The sequence number acknowledged by this packet, iff NL_FLAG_ACK is set.
+  uint16_t ackSeq;
+
+  /// The message identifier, iff NL_FLAG_FRAGMENT is set.
+  uint16_t ident;
+
+  /// The byte offset of the payload within the message, iff NL_FLAG_FRAGMENT
+  /// is set.
+  uint32_t offset;
 };
 
+// Determines the traffic class of a decoded header.
+//
+#define NL_CLASS(HDR) ((enum nl_class)(((HDR).flags & NL_CLASS_MASK) >> NL_CLASS_SHIFT))
+
+// Sets the traffic class of a decoded header.
+//
+#define NL_SET_CLASS(HDR, CLASS) \
+  ((HDR).flags = (uint8_t)(((HDR).flags & ~NL_CLASS_MASK) | \
+                           (((CLASS) << NL_CLASS_SHIFT) & NL_CLASS_MASK)))
+
+// Determines the number of bytes used by the headers of a packet.
+//
+#define NL_HEADERS_LENGTH(HDR) \
+  (NL_HEADER_LENGTH + \
+   (((HDR).flags & NL_FLAG_ACK) ? NL_ACK_HEADER_LENGTH : 0) + \
+   (((HDR).flags & NL_FLAG_FRAGMENT) ? NL_FRAG_HEADER_LENGTH : 0))
+
 // Determines the number of bytes used by a packet (the number of bytes used
-// by the header plus the number of bytes used by the payload).
+// by the headers plus the number of bytes used by the payload).
+//
+#define NL_PACKET_LENGTH(HDR) (NL_HEADERS_LENGTH(HDR) + (HDR).length)
+
+// The largest number of bytes used by any packet.
 //
-#define NL_PACKET_LENGTH(PKT) (offsetof(struct nl_packet, data) + PKT.length)
+#define NL_PACKET_MAXLENGTH \
+  (NL_HEADER_LENGTH + NL_ACK_HEADER_LENGTH + NL_FRAG_HEADER_LENGTH + NL_MAXDATA)
+
+/// Write the given header (and its ACK and fragment headers, if any) into the first
+/// NL_HEADERS_LENGTH bytes of buf. The checksum field is written as given; use
+/// nl_seal to compute it.
+///
+void nl_encode_header(const struct nl_header *header, char *buf);
+
+/// Read a header (and its ACK and fragment headers, if any) from the start of buf.
+/// Returns false if length is too short to hold the headers.
+///
+bool nl_decode_header(const char *buf, size_t length, struct nl_header *header);
+
+/// Compute the checksum of the encoded packet of the given length in buf, and
+/// store it in the packet's header.
+///
+void nl_seal(char *buf, size_t length);
+
+/// Returns the traffic class of the encoded packet of the given length in buf,
+/// without decoding the rest of its header. A buffer too short to hold a
+/// header is bulk.
+///
+enum nl_class nl_packet_class(const char *buf, size_t length);
+
+/// Returns true iff the encoded packet in buf is complete (its payload length
+/// fits in the given length) and its checksum is valid.
+///
+bool nl_verify(const char *buf, size_t length);
 
 #endif // NETWORK_H
-  
-  
-  
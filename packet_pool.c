@@ -0,0 +1,170 @@
+/// This file implements the reference-counted packet buffer pool. The slab is
+/// a single calloc'd array, and free buffers are chained through their next
+/// index so that allocation and release are both O(1).
+
+#include "packet_pool.h"
+
+#include <cnet.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// This struct holds one buffer of the pool.
+///
+struct pkt_buf {
+  // The number of references held to this buffer (zero iff it is free).
+  int refcount;
+
+  // The index of the next free buffer, while this buffer is on the free list.
+  pkt_handle next_free;
+
+  // The index of the next buffer on this buffer's chain, while allocated.
+  pkt_handle next;
+
+  // The number of payload bytes stored in this buffer.
+  size_t length;
+
+  // Space for a data link layer header, followed by the payload itself.
+  char bytes[PKT_HEADROOM + PKT_MAXDATA];
+};
+
+static struct pkt_buf *slab = NULL;         // The preallocated buffers.
+static pkt_handle free_head = PKT_NULL;     // The first free buffer.
+static int in_use = 0;                      // The number of allocated buffers.
+
+/// Allocate the slab and free list for this node.
+///
+void pkt_pool_init(void) {
+  if (slab == NULL) {
+    slab = calloc(PKT_POOL_SIZE, sizeof(struct pkt_buf));
+    if (slab == NULL) {
+      fprintf(stderr, "%s: cannot allocate packet pool\n", nodeinfo.nodename);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Chain every buffer onto the free list.
+  for (pkt_handle i = 0; i < PKT_POOL_SIZE; ++i) {
+    slab[i].refcount = 0;
+    slab[i].next_free = (i + 1 < PKT_POOL_SIZE) ? i + 1 : PKT_NULL;
+  }
+  free_head = 0;
+  in_use = 0;
+}
+
+/// Take a buffer from the free list.
+///
+pkt_handle pkt_alloc(void) {
+  if (free_head == PKT_NULL) {
+    printf("POOL: no free packet buffers.\n");
+    return PKT_NULL;
+  }
+
+  pkt_handle handle = free_head;
+  free_head = slab[handle].next_free;
+
+  slab[handle].refcount = 1;
+  slab[handle].next_free = PKT_NULL;
+  slab[handle].next = PKT_NULL;
+  slab[handle].length = 0;
+  ++in_use;
+
+  return handle;
+}
+
+/// Allocate a buffer and copy the given bytes into its payload area.
+///
+pkt_handle pkt_copy_in(const char *data, size_t length) {
+  if (length > PKT_MAXDATA) return PKT_NULL;
+
+  pkt_handle handle = pkt_alloc();
+  if (handle == PKT_NULL) return PKT_NULL;
+
+  memcpy(pkt_data(handle), data, length);
+  slab[handle].length = length;
+
+  return handle;
+}
+
+/// Add a reference to the given buffer.
+///
+pkt_handle pkt_ref(pkt_handle handle) {
+  if (handle != PKT_NULL) ++slab[handle].refcount;
+  return handle;
+}
+
+/// Drop a reference to the given buffer.
+///
+void pkt_release(pkt_handle handle) {
+  if (handle == PKT_NULL || slab[handle].refcount == 0) return;
+
+  // Return the buffer to the free list once nobody refers to it.
+  if (--slab[handle].refcount == 0) {
+    slab[handle].next_free = free_head;
+    free_head = handle;
+    --in_use;
+  }
+}
+
+/// Returns a pointer to the payload area of the given buffer.
+///
+char *pkt_data(pkt_handle handle) {
+  return slab[handle].bytes + PKT_HEADROOM;
+}
+
+/// Returns a pointer to the hdr_length bytes in front of the payload.
+///
+char *pkt_headroom(pkt_handle handle, size_t hdr_length) {
+  return slab[handle].bytes + PKT_HEADROOM - hdr_length;
+}
+
+/// Returns the number of payload bytes stored in the given buffer.
+///
+size_t pkt_length(pkt_handle handle) {
+  return slab[handle].length;
+}
+
+/// Set the number of payload bytes stored in the given buffer.
+///
+void pkt_set_length(pkt_handle handle, size_t length) {
+  slab[handle].length = (length > PKT_MAXDATA) ? PKT_MAXDATA : length;
+}
+
+/// Returns true iff the given buffer is referenced from more than one place.
+///
+bool pkt_shared(pkt_handle handle) {
+  return slab[handle].refcount > 1;
+}
+
+/// Returns the number of buffers currently allocated on this node.
+///
+int pkt_pool_in_use(void) {
+  return in_use;
+}
+
+/// Returns the number of buffers currently free on this node.
+///
+int pkt_pool_free(void) {
+  return PKT_POOL_SIZE - in_use;
+}
+
+/// Returns the buffer that follows the given buffer on its chain.
+///
+pkt_handle pkt_next(pkt_handle handle) {
+  return slab[handle].next;
+}
+
+/// Set the buffer that follows the given buffer on its chain.
+///
+void pkt_set_next(pkt_handle handle, pkt_handle next) {
+  slab[handle].next = next;
+}
+
+/// Drop a reference to every buffer on the chain starting at the given buffer.
+///
+void pkt_release_chain(pkt_handle handle) {
+  while (handle != PKT_NULL) {
+    pkt_handle next = slab[handle].next;
+    pkt_release(handle);
+    handle = next;
+  }
+}
@@ -0,0 +1,93 @@
+/// This file declares a reference-counted pool of packet buffers. Each node
+/// preallocates a fixed slab of buffers when it reboots, and the layers pass
+/// small integer handles to these buffers around instead of copying whole
+/// packets by value.
+
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include "dll_shared.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PKT_POOL_SIZE 256   // The number of buffers preallocated per node.
+#define PKT_HEADROOM 32     // Bytes reserved in front of each payload so that a
+                            // data link layer can prepend its header in place.
+#define PKT_MAXDATA 2312    // The largest payload any of our links can carry.
+
+/// A handle to one buffer in the pool. Handles are only meaningful on the node
+/// that allocated them.
+///
+typedef int pkt_handle;
+
+#define PKT_NULL (-1)   // The handle that refers to no buffer.
+
+/// Allocate the slab and free list for this node. Must be called once from the
+/// node's reboot function before any other pool function.
+///
+void pkt_pool_init(void);
+
+/// Take a buffer from the free list. The buffer starts with a reference count
+/// of one and a length of zero. Returns PKT_NULL if the pool is exhausted.
+///
+pkt_handle pkt_alloc(void);
+
+/// Allocate a buffer and copy the given bytes into its payload area. Returns
+/// PKT_NULL if the pool is exhausted or the data will not fit.
+///
+pkt_handle pkt_copy_in(const char *data, size_t length);
+
+/// Add a reference to the given buffer, and return the same handle.
+///
+pkt_handle pkt_ref(pkt_handle handle);
+
+/// Drop a reference to the given buffer. The buffer returns to the free list
+/// when its last reference is dropped. Releasing PKT_NULL does nothing.
+///
+void pkt_release(pkt_handle handle);
+
+/// Returns a pointer to the payload area of the given buffer.
+///
+char *pkt_data(pkt_handle handle);
+
+/// Returns a pointer to the hdr_length bytes immediately in front of the
+/// payload, for a data link layer to write its header into.
+///
+char *pkt_headroom(pkt_handle handle, size_t hdr_length);
+
+/// Returns the number of payload bytes currently stored in the given buffer.
+///
+size_t pkt_length(pkt_handle handle);
+
+/// Set the number of payload bytes stored in the given buffer.
+///
+void pkt_set_length(pkt_handle handle, size_t length);
+
+/// Returns true iff the given buffer is referenced from more than one place.
+///
+bool pkt_shared(pkt_handle handle);
+
+/// Returns the number of buffers currently allocated on this node.
+///
+int pkt_pool_in_use(void);
+
+/// Returns the number of buffers currently free on this node.
+///
+int pkt_pool_free(void);
+
+/// Returns the buffer that follows the given buffer on its chain, or PKT_NULL.
+/// Chains link the fragments of one message, and a buffer may be on at most
+/// one chain at a time.
+///
+pkt_handle pkt_next(pkt_handle handle);
+
+/// Set the buffer that follows the given buffer on its chain.
+///
+void pkt_set_next(pkt_handle handle, pkt_handle next);
+
+/// Drop a reference to every buffer on the chain starting at the given buffer.
+///
+void pkt_release_chain(pkt_handle handle);
+
+#endif // PACKET_POOL_H
@@ -0,0 +1,81 @@
+/// This file implements the peer table kept by each mobile node. Like the
+/// neighbor table, signal strength is smoothed so one faded beacon does not
+/// move traffic off the direct path.
+
+#include "peer.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+#include <string.h>
+
+static struct peer table[PEER_MAX];
+
+/// Returns true iff we have heard the given peer within PEER_TIMEOUT.
+///
+static bool in_range(const struct peer *p) {
+  return p->used && nodeinfo.time_in_usec - p->heard <= PEER_TIMEOUT;
+}
+
+/// Returns the entry of the given mobile, or NULL.
+///
+static struct peer *find(CnetAddr addr) {
+  for (int i = 0; i < PEER_MAX; ++i) {
+    if (table[i].used && table[i].addr == addr) return &table[i];
+  }
+  return NULL;
+}
+
+/// Clear the peer table.
+///
+void peer_init(void) {
+  memset(table, 0, sizeof(table));
+}
+
+/// Record a beacon heard from a mobile.
+///
+void peer_heard(CnetAddr addr, const CnetNICaddr nic, double rssi) {
+  struct peer *slot = find(addr);
+
+  // Failing that, take a free entry or the one heard from least recently.
+  if (slot == NULL) {
+    for (int i = 0; i < PEER_MAX; ++i) {
+      struct peer *p = &table[i];
+      if (slot == NULL || !p->used || (slot->used && p->heard < slot->heard))
+        slot = p;
+    }
+  }
+
+  if (!slot->used || slot->addr != addr || !in_range(slot)) {
+    // A new (or returning) peer starts from its first sample.
+    if (!slot->used || slot->addr != addr) slot->failed_until = 0;
+    slot->used = true;
+    slot->addr = addr;
+    slot->rssi = rssi;
+  } else {
+    slot->rssi += PEER_ALPHA * (rssi - slot->rssi);
+  }
+
+  memcpy(slot->nic, nic, sizeof(CnetNICaddr));
+  slot->heard = nodeinfo.time_in_usec;
+}
+
+/// Returns the entry of addr if packets for it should be sent directly.
+///
+const struct peer *peer_direct(CnetAddr addr) {
+  const struct peer *p = find(addr);
+
+  if (p == NULL || !in_range(p) || p->rssi < PEER_GOOD_RSSI) return NULL;
+  if (nodeinfo.time_in_usec < p->failed_until) return NULL;
+  return p;
+}
+
+/// Record that packets sent directly to addr went unanswered.
+///
+void peer_failed(CnetAddr addr) {
+  struct peer *p = find(addr);
+  if (p == NULL || nodeinfo.time_in_usec < p->failed_until) return;
+
+  p->failed_until = nodeinfo.time_in_usec + PEER_HOLDDOWN;
+  printf("Mobile %" PRId32 ": no answer from peer %" PRId32
+         ", sending through our AP.\n", nodeinfo.address, addr);
+}
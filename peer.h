@@ -0,0 +1,59 @@
+/// This file declares the peer table kept by each mobile node. It tracks the
+/// other mobiles whose beacons we hear, and how strongly. A packet for a peer
+/// that we hear well is sent straight to its NIC, rather than through our AP
+/// and perhaps across the LAN. A peer that does not answer is left to the AP
+/// route for a while.
+
+#ifndef PEER_H
+#define PEER_H
+
+#include <cnet.h>
+#include <stdbool.h>
+
+#define PEER_MAX 16               // The most mobiles tracked at once.
+#define PEER_ALPHA 0.25           // The weight of each new signal sample.
+#define PEER_INTERVAL 1000000     // Usecs between the beacons of a mobile.
+#define PEER_TIMEOUT (3 * PEER_INTERVAL)  // Usecs before a silent peer is lost.
+#define PEER_GOOD_RSSI -70.0      // The weakest signal (dBm) that we send over.
+#define PEER_HOLDDOWN 10000000    // Usecs that a failed peer is sent via the AP.
+
+/// This struct holds what a mobile knows about another mobile in range.
+///
+struct peer {
+  // True iff this entry holds a mobile.
+  bool used;
+
+  // The mobile, and the NIC address of its WiFi link.
+  CnetAddr addr;
+  CnetNICaddr nic;
+
+  // The smoothed signal strength of the mobile's beacons (dBm), and the time
+  // that we last heard one.
+  double rssi;
+  CnetTime heard;
+
+  // Packets for the mobile go through our AP until this time.
+  CnetTime failed_until;
+};
+
+/// Clear the peer table. Called when a mobile reboots.
+///
+void peer_init(void);
+
+/// Record a beacon heard from the mobile addr, sent by nic with a signal of
+/// rssi dBm.
+///
+void peer_heard(CnetAddr addr, const CnetNICaddr nic, double rssi);
+
+/// Returns the entry of addr if packets for it should be sent directly: we
+/// have heard it within PEER_TIMEOUT, at PEER_GOOD_RSSI or better, and it has
+/// not failed within PEER_HOLDDOWN. Returns NULL otherwise.
+///
+const struct peer *peer_direct(CnetAddr addr);
+
+/// Record that packets sent directly to addr went unanswered, so that they go
+/// through our AP for the next PEER_HOLDDOWN usecs.
+///
+void peer_failed(CnetAddr addr);
+
+#endif // PEER_H
@@ -0,0 +1,120 @@
+/// This file implements the polling scheduler kept by each access point. The
+/// mobiles are polled round-robin, from the entry after the one polled last.
+
+#include "poll.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+#include <string.h>
+
+static struct poll_entry table[POLL_MOBILES];
+
+// The entry that was granted last, the time of the grant, and whether the
+// grant is still in progress.
+static int last = POLL_MOBILES - 1;
+static CnetTime granted_at = 0;
+static bool granted = false;
+
+// The scheduler counters reported at shutdown.
+static int grants = 0;
+static int expiries = 0;
+static CnetTime total_wait = 0;
+static CnetTime total_burst = 0;
+
+/// Returns the entry of the given mobile, claiming a free one if it has none,
+/// or NULL if the table is full.
+///
+static struct poll_entry *find(CnetAddr mobile) {
+  struct poll_entry *spare = NULL;
+
+  for (int i = 0; i < POLL_MOBILES; ++i) {
+    if (table[i].used && table[i].mobile == mobile) return &table[i];
+
+    // An entry is only reused while it has no backlog, nor grant in progress.
+    if (spare == NULL && (!table[i].used || table[i].backlog == 0) &&
+        !(granted && i == last))
+      spare = &table[i];
+  }
+
+  if (spare == NULL) return NULL;
+
+  spare->used = true;
+  spare->mobile = mobile;
+  spare->backlog = 0;
+  return spare;
+}
+
+/// Clear the scheduler and its counters.
+///
+void poll_init(void) {
+  memset(table, 0, sizeof(table));
+  last = POLL_MOBILES - 1;
+  granted = false;
+
+  grants = 0;
+  expiries = 0;
+  total_wait = 0;
+  total_burst = 0;
+}
+
+/// Record a POLL packet from a mobile.
+///
+bool poll_request(CnetAddr mobile, int link, const CnetNICaddr nic, int backlog) {
+  struct poll_entry *entry = find(mobile);
+  if (entry == NULL) return false;
+
+  if (entry->backlog == 0 && backlog > 0)
+    entry->requested = nodeinfo.time_in_usec;
+  entry->backlog = backlog;
+  entry->link = link;
+  memcpy(entry->nic, nic, sizeof(CnetNICaddr));
+
+  if (!granted || entry != &table[last]) return false;
+
+  // A report from the mobile that we granted ends its burst.
+  granted = false;
+  total_burst += nodeinfo.time_in_usec - granted_at;
+  if (backlog > 0) entry->requested = nodeinfo.time_in_usec;
+  return true;
+}
+
+/// Grant the next mobile with a backlog.
+///
+const struct poll_entry *poll_next(void) {
+  for (int i = 1; i <= POLL_MOBILES; ++i) {
+    int next = (last + i) % POLL_MOBILES;
+    struct poll_entry *entry = &table[next];
+
+    if (!entry->used || entry->backlog == 0) continue;
+
+    last = next;
+    granted = true;
+    granted_at = nodeinfo.time_in_usec;
+    total_wait += nodeinfo.time_in_usec - entry->requested;
+    ++grants;
+    return entry;
+  }
+  return NULL;
+}
+
+/// Give up the current grant.
+///
+void poll_expired(void) {
+  if (!granted) return;
+
+  // The mobile may have gone; it asks again if it is still there.
+  granted = false;
+  table[last].backlog = 0;
+  total_burst += nodeinfo.time_in_usec - granted_at;
+  ++expiries;
+}
+
+/// Print the scheduler counters.
+///
+void poll_report(void) {
+  printf("AP %" PRId32 ": %d polls granted, %d expired, mean wait %" PRId64
+         " usecs, mean burst %" PRId64 " usecs.\n", nodeinfo.address,
+         grants, expiries,
+         (int64_t)(grants > 0 ? total_wait / grants : 0),
+         (int64_t)(grants > 0 ? total_burst / grants : 0));
+}
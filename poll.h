@@ -0,0 +1,67 @@
+/// This file declares the polling scheduler kept by each access point. Rather
+/// than contending for the air, a mobile queues its frames for the AP and
+/// sends a POLL packet that reports how many it holds. The AP grants each
+/// mobile with a backlog a burst of up to POLL_GRANT frames in turn, with a
+/// POLL packet of its own. The mobile sends its burst and then reports its
+/// remaining backlog, which ends its grant; a grant that is not ended within
+/// the time the burst should take is given up.
+///
+/// The payload of a POLL packet is one byte: the backlog reported by a mobile,
+/// or the frames granted to it by its AP. A grant goes on with the AP's
+/// credits (see credit.h).
+
+#ifndef POLL_H
+#define POLL_H
+
+#include <cnet.h>
+#include <stdbool.h>
+
+#define EV_POLL EV_TIMER6
+
+#define POLL_MOBILES 32           // Mobiles that an AP can poll at once.
+#define POLL_GRANT 4              // Frames that a mobile may send per poll.
+#define POLL_SLOT 2500            // Usecs allowed for each frame granted.
+#define POLL_RETRY 50000          // Usecs before a mobile repeats its request.
+#define POLL_PAYLOAD_LENGTH 1     // Bytes in the payload of a POLL packet.
+
+/// This struct holds what an AP knows about the backlog of one mobile.
+///
+struct poll_entry {
+  // True iff this entry holds a mobile.
+  bool used;
+
+  // The mobile, and the link and NIC address that it is polled on.
+  CnetAddr mobile;
+  int link;
+  CnetNICaddr nic;
+
+  // The frames that the mobile last said it holds for us, and the time that
+  // it first asked to be polled for them.
+  int backlog;
+  CnetTime requested;
+};
+
+/// Clear the scheduler and its counters. Called when an access point reboots.
+///
+void poll_init(void);
+
+/// Record a POLL packet from mobile, heard on link from nic, that reports the
+/// given backlog. Returns true iff it ends the mobile's grant.
+///
+bool poll_request(CnetAddr mobile, int link, const CnetNICaddr nic, int backlog);
+
+/// Grant the next mobile with a backlog, in round-robin order, and return its
+/// entry; or return NULL if no mobile has a backlog.
+///
+const struct poll_entry *poll_next(void);
+
+/// Give up the current grant, as the mobile has not ended it in time.
+///
+void poll_expired(void);
+
+/// Print the scheduler counters: the grants made, those given up, and the
+/// mean times that mobiles waited for a grant and took to use it.
+///
+void poll_report(void);
+
+#endif // POLL_H
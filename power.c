@@ -0,0 +1,108 @@
+/// This file implements the transmit power control of a WiFi link. The power
+/// for each receiver is kept in a small table; a receiver that we have not
+/// heard from for longest gives up its entry to a new one.
+
+#include "power.h"
+
+#include <cnet.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/// Reset the given state.
+///
+void power_init(struct power_state *state, double max) {
+  memset(state, 0, sizeof(*state));
+  state->max = max;
+}
+
+/// Returns the margin by which a frame was heard.
+///
+int power_margin(const WLANINFO *info, double signal) {
+  double margin = signal - (info->rx_sensitivity_dBm + info->rx_signal_to_noise_dBm);
+  if (margin < -127.0) return -127;
+  if (margin > 127.0) return 127;
+  return (int)lround(margin);
+}
+
+/// Returns the index of the entry of nic, or -1 if it has none.
+///
+static int find(const struct power_state *state, const CnetNICaddr nic) {
+  for (int i = 0; i < POWER_PEERS; ++i) {
+    const struct power_peer *peer = &state->peers[i];
+    if (peer->used && memcmp(peer->nic, nic, sizeof(CnetNICaddr)) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/// Returns the entry of nic, claiming a free entry or the one heard from least
+/// recently if it has none.
+///
+static struct power_peer *claim(struct power_state *state, const CnetNICaddr nic) {
+  int found = find(state, nic);
+  if (found >= 0) return &state->peers[found];
+
+  struct power_peer *spare = &state->peers[0];
+  for (int i = 0; i < POWER_PEERS; ++i) {
+    struct power_peer *p = &state->peers[i];
+    if (!p->used) {
+      spare = p;
+      break;
+    }
+    if (p->heard < spare->heard) spare = p;
+  }
+
+  spare->used = true;
+  memcpy(spare->nic, nic, sizeof(CnetNICaddr));
+  spare->power = state->max;
+  return spare;
+}
+
+/// Returns the power to send a frame to nic with.
+///
+double power_for(const struct power_state *state, const CnetNICaddr nic) {
+  int found = find(state, nic);
+  return found >= 0 ? state->peers[found].power : state->max;
+}
+
+/// Take the power that a reported margin calls for.
+///
+void power_reported(struct power_state *state,
+                    const CnetNICaddr nic,
+                    double sent,
+                    int margin) {
+  if (margin == POWER_MARGIN_UNKNOWN) return;
+
+  struct power_peer *peer = claim(state, nic);
+  double power = sent - margin + POWER_SAFETY;
+  if (power < POWER_MIN) power = POWER_MIN;
+  if (power > state->max) power = state->max;
+
+  peer->power = power;
+  peer->heard = nodeinfo.time_in_usec;
+  ++state->reports;
+  state->power_sum += power;
+}
+
+/// Raise our power to nic after a loss.
+///
+void power_lost(struct power_state *state, const CnetNICaddr nic) {
+  int found = find(state, nic);
+  if (found < 0) return;
+
+  struct power_peer *peer = &state->peers[found];
+  if (peer->power >= state->max) return;
+
+  peer->power += POWER_LOSS_STEP;
+  if (peer->power > state->max) peer->power = state->max;
+  ++state->losses;
+}
+
+/// Print the power control counters.
+///
+void power_report(const struct power_state *state, int link) {
+  double mean = state->reports > 0 ? state->power_sum / state->reports : state->max;
+  printf("WIFI link %d: %d margins reported, %d losses, mean power %.1f dBm "
+         "of %.1f.\n", link, state->reports, state->losses, mean, state->max);
+}
@@ -0,0 +1,78 @@
+/// This file declares the transmit power control of a WiFi link. Each data
+/// frame is sent with no more power than its receiver needs: the margin by which a
+/// receiver heard us, above the strength that it needs to decode a frame
+/// (its sensitivity plus its signal-to-noise ratio), is reported back to us,
+/// and the next frames to it are sent with that much less power, less
+/// POWER_SAFETY. Quieter cells let their neighbours transmit at the same time.
+/// Frames to receivers that have not reported, broadcasts and RTS/CTS control
+/// frames are sent with the full power of the link, so that reservations reach
+/// every node that could otherwise be hidden from an exchange.
+
+#ifndef POWER_H
+#define POWER_H
+
+#include <cnet.h>
+#include <stdbool.h>
+
+#define POWER_PEERS 16            // Receivers whose power we keep at once.
+#define POWER_SAFETY 6.0          // dB above the least power that we keep.
+#define POWER_MIN -10.0           // dBm below which we never go.
+#define POWER_LOSS_STEP 6.0       // dB that we add after each unanswered frame.
+#define POWER_MARGIN_UNKNOWN -128 // A reported margin that carries nothing.
+
+/// This struct holds the power that we send to one receiver with.
+///
+struct power_peer {
+  bool used;
+  CnetNICaddr nic;
+  CnetTime heard;
+  double power;
+};
+
+/// This struct holds the transmit power control of one link.
+///
+struct power_state {
+  // The full power of the link (dBm), and the receivers that have reported.
+  double max;
+  struct power_peer peers[POWER_PEERS];
+
+  // The margins reported to us and the losses that raised our power, and the
+  // sum of the power that they left us with, for the report.
+  int reports;
+  int losses;
+  double power_sum;
+};
+
+/// Reset the given state, for a link whose full power is max dBm.
+///
+void power_init(struct power_state *state, double max);
+
+/// Returns the margin (dB) by which a frame that arrived with the given
+/// signal strength (dBm) was heard, given the receiving link's parameters,
+/// rounded and clamped to fit a signed byte.
+///
+int power_margin(const WLANINFO *info, double signal);
+
+/// Returns the power (dBm) to send a frame to nic with.
+///
+double power_for(const struct power_state *state, const CnetNICaddr nic);
+
+/// Called when nic reports that it heard a frame that we sent with the given
+/// power (dBm) with the given margin (dB).
+///
+void power_reported(struct power_state *state,
+                    const CnetNICaddr nic,
+                    double sent,
+                    int margin);
+
+/// Called when a frame that we sent to nic went unanswered. Our power to nic
+/// is raised by POWER_LOSS_STEP, up to the full power of the link.
+///
+void power_lost(struct power_state *state, const CnetNICaddr nic);
+
+/// Print the margins reported to us, the losses, and the mean power that they
+/// left us with, for the given link.
+///
+void power_report(const struct power_state *state, int link);
+
+#endif // POWER_H
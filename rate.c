@@ -0,0 +1,154 @@
+/// This file implements the rate adaptation of a WiFi link. The rate of each
+/// receiver is kept in a small table; a receiver that we have not heard from
+/// for longest gives up its entry to a new one.
+
+#include "rate.h"
+
+#include <cnet.h>
+#include <stdio.h>
+#include <string.h>
+
+/// This struct describes one rate: its speed, in the Mbps of 802.11a, and
+/// the margin above the slowest rate that it needs, from the differences
+/// between the receiver sensitivities that 802.11a requires of each rate.
+///
+struct rate_info {
+  int mbps;
+  int margin;
+};
+
+static const struct rate_info rates[RATE_COUNT] = {
+  { 6, 0 },
+  { 9, 1 },
+  { 12, 3 },
+  { 18, 5 },
+  { 24, 8 },
+  { 36, 12 },
+  { 48, 16 },
+  { 54, 17 }
+};
+
+/// Reset the given state.
+///
+void rate_init(struct rate_state *state, CnetInt64 base) {
+  memset(state, 0, sizeof(*state));
+  state->base = base;
+}
+
+/// Returns the margin that a rate needs.
+///
+int rate_margin(int rate) {
+  if (rate < 0) rate = 0;
+  if (rate >= RATE_COUNT) rate = RATE_COUNT - 1;
+  return rates[rate].margin;
+}
+
+/// Returns the bandwidth of a rate.
+///
+CnetInt64 rate_bandwidth(const struct rate_state *state, int rate) {
+  if (rate < 0) rate = 0;
+  if (rate >= RATE_COUNT) rate = RATE_COUNT - 1;
+  return state->base * rates[rate].mbps / rates[0].mbps;
+}
+
+/// Returns the index of the entry of nic, or -1 if it has none.
+///
+static int find(const struct rate_state *state, const CnetNICaddr nic) {
+  for (int i = 0; i < RATE_PEERS; ++i) {
+    const struct rate_peer *peer = &state->peers[i];
+    if (peer->used && memcmp(peer->nic, nic, sizeof(CnetNICaddr)) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/// Returns the entry of nic, claiming a free entry or the one heard from least
+/// recently if it has none.
+///
+static struct rate_peer *claim(struct rate_state *state, const CnetNICaddr nic) {
+  int found = find(state, nic);
+  if (found >= 0) return &state->peers[found];
+
+  struct rate_peer *spare = &state->peers[0];
+  for (int i = 0; i < RATE_PEERS; ++i) {
+    struct rate_peer *p = &state->peers[i];
+    if (!p->used) {
+      spare = p;
+      break;
+    }
+    if (p->heard < spare->heard) spare = p;
+  }
+
+  memset(spare, 0, sizeof(*spare));
+  spare->used = true;
+  memcpy(spare->nic, nic, sizeof(CnetNICaddr));
+  spare->cap = RATE_COUNT - 1;
+  return spare;
+}
+
+/// Returns the rate to send a frame to nic at.
+///
+int rate_for(const struct rate_state *state, const CnetNICaddr nic) {
+  int found = find(state, nic);
+  return found >= 0 ? state->peers[found].rate : 0;
+}
+
+/// Choose the rate that a reported margin allows.
+///
+int rate_reported(struct rate_state *state, const CnetNICaddr nic, int margin) {
+  struct rate_peer *peer = claim(state, nic);
+  peer->heard = nodeinfo.time_in_usec;
+  peer->margin = margin;
+
+  // After enough reports without a loss, try the next rate up.
+  if (peer->cap < RATE_COUNT - 1 && ++peer->probe >= RATE_PROBE) {
+    ++peer->cap;
+    peer->probe = 0;
+  }
+
+  int rate = 0;
+  while (rate < peer->cap && rates[rate + 1].margin + RATE_SAFETY <= margin)
+    ++rate;
+  peer->rate = rate;
+  return rate;
+}
+
+/// Count a frame sent.
+///
+void rate_sent(struct rate_state *state, const CnetNICaddr nic, int rate) {
+  int found = find(state, nic);
+  if (found >= 0) ++state->peers[found].sent[rate];
+}
+
+/// Step down a rate after a loss.
+///
+void rate_lost(struct rate_state *state, const CnetNICaddr nic) {
+  int found = find(state, nic);
+  if (found < 0) return;
+
+  struct rate_peer *peer = &state->peers[found];
+  ++peer->lost[peer->rate];
+  if (peer->rate > 0) --peer->rate;
+  peer->cap = peer->rate;
+  peer->probe = 0;
+}
+
+/// Print the rate table.
+///
+void rate_report(const struct rate_state *state, int link) {
+  for (int i = 0; i < RATE_PEERS; ++i) {
+    const struct rate_peer *peer = &state->peers[i];
+    if (!peer->used) continue;
+
+    printf("WIFI link %d: to %02x:%02x:%02x:%02x:%02x:%02x at %d Mbps "
+           "(margin %d dB), sent/lost:", link,
+           peer->nic[0], peer->nic[1], peer->nic[2],
+           peer->nic[3], peer->nic[4], peer->nic[5],
+           rates[peer->rate].mbps, peer->margin);
+    for (int rate = 0; rate < RATE_COUNT; ++rate) {
+      if (peer->sent[rate] > 0 || peer->lost[rate] > 0)
+        printf(" %d:%d/%d", rates[rate].mbps, peer->sent[rate], peer->lost[rate]);
+    }
+    printf("\n");
+  }
+}
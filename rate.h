@@ -0,0 +1,87 @@
+/// This file declares the rate adaptation of a WiFi link. Each receiver is
+/// sent frames at its own rate, chosen from RATE_COUNT rates modelled on those
+/// of 802.11a: the link's configured bandwidth is the slowest (6 Mbps), and
+/// each faster rate needs a stronger signal at the receiver, by the margin in
+/// rate_margin(). A receiver reports the margin by which it hears us (see
+/// power.h); the fastest rate whose margin that covers, less RATE_SAFETY, is
+/// used. Each loss steps the receiver down a rate, and caps it there until
+/// RATE_PROBE reports in a row allow the next rate up to be tried again.
+
+#ifndef RATE_H
+#define RATE_H
+
+#include <cnet.h>
+#include <stdbool.h>
+
+#define RATE_COUNT 8       // Rates that we choose from, from the slowest.
+#define RATE_PEERS 16      // Receivers whose rate we keep at once.
+#define RATE_SAFETY 3      // dB of margin that we keep beyond a rate's needs.
+#define RATE_PROBE 10      // Reports at the cap before we try a faster rate.
+
+/// This struct holds the rate that we send to one receiver with, and what we
+/// have sent it at each rate.
+///
+struct rate_peer {
+  bool used;
+  CnetNICaddr nic;
+  CnetTime heard;
+
+  // The rate that we send with now, and the fastest that we may use until
+  // enough reports have come since the last loss.
+  int rate;
+  int cap;
+  int probe;
+
+  // The last margin reported, at the full power of the link (dB).
+  int margin;
+
+  // The frames sent and the losses seen, at each rate.
+  int sent[RATE_COUNT];
+  int lost[RATE_COUNT];
+};
+
+/// This struct holds the rate adaptation of one link.
+///
+struct rate_state {
+  // The bandwidth of the slowest rate: the link's configured bandwidth.
+  CnetInt64 base;
+  struct rate_peer peers[RATE_PEERS];
+};
+
+/// Reset the given state, for a link whose configured bandwidth is base.
+///
+void rate_init(struct rate_state *state, CnetInt64 base);
+
+/// Returns the margin (dB) above that of the slowest rate that a receiver
+/// needs to decode a frame sent at the given rate.
+///
+int rate_margin(int rate);
+
+/// Returns the bandwidth of the given rate on the given link.
+///
+CnetInt64 rate_bandwidth(const struct rate_state *state, int rate);
+
+/// Returns the rate to send a frame to nic at. Receivers that have not
+/// reported are sent at the slowest rate.
+///
+int rate_for(const struct rate_state *state, const CnetNICaddr nic);
+
+/// Called when nic reports that it would hear us, at the full power of the
+/// link, with the given margin (dB). Returns the rate that nic is sent at now.
+///
+int rate_reported(struct rate_state *state, const CnetNICaddr nic, int margin);
+
+/// Called when a frame is sent to nic at the given rate.
+///
+void rate_sent(struct rate_state *state, const CnetNICaddr nic, int rate);
+
+/// Called when a frame to nic was lost. Steps nic down a rate.
+///
+void rate_lost(struct rate_state *state, const CnetNICaddr nic);
+
+/// Print the rate table of the given link: for each receiver, its rate and
+/// last margin, and the frames sent and lost at each rate.
+///
+void rate_report(const struct rate_state *state, int link);
+
+#endif // RATE_H
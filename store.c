@@ -0,0 +1,149 @@
+/// This file implements the downlink store kept by each access point. Each
+/// mobile has a ring of references to pool buffers, like the handoff buffer,
+/// but packets are only released when they are flushed or their TTL expires.
+
+#include "store.h"
+
+#include <cnet.h>
+#include <inttypes.h>
+
+/// This struct holds the packets waiting for one mobile.
+///
+struct store_queue {
+  bool used;
+  CnetAddr mobile;
+
+  // The held packets, oldest at head, and the times that they were held.
+  pkt_handle packets[STORE_DEPTH];
+  CnetTime held[STORE_DEPTH];
+  int head;
+  int count;
+};
+
+static struct store_queue queues[STORE_MOBILES];
+
+// The store counters reported at shutdown.
+static int held = 0;
+static int flushed = 0;
+static int expired = 0;
+static int overflowed = 0;
+
+/// Release the oldest packet held in the given queue.
+///
+static void drop_oldest(struct store_queue *q) {
+  pkt_release(q->packets[q->head]);
+  q->packets[q->head] = PKT_NULL;
+  q->head = (q->head + 1) % STORE_DEPTH;
+  --q->count;
+}
+
+/// Release the packets in the given queue whose TTL has run out, and free the
+/// queue if that empties it.
+///
+static void expire(struct store_queue *q) {
+  while (q->count > 0 &&
+         nodeinfo.time_in_usec - q->held[q->head] > STORE_TTL) {
+    drop_oldest(q);
+    ++expired;
+  }
+  if (q->count == 0) q->used = false;
+}
+
+/// Returns the queue for the given mobile. If it has none, then a free queue
+/// is claimed if claim is true.
+///
+static struct store_queue *find(CnetAddr mobile, bool claim) {
+  struct store_queue *spare = NULL;
+
+  for (int i = 0; i < STORE_MOBILES; ++i) {
+    struct store_queue *q = &queues[i];
+
+    if (q->used && q->mobile == mobile) return q;
+    if (q->used) expire(q);
+    if (spare == NULL && !q->used) spare = q;
+  }
+
+  if (!claim || spare == NULL) return NULL;
+
+  spare->used = true;
+  spare->mobile = mobile;
+  spare->head = 0;
+  spare->count = 0;
+  return spare;
+}
+
+/// Forget every held packet and clear the counters.
+///
+void store_init(void) {
+  for (int i = 0; i < STORE_MOBILES; ++i) {
+    queues[i].used = false;
+    queues[i].count = 0;
+    for (int j = 0; j < STORE_DEPTH; ++j) queues[i].packets[j] = PKT_NULL;
+  }
+
+  held = 0;
+  flushed = 0;
+  expired = 0;
+  overflowed = 0;
+}
+
+/// Returns true iff a mobile last heard at the given time is unreachable.
+///
+bool store_unreachable(CnetTime heard) {
+  return nodeinfo.time_in_usec - heard > STORE_SILENCE;
+}
+
+/// Hold a packet for mobile.
+///
+void store_hold(CnetAddr mobile, pkt_handle packet) {
+  struct store_queue *q = find(mobile, true);
+  if (q == NULL) {
+    ++overflowed;
+    return;
+  }
+
+  expire(q);
+  q->used = true;
+
+  if (q->count == STORE_DEPTH) {
+    drop_oldest(q);
+    ++overflowed;
+  }
+
+  int tail = (q->head + q->count) % STORE_DEPTH;
+  q->packets[tail] = pkt_ref(packet);
+  q->held[tail] = nodeinfo.time_in_usec;
+  ++q->count;
+  ++held;
+}
+
+/// Flush the packets held for mobile.
+///
+int store_flush(CnetAddr mobile, store_emit_fn emit, void *context) {
+  struct store_queue *q = find(mobile, false);
+  if (q == NULL) return 0;
+
+  expire(q);
+
+  int count = 0;
+  while (q->count > 0) {
+    (*emit)(q->packets[q->head], context);
+    drop_oldest(q);
+    ++count;
+  }
+  q->used = false;
+
+  flushed += count;
+  if (count > 0)
+    printf("STORE: flushed %d packets held for mobile %" PRId32 ".\n",
+           count, mobile);
+  return count;
+}
+
+/// Print the store counters.
+///
+void store_report(void) {
+  printf("AP %" PRId32 ": %d packets held for unreachable mobiles, %d flushed, "
+         "%d expired, %d overflowed.\n",
+         nodeinfo.address, held, flushed, expired, overflowed);
+}
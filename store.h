@@ -0,0 +1,55 @@
+/// This file declares the downlink store kept by each access point. When a
+/// mobile that we serve falls silent (it has walked behind walls, or out of
+/// range), the packets for it are held here rather than sent into the air to
+/// be lost. They are flushed to the mobile when we hear from it again, or to
+/// its new AP if it turns up elsewhere. A mobile sends an ASSOC to its AP
+/// whenever it has been silent for ASSOC_KEEPALIVE, so silence means trouble.
+
+#ifndef STORE_H
+#define STORE_H
+
+#include "association.h"
+#include "packet_pool.h"
+
+#include <cnet.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define STORE_MOBILES 16                      // Mobiles whose packets are held at once.
+#define STORE_DEPTH 16                        // Packets held for each mobile.
+#define STORE_TTL 10000000                    // Usecs for which a packet is held.
+#define STORE_SILENCE (4 * ASSOC_KEEPALIVE)   // Usecs of silence before a mobile
+                                              // is thought unreachable.
+
+/// The type of function that is given each packet flushed by store_flush.
+/// The buffer remains owned by store_flush.
+///
+typedef void (*store_emit_fn)(pkt_handle packet, void *context);
+
+/// Forget every held packet and clear the counters. Called when an access
+/// point reboots, after its pool has been reset.
+///
+void store_init(void);
+
+/// Returns true iff a mobile that we last heard at the given time should be
+/// thought unreachable, so that packets for it are held.
+///
+bool store_unreachable(CnetTime heard);
+
+/// Hold the packet in the given buffer for mobile, by taking a reference to
+/// it. The oldest packet held for the mobile is dropped if its store is full,
+/// or the packet itself if no store is free.
+///
+void store_hold(CnetAddr mobile, pkt_handle packet);
+
+/// Pass each packet held for mobile that has not expired to emit, oldest
+/// first, then release them all. Returns the number of packets passed to emit.
+///
+int store_flush(CnetAddr mobile, store_emit_fn emit, void *context);
+
+/// Print the store counters: the packets held, flushed, and dropped because
+/// they expired or would not fit.
+///
+void store_report(void);
+
+#endif // STORE_H
@@ -19,16 +19,18 @@
 static	CnetTimerID	tid		= NULLTIMER;
 static	bool		paused		= true;
 
+//  THE WALK IN PROGRESS, WHICH walking_predict() REPORTS
+static	char		FENCE_A[1000];
+static	double		dx	= 0.0;
+static	double		dy	= 0.0;
+static	double		newx	= 0.0;
+static	double		newy	= 0.0;
+static	int		nsteps	= 0;
+static	CnetTime	nextstep = 0;	// when the next step will be taken
+static	char		FENCE_B[1000];
+
 static EVENT_HANDLER(walkingstyle)
 {
-    static	char		FENCE_A[1000];
-    static	double		dx	= 0.0;
-    static	double		dy	= 0.0;
-    static	double		newx	= 0.0;
-    static	double		newy	= 0.0;
-    static	int		nsteps	= 0;
-    static	char		FENCE_B[1000];
-
     for (size_t i = 0; i < 1000; ++i) {
       if (FENCE_A[i])
         fprintf(stdout, "FENCE_A damaged %d: %c.\n", (int)i, FENCE_A[i]);
@@ -90,6 +92,7 @@ static EVENT_HANDLER(walkingstyle)
     }
 
 //  RESCHEDULE THIS WALKING EVENT
+    nextstep = nodeinfo.time_in_usec + movenext;
     tid	= CNET_start_timer(EV_WALKING, movenext, data);
 }
 
@@ -123,3 +126,23 @@ bool am_walking(void)
 {
   return (paused == false);
 }
+
+void walking_predict(CnetTime ahead, CnetPosition *where)
+{
+  CHECK(CNET_get_position(where, NULL));
+  if (paused || nsteps <= 0)
+    return;
+
+  // Count the steps that will have been taken by then, one per WALK_FREQUENCY
+  // from the next, up to the end of the walk.
+  CnetTime until = nextstep - nodeinfo.time_in_usec;
+  if (ahead < until)
+    return;
+
+  int steps = 1 + (int)((ahead - until) / WALK_FREQUENCY);
+  if (steps > nsteps)
+    steps = nsteps;
+
+  where->x = (int)lround(newx + steps * dx);
+  where->y = (int)lround(newy + steps * dy);
+}
@@ -11,4 +11,9 @@ extern	void	start_walking(void);
 extern	void	stop_walking(void);
 extern	bool	am_walking(void);
 
+/// Predict where we will be ahead usecs from now, if we keep to our walk (or
+/// stay where we are, if we are paused).
+///
+extern	void	walking_predict(CnetTime ahead, CnetPosition *where);
+
 #endif // WALKING_H